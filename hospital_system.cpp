@@ -1,7 +1,7 @@
 // hospital_system.cpp
-// Build with: clang++ -std=gnu++14 hospital_system.cpp -o hospital_system
-// Or: g++ -std=gnu++14 hospital_system.cpp -o hospital_system
-// Run: ./hospital_system
+// Build with: clang++ -std=gnu++14 -pthread hospital_system.cpp -o hospital_system
+// Or: g++ -std=gnu++14 -pthread hospital_system.cpp -o hospital_system
+// Run: ./hospital_system   (or --bench for the benchmark suite, --shm-serve <name> for local kiosks)
 
 #include <iostream>
 #include <string>
@@ -9,22 +9,189 @@
 #include <queue>
 #include <stack>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
+#include <array>
+#include <map>
+#include <tuple>
+#include <climits>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define HOSPITAL_HAVE_SHM 1
+#define HOSPITAL_HAVE_MMAP 1
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
 
 using namespace std;
 
 /*
  Hospital Appointment & Triage System
  - Doctor schedules: singly linked list (SlotNode)
- - Routine appointments: per-doctor circular queue (vector buffer)
+ - Routine appointments: per-doctor circular queue (vector buffer, or std::array
+   when built with -DHOSPITAL_FIXED_QUEUE_CAP=<power of two>)
+ - Optional persistent mode: routine rings and slot state in a memory-mapped file
  - Emergency triage: min-heap (priority_queue with greater comparator)
- - Patient index: unordered_map<int, Patient>
- - Undo log: stack<Action>
+ - Patient store: dense rows + open-addressing id -> row index, tombstones, incremental compaction;
+   tokens carry a checked row handle so the serve path skips the index
+ - Big arenas (patient rows/index, token index, triage heap, slot pool): optional huge pages + prefault
+ - Undo log: deque of recent actions, older ones spilled to a file as LZ-packed delta blocks
+ - Failure counters: refusals by reason per doctor and per thread, merged on read
+ - Routine classes: per-doctor walk-in ring per class (priority, follow-up, standard) + non-empty bitmask
+ - Group sessions: per-doctor capacity-N session slots, batch check-in/serve with one undo record per batch
+ - Cohort bitmaps: roaring bitmaps of patient ids by age band, pending token, triaged today, specialization seen
+ - Operation log: raw active segment, sealed segments delta-varint encoded + LZ compressed
+ - Variable-length appointments: per-doctor free-time treap with coalescing, first-fit in O(log n)
+ - Overbooking: per-doctor weekday-hour no-show counts set how many tokens a slot may hold
+ - Slot claims: taken flag + token id in one atomic word, booked by compare-and-swap from any thread
+ - Doctor timeline: min-heap of booked slots by start time, merged with walk-ins by policy and clock
+ - Resource calendars: per-resource free-interval map; bookings leapfrog doctor slots and resources
+ - Checkpoints: full base plus chained deltas of dirty doctors/patients/appointments
+ - Slow-op watchdog: per-operation latency budgets, over-budget calls logged to a fixed ring
+ - Cold patient history: LZ-packed (optionally with a trained dictionary), unpacked on read or mutation
+ - State checksum: order-independent sum of per-record hashes, updated per mutation
+ - Local clients: per-client SPSC submission/completion rings in POSIX shared memory
+ - Multi-facility front: one HospitalSystem shard per worker thread, routed by facility id
  Note: this file targets C++14 (no std::optional).
 */
 
+// ----------------------------- Spinning -----------------------------
+// Spin briefly, then yield; on a single CPU spinning only delays the other side.
+inline void cpuRelax(int& spins) {
+    static const int spinLimit = thread::hardware_concurrency() > 1 ? 1024 : 1;
+    if (++spins < spinLimit) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else { spins = 0; this_thread::yield(); }
+}
+
+// After the n-th lost compare-and-swap in a row: pause about 2^n cycles
+// (capped), so threads that collided spread out instead of colliding again.
+inline void contentionBackoff(int losses) {
+    int spins = 0, rounds = 1 << min(losses, 10);
+    for (int i = 0; i < rounds; ++i) cpuRelax(spins);
+}
+
+// ----------------------------- Huge Pages -----------------------------
+// Backing for the big lookup arenas (patient rows and index, token index,
+// triage heap, slot pool). Requests of kArenaMinBytes or more are mapped
+// directly in 2 MiB-aligned multiples of 2 MiB and, per hugePageConfig(),
+// placed on explicit huge pages (MAP_HUGETLB, falling back to small pages
+// when none are reserved) or offered to transparent huge pages
+// (MADV_HUGEPAGE); with prefault every page is touched before use, so
+// lookups never take the first-touch fault. Smaller requests go to
+// operator new. The mode applies to arenas allocated after it is set.
+enum HugePageMode { HUGEPAGES_OFF, HUGEPAGES_TRANSPARENT, HUGEPAGES_EXPLICIT };
+
+struct HugePageConfig {
+    HugePageMode mode = HUGEPAGES_OFF;
+    bool prefault = false;
+};
+
+struct HugePageStats {
+    atomic<size_t> mappedBytes{0}; // arena bytes currently mapped
+    atomic<size_t> hugeTlbMaps{0}; // arenas placed on MAP_HUGETLB pages
+    atomic<size_t> fallbacks{0};   // explicit requests that got small pages
+};
+
+inline HugePageConfig& hugePageConfig() { static HugePageConfig c; return c; }
+inline HugePageStats& hugePageStats() { static HugePageStats s; return s; }
+
+const size_t kHugePageBytes = size_t(2) << 20;
+const size_t kArenaMinBytes = size_t(1) << 20;
+
+inline size_t arenaRound(size_t bytes) { return (bytes + kHugePageBytes - 1) & ~(kHugePageBytes - 1); }
+
+inline void* arenaMap(size_t bytes) {
+#ifdef HOSPITAL_HAVE_MMAP
+    const HugePageConfig cfg = hugePageConfig();
+    size_t len = arenaRound(bytes);
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (cfg.mode == HUGEPAGES_EXPLICIT) {
+        p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        ++(p != MAP_FAILED ? hugePageStats().hugeTlbMaps : hugePageStats().fallbacks);
+    }
+#endif
+    if (p == MAP_FAILED) {
+        // over-map by one huge page and trim, so the arena starts 2 MiB aligned
+        char* raw = (char*)mmap(nullptr, len + kHugePageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == (char*)MAP_FAILED) throw bad_alloc();
+        char* aligned = (char*)(((uintptr_t)raw + kHugePageBytes - 1) & ~(uintptr_t)(kHugePageBytes - 1));
+        if (aligned > raw) munmap(raw, aligned - raw);
+        if (aligned + len < raw + len + kHugePageBytes) munmap(aligned + len, raw + len + kHugePageBytes - (aligned + len));
+        p = aligned;
+#ifdef MADV_HUGEPAGE
+        if (cfg.mode != HUGEPAGES_OFF) madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+    if (cfg.prefault)
+        for (size_t off = 0; off < len; off += 4096) ((volatile char*)p)[off] = 0;
+    hugePageStats().mappedBytes += len;
+    return p;
+#else
+    return ::operator new(bytes);
+#endif
+}
+
+inline void arenaUnmap(void* p, size_t bytes) {
+#ifdef HOSPITAL_HAVE_MMAP
+    munmap(p, arenaRound(bytes));
+    hugePageStats().mappedBytes -= arenaRound(bytes);
+#else
+    (void)bytes;
+    ::operator delete(p);
+#endif
+}
+
+// Standard allocator over arenaMap for containers that can grow large.
+template <class T>
+struct HugePageAllocator {
+    typedef T value_type;
+    HugePageAllocator() = default;
+    template <class U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = n * sizeof(T);
+        return (T*)(bytes >= kArenaMinBytes ? arenaMap(bytes) : ::operator new(bytes));
+    }
+    void deallocate(T* p, size_t n) {
+        size_t bytes = n * sizeof(T);
+        if (bytes >= kArenaMinBytes) arenaUnmap(p, bytes);
+        else ::operator delete(p);
+    }
+};
+template <class T, class U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
 // ----------------------------- ADTs -----------------------------
-enum TokenType { ROUTINE, EMERGENCY };
+enum TokenType : uint8_t { ROUTINE, EMERGENCY };
 
 struct Patient {
     int id = 0;
@@ -40,398 +207,5980 @@ struct Token {
     int doctorId = -1;
     int slotId = -1; // -1 if not slot-based
     TokenType type = ROUTINE;
+    uint8_t routineClass = 0; // RoutineClass of a walk-in, chosen at enqueue
+    int patientHandle = -1;   // PatientStore handle of patientId when issued, see PatientStore::resolve
 };
 
+// "HH:MM" -> minutes since midnight, or -1 if malformed.
+inline int parseClock(const string& t) {
+    int h = 0, m = 0;
+    if (sscanf(t.c_str(), "%d:%d", &h, &m) != 2 || h < 0 || h > 23 || m < 0 || m > 59) return -1;
+    return h * 60 + m;
+}
+
+const int kWeekdays = 7;
+const int kHeatBuckets = kWeekdays * 24; // one bucket per weekday-hour
+const char* const kWeekdayNames[kWeekdays] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+
 // Singly linked list node for slots
 struct SlotNode {
     int slotId;
     string startTime;
     string endTime;
-    bool taken;
-    int tokenId;
+    // taken flag (bit 32) and token id (low 32 bits) in one word, so booking
+    // is a single compare-and-swap (see Doctor::claimFirstFreeAfter)
+    atomic<uint64_t> state;
+    int weekday;   // 0 = Monday
+    int startMin;  // minutes since midnight, -1 if startTime is malformed
+    int endMin;
+    vector<int> overbooked; // tokens booked past tokenId, in booking order; not kept by PersistentQueueStore
+    unsigned bookingSeq = 0; // bumped on every booking, see Doctor::noteBooked
     SlotNode* next;
-    SlotNode(int sid, const string& s, const string& e)
-        : slotId(sid), startTime(s), endTime(e), taken(false), tokenId(-1), next(nullptr) {}
+    SlotNode(int sid, const string& s, const string& e, int day = 0)
+        : slotId(sid), startTime(s), endTime(e), state(pack(false, -1)),
+          weekday(day >= 0 && day < kWeekdays ? day : 0), startMin(parseClock(s)), endMin(parseClock(e)), next(nullptr) {}
+
+    int heatBucket() const { return weekday * 24 + (startMin < 0 ? 0 : startMin / 60); }
+    bool timed() const { return startMin >= 0 && endMin > startMin; }
+    int weekStart() const { return weekday * 1440 + startMin; }
+    int weekEnd() const { return weekday * 1440 + endMin; }
+
+    static uint64_t pack(bool taken, int tokenId) { return (taken ? 1ull << 32 : 0) | (uint32_t)tokenId; }
+    bool taken() const { return (state.load(memory_order_acquire) >> 32) != 0; }
+    int tokenId() const { return (int)(uint32_t)state.load(memory_order_acquire); }
+    void setState(bool taken, int tokenId) { state.store(pack(taken, tokenId), memory_order_release); }
+
+    // Takes a free slot for tokenId; false if someone else holds it.
+    bool tryClaim(int tokenId) {
+        uint64_t cur = state.load(memory_order_relaxed);
+        while (!(cur >> 32))
+            if (state.compare_exchange_weak(cur, pack(true, tokenId), memory_order_acq_rel, memory_order_relaxed)) return true;
+        return false;
+    }
+
+    // Nodes come from SlotPool, see below.
+    static void* operator new(size_t bytes);
+    static void operator delete(void* p);
 };
 
-// ----------------------------- Doctor -----------------------------
-struct Doctor {
-    int id = 0;
-    string name;
-    string specialization;
-    SlotNode* slotHead = nullptr;
-    vector<Token> circBuffer;
-    int frontIdx = 0, rearIdx = -1;
-    int capacity = 10;
-    int sizeQ = 0;
+// SlotNodes packed into 2 MiB arena chunks (huge pages when enabled), so
+// slot walks stay within a few TLB entries. Freed cells go on a free list;
+// chunks live as long as the process. One pool per thread, so shards on
+// their own workers never contend and need no lock; a node freed on another
+// thread simply joins that thread's free list.
+class SlotPool {
+private:
+    void* freeList = nullptr;
+    char* bump = nullptr;
+    size_t bumpLeft = 0;
 
-    Doctor() = default;
-    Doctor(int _id, const string& _name, const string& _spec, int cap = 10)
-        : id(_id), name(_name), specialization(_spec), slotHead(nullptr), circBuffer(cap),
-          capacity(cap), frontIdx(0), rearIdx(-1), sizeQ(0) {}
+public:
+    static SlotPool& instance() { static thread_local SlotPool* pool = new SlotPool(); return *pool; }
 
-    ~Doctor() {
-        SlotNode* cur = slotHead;
-        while (cur) {
-            SlotNode* nxt = cur->next;
-            delete cur;
-            cur = nxt;
+    void* take() {
+        if (freeList) { void* p = freeList; freeList = *(void**)p; return p; }
+        if (bumpLeft < sizeof(SlotNode)) { bump = (char*)arenaMap(kHugePageBytes); bumpLeft = kHugePageBytes; }
+        void* p = bump;
+        bump += sizeof(SlotNode); bumpLeft -= sizeof(SlotNode);
+        return p;
+    }
+    void give(void* p) {
+        *(void**)p = freeList; freeList = p;
+    }
+};
+
+inline void* SlotNode::operator new(size_t) { return SlotPool::instance().take(); }
+inline void SlotNode::operator delete(void* p) { if (p) SlotPool::instance().give(p); }
+
+// weekday + "HH:MM" -> minutes since Monday 00:00, or -1.
+inline int weekMinute(int weekday, const string& clock) {
+    int m = parseClock(clock);
+    if (m < 0 || weekday < 0 || weekday >= kWeekdays) return -1;
+    return weekday * 1440 + m;
+}
+
+// Per-specialization slot counters by weekday-hour. booked/free are current
+// gauges; served/noShow accumulate.
+struct SlotBucketCounts {
+    int booked = 0;
+    int free = 0;
+    int served = 0;
+    int noShow = 0;
+};
+
+struct SlotHeatmap {
+    array<SlotBucketCounts, kHeatBuckets> buckets;
+};
+
+// Per-doctor attendance of slot-booked patients by weekday-hour, the input
+// to overbooking.
+struct SlotAttendance {
+    int shows = 0;
+    int noShows = 0;
+};
+
+// ----------------------------- Patient Store -----------------------------
+// Open-addressing int -> int map (linear probing, backward-shift erase) in
+// one flat arena: a hit touches one or two cache lines and one page, which
+// huge pages keep in the TLB. Load stays at or below one half. Keys must
+// not be INT_MIN (marks an empty entry).
+class IdIndex {
+private:
+    struct Entry { int key; int value; };
+    vector<Entry, HugePageAllocator<Entry>> table; // power-of-two size
+    size_t used = 0;
+    int shift = 64;
+
+    size_t home(int key) const { return (size_t)(((uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ull) >> shift); }
+    size_t probe(int key) const { // entry holding key, or the empty entry ending its run
+        size_t m = table.size() - 1, i = home(key);
+        while (table[i].key != key && table[i].key != INT_MIN) i = (i + 1) & m;
+        return i;
+    }
+    void rehash(size_t cap) {
+        vector<Entry, HugePageAllocator<Entry>> old(cap, Entry{INT_MIN, 0});
+        old.swap(table);
+        shift = 64;
+        for (size_t c = cap; c > 1; c >>= 1) --shift;
+        for (const Entry& e : old)
+            if (e.key != INT_MIN) table[probe(e.key)] = e;
+    }
+
+public:
+    int* find(int key) {
+        if (table.empty()) return nullptr;
+        Entry& e = table[probe(key)];
+        return e.key == INT_MIN ? nullptr : &e.value;
+    }
+    const int* find(int key) const { return const_cast<IdIndex*>(this)->find(key); }
+    bool count(int key) const { return find(key) != nullptr; }
+
+    // Value for key, inserted as 0 if missing.
+    int& operator[](int key) {
+        if ((used + 1) * 2 > table.size()) rehash(max<size_t>(16, table.size() * 2));
+        Entry& e = table[probe(key)];
+        if (e.key == INT_MIN) { e.key = key; e.value = 0; ++used; }
+        return e.value;
+    }
+
+    bool erase(int key) {
+        if (table.empty()) return false;
+        size_t m = table.size() - 1, i = probe(key);
+        if (table[i].key == INT_MIN) return false;
+        // pull later entries of the run back unless that would move one before its home
+        for (size_t j = (i + 1) & m; table[j].key != INT_MIN; j = (j + 1) & m) {
+            size_t k = home(table[j].key);
+            if (((j - k) & m) >= ((j - i) & m)) { table[i] = table[j]; i = j; }
         }
-        slotHead = nullptr;
+        table[i].key = INT_MIN;
+        --used;
+        return true;
     }
 
-    bool isFull() const { return sizeQ == capacity; }
-    bool isEmpty() const { return sizeQ == 0; }
+    void reserve(size_t n) {
+        size_t cap = 16;
+        while (cap < n * 2) cap <<= 1;
+        if (cap > table.size()) rehash(cap);
+    }
+    void clear() { fill(table.begin(), table.end(), Entry{INT_MIN, 0}); used = 0; }
+    size_t size() const { return used; }
 
-    bool enqueueRoutine(const Token& t) {
-        if (isFull()) return false;
+    template <class F>
+    void forEach(F f) const {
+        for (const Entry& e : table) if (e.key != INT_MIN) f(e.key, e.value);
+    }
+};
+
+// Patients in a dense row vector with an id -> row index. Deleting leaves a
+// tombstone (dead row, index entry gone) whose row is reused by the next
+// insert. Once tombstones pass a quarter of the rows, compactStep() moves
+// live rows from the tail into holes a few at a time, so reclaiming space
+// never stops the desk for a full rebuild.
+class PatientStore {
+private:
+    enum { kRowLive = 1, kRowCold = 2 };
+    vector<Patient, HugePageAllocator<Patient>> rows;
+    vector<uint8_t, HugePageAllocator<uint8_t>> live;   // kRow* flags, 0 = dead
+    struct RowMeta {
+        uint64_t touched = 0;    // clock of the row's last mutation, 0 = never
+        uint64_t fieldsHash = 0; // caller's hash of the row minus freq, 0 = not cached
+    };
+    vector<RowMeta, HugePageAllocator<RowMeta>> meta;
+    vector<int> holes;              // dead rows, may include rows already trimmed off the tail
+    IdIndex index;                  // id -> row
+    size_t dead = 0;
+    bool compacting = false;        // from a quarter of rows dead until none are
+
+    void trimTail() {
+        while (!rows.empty() && !live.back()) { rows.pop_back(); live.pop_back(); meta.pop_back(); --dead; }
+    }
+
+public:
+    Patient* find(int id) {
+        int* row = index.find(id);
+        return row ? &rows[*row] : nullptr;
+    }
+    const Patient* find(int id) const {
+        const int* row = index.find(id);
+        return row ? &rows[*row] : nullptr;
+    }
+    bool count(int id) const { return index.count(id); }
+
+    // Patients are also addressed by handle, their row number. A handle is
+    // kept next to the id (Token::patientHandle) and stays good until the row
+    // is compacted away or the patient deleted; resolve checks it against the
+    // id and falls back to the index, refreshing the handle.
+    Patient* find(int id, int& handle) {
+        int* row = index.find(id);
+        handle = row ? *row : -1;
+        return row ? &rows[*row] : nullptr;
+    }
+    Patient* resolve(int& handle, int id) {
+        if ((size_t)handle < rows.size() && live[handle] && rows[handle].id == id) return &rows[handle];
+        return find(id, handle);
+    }
+
+    // Cold rows have their history packed away by HospitalSystem.
+    bool isCold(int handle) const { return live[handle] & kRowCold; }
+    void setCold(int id, bool cold) {
+        if (int* row = index.find(id)) live[*row] = cold ? (kRowLive | kRowCold) : kRowLive;
+    }
+
+    // Stamps the row with clock and returns the previous stamp.
+    uint64_t touch(int handle, uint64_t clock) { uint64_t was = meta[handle].touched; meta[handle].touched = clock; return was; }
+    void touchAll(uint64_t clock) {
+        for (size_t i = 0; i < rows.size(); ++i) if (live[i]) meta[i].touched = clock;
+    }
+    uint64_t lastTouch(int id) const {
+        const int* row = index.find(id);
+        return row ? meta[*row].touched : 0;
+    }
+
+    // Hash of every field but freq, kept for the owner. upsert hands out a
+    // writable row, so it drops the cached value.
+    uint64_t fieldsHash(int handle) const { return meta[handle].fieldsHash; }
+    void setFieldsHash(int handle, uint64_t h) { meta[handle].fieldsHash = h; }
+
+    // Row for id, created empty if missing.
+    Patient& upsert(int id) {
+        if (int* at = index.find(id)) { meta[*at].fieldsHash = 0; return rows[*at]; }
+        int row = -1;
+        while (!holes.empty() && row < 0) {
+            int h = holes.back(); holes.pop_back();
+            if (h < (int)rows.size() && !live[h]) row = h;
+        }
+        if (row < 0) { row = (int)rows.size(); rows.push_back(Patient()); live.push_back(kRowLive); meta.push_back(RowMeta()); }
+        else { live[row] = kRowLive; meta[row] = RowMeta(); --dead; }
+        rows[row] = Patient(); rows[row].id = id;
+        index[id] = row;
+        return rows[row];
+    }
+
+    bool erase(int id) {
+        int* at = index.find(id);
+        if (!at) return false;
+        int row = *at;
+        index.erase(id);
+        rows[row] = Patient(); rows[row].id = id; // releases the strings
+        live[row] = 0; meta[row] = RowMeta(); ++dead;
+        holes.push_back(row);
+        trimTail();
+        if (dead * 4 > rows.size()) compacting = true;
+        return true;
+    }
+
+    void clear() { rows.clear(); live.clear(); meta.clear(); holes.clear(); index.clear(); dead = 0; compacting = false; }
+    void reserve(size_t n) { rows.reserve(n); live.reserve(n); meta.reserve(n); index.reserve(n); }
+
+    size_t size() const { return index.size(); }
+    size_t rowCount() const { return rows.size(); }
+    size_t tombstones() const { return dead; }
+    bool needsCompaction() const { return compacting; }
+
+    // Moves up to maxMoves live rows from the tail into holes; returns the
+    // number moved. Storage is given back once the rows shrink to a quarter
+    // of their capacity.
+    size_t compactStep(size_t maxMoves) {
+        size_t moved = 0;
+        while (moved < maxMoves && dead > 0 && !holes.empty()) {
+            int h = holes.back(); holes.pop_back();
+            if (h >= (int)rows.size() || live[h]) continue;
+            // the tail row is live: trimTail runs after every erase and move
+            int from = (int)rows.size() - 1;
+            rows[h] = move(rows[from]); live[h] = live[from]; meta[h] = meta[from];
+            index[rows[h].id] = h;
+            rows.pop_back(); live.pop_back(); meta.pop_back(); --dead;
+            trimTail();
+            ++moved;
+        }
+        if (dead == 0) { holes.clear(); compacting = false; }
+        if (rows.capacity() > 64 && rows.size() * 4 < rows.capacity()) { rows.shrink_to_fit(); live.shrink_to_fit(); meta.shrink_to_fit(); }
+        return moved;
+    }
+
+    template <class F>
+    void forEach(F f) {
+        for (size_t i = 0; i < rows.size(); ++i) if (live[i]) f(rows[i]);
+    }
+    template <class F>
+    void forEach(F f) const {
+        for (size_t i = 0; i < rows.size(); ++i) if (live[i]) f(rows[i]);
+    }
+};
+
+// ----------------------------- Cohort Bitmaps -----------------------------
+// Compressed id set in the roaring layout: ids split on their high 16 bits
+// into containers kept sorted by key, each holding the low halves either as
+// a sorted array (up to kArrayMax of them, 2 bytes apiece) or as a 65536-bit
+// bitmap (8 KiB). A bitmap goes back to an array only once removals halve
+// that, so a cohort hovering at the threshold does not convert on every
+// change. Set operations run container by container, so a sparse cohort
+// costs as little as a dense one.
+class RoaringBitmap {
+private:
+    // Without -mpopcnt __builtin_popcountll is a libgcc call; this inlines.
+    static int bitCount(uint64_t x) {
+        x -= (x >> 1) & 0x5555555555555555ull;
+        x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+        x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+        return (int)((x * 0x0101010101010101ull) >> 56);
+    }
+
+    static const uint32_t kArrayMax = 4096;
+    static const int kWords = 1024;
+    struct Container {
+        uint16_t key = 0;
+        uint32_t card = 0;
+        vector<uint16_t> array; // sorted, never more than kArrayMax
+        vector<uint64_t> words; // kWords of them, or none while an array
+
+        bool isBitmap() const { return !words.empty(); }
+        bool has(uint16_t v) const {
+            if (isBitmap()) return (words[v >> 6] >> (v & 63)) & 1;
+            return binary_search(array.begin(), array.end(), v);
+        }
+        void toBitmap() {
+            words.assign(kWords, 0);
+            for (uint16_t v : array) words[v >> 6] |= 1ull << (v & 63);
+            vector<uint16_t>().swap(array);
+        }
+        void toArray() {
+            array.clear(); array.reserve(card);
+            for (int w = 0; w < kWords; ++w)
+                for (uint64_t b = words[w]; b; b &= b - 1) array.push_back((uint16_t)(w * 64 + __builtin_ctzll(b)));
+            vector<uint64_t>().swap(words);
+        }
+        void recount() {
+            card = 0;
+            for (uint64_t w : words) card += bitCount(w);
+        }
+        bool add(uint16_t v) {
+            if (isBitmap()) {
+                uint64_t& w = words[v >> 6], bit = 1ull << (v & 63);
+                if (w & bit) return false;
+                w |= bit; ++card; return true;
+            }
+            auto at = lower_bound(array.begin(), array.end(), v);
+            if (at != array.end() && *at == v) return false;
+            array.insert(at, v); ++card;
+            if (card > kArrayMax) toBitmap();
+            return true;
+        }
+        bool remove(uint16_t v) {
+            if (isBitmap()) {
+                uint64_t& w = words[v >> 6], bit = 1ull << (v & 63);
+                if (!(w & bit)) return false;
+                w &= ~bit; --card;
+                if (card <= kArrayMax / 2) toArray();
+                return true;
+            }
+            auto at = lower_bound(array.begin(), array.end(), v);
+            if (at == array.end() || *at != v) return false;
+            array.erase(at); --card;
+            return true;
+        }
+        void orWith(const Container& o) {
+            if (o.isBitmap()) {
+                if (!isBitmap()) toBitmap();
+                for (int w = 0; w < kWords; ++w) words[w] |= o.words[w];
+                recount();
+            } else if (isBitmap()) {
+                for (uint16_t v : o.array) {
+                    uint64_t& w = words[v >> 6], bit = 1ull << (v & 63);
+                    if (!(w & bit)) { w |= bit; ++card; }
+                }
+            } else {
+                vector<uint16_t> merged; merged.reserve(array.size() + o.array.size());
+                set_union(array.begin(), array.end(), o.array.begin(), o.array.end(), back_inserter(merged));
+                array.swap(merged); card = (uint32_t)array.size();
+                if (card > kArrayMax) toBitmap();
+            }
+        }
+        void andWith(const Container& o) {
+            if (isBitmap() && o.isBitmap()) {
+                for (int w = 0; w < kWords; ++w) words[w] &= o.words[w];
+                recount();
+                if (card <= kArrayMax) toArray();
+                return;
+            }
+            if (!isBitmap()) { // filter the array in place
+                size_t k = 0;
+                if (o.isBitmap()) {
+                    for (uint16_t v : array) { array[k] = v; k += (o.words[v >> 6] >> (v & 63)) & 1; }
+                } else {
+                    auto b = o.array.begin();
+                    for (uint16_t v : array) {
+                        while (b != o.array.end() && *b < v) ++b;
+                        if (b == o.array.end()) break;
+                        if (*b == v) array[k++] = v;
+                    }
+                }
+                array.resize(k); card = (uint32_t)k;
+                return;
+            }
+            vector<uint16_t> kept(o.array.size());
+            size_t k = 0;
+            for (uint16_t v : o.array) { kept[k] = v; k += (words[v >> 6] >> (v & 63)) & 1; }
+            kept.resize(k);
+            vector<uint64_t>().swap(words);
+            array.swap(kept); card = (uint32_t)k;
+        }
+        uint64_t andCount(const Container& o) const {
+            uint64_t n = 0;
+            if (isBitmap() && o.isBitmap()) {
+                for (int w = 0; w < kWords; ++w) n += bitCount(words[w] & o.words[w]);
+            } else if (isBitmap() || o.isBitmap()) {
+                const Container& arr = isBitmap() ? o : *this;
+                const Container& bits = isBitmap() ? *this : o;
+                for (uint16_t v : arr.array) n += (bits.words[v >> 6] >> (v & 63)) & 1;
+            } else {
+                auto a = array.begin(), b = o.array.begin();
+                while (a != array.end() && b != o.array.end()) {
+                    if (*a < *b) ++a; else if (*b < *a) ++b; else { ++n; ++a; ++b; }
+                }
+            }
+            return n;
+        }
+    };
+    vector<Container> cs; // sorted by key, none empty
+
+    size_t slot(uint16_t key) const { // first container with key >= key
+        size_t lo = 0, hi = cs.size();
+        while (lo < hi) { size_t mid = (lo + hi) / 2; if (cs[mid].key < key) lo = mid + 1; else hi = mid; }
+        return lo;
+    }
+
+public:
+    bool add(uint32_t x) {
+        uint16_t key = (uint16_t)(x >> 16);
+        size_t i = slot(key);
+        if (i == cs.size() || cs[i].key != key) { cs.insert(cs.begin() + i, Container()); cs[i].key = key; }
+        return cs[i].add((uint16_t)x);
+    }
+    bool remove(uint32_t x) {
+        uint16_t key = (uint16_t)(x >> 16);
+        size_t i = slot(key);
+        if (i == cs.size() || cs[i].key != key || !cs[i].remove((uint16_t)x)) return false;
+        if (cs[i].card == 0) cs.erase(cs.begin() + i);
+        return true;
+    }
+    bool contains(uint32_t x) const {
+        uint16_t key = (uint16_t)(x >> 16);
+        size_t i = slot(key);
+        return i < cs.size() && cs[i].key == key && cs[i].has((uint16_t)x);
+    }
+    uint64_t cardinality() const {
+        uint64_t n = 0;
+        for (const Container& c : cs) n += c.card;
+        return n;
+    }
+    bool empty() const { return cs.empty(); }
+    void clear() { cs.clear(); }
+    size_t bytes() const {
+        size_t n = cs.capacity() * sizeof(Container);
+        for (const Container& c : cs) n += c.array.capacity() * sizeof(uint16_t) + c.words.capacity() * sizeof(uint64_t);
+        return n;
+    }
+
+    void orWith(const RoaringBitmap& o) {
+        vector<Container> out; out.reserve(cs.size() + o.cs.size());
+        size_t i = 0, j = 0;
+        while (i < cs.size() || j < o.cs.size()) {
+            if (j == o.cs.size() || (i < cs.size() && cs[i].key < o.cs[j].key)) out.push_back(move(cs[i++]));
+            else if (i == cs.size() || o.cs[j].key < cs[i].key) out.push_back(o.cs[j++]);
+            else { cs[i].orWith(o.cs[j++]); out.push_back(move(cs[i++])); }
+        }
+        cs.swap(out);
+    }
+    void andWith(const RoaringBitmap& o) {
+        size_t keep = 0, j = 0;
+        for (size_t i = 0; i < cs.size(); ++i) {
+            while (j < o.cs.size() && o.cs[j].key < cs[i].key) ++j;
+            if (j == o.cs.size() || o.cs[j].key != cs[i].key) continue;
+            cs[i].andWith(o.cs[j]);
+            if (cs[i].card) { if (keep != i) cs[keep] = move(cs[i]); ++keep; }
+        }
+        cs.resize(keep);
+    }
+    // |a AND b| without building the intersection.
+    static uint64_t andCount(const RoaringBitmap& a, const RoaringBitmap& b) {
+        uint64_t n = 0;
+        size_t i = 0, j = 0;
+        while (i < a.cs.size() && j < b.cs.size()) {
+            if (a.cs[i].key < b.cs[j].key) ++i;
+            else if (b.cs[j].key < a.cs[i].key) ++j;
+            else n += a.cs[i++].andCount(b.cs[j++]);
+        }
+        return n;
+    }
+
+    // Calls f(id) in ascending order; stops early when f returns false.
+    template <class F>
+    void forEach(F f) const {
+        for (const Container& c : cs) {
+            uint32_t high = (uint32_t)c.key << 16;
+            if (!c.isBitmap()) { for (uint16_t v : c.array) if (!f(high | v)) return; continue; }
+            for (int w = 0; w < kWords; ++w)
+                for (uint64_t b = c.words[w]; b; b &= b - 1)
+                    if (!f(high | (uint32_t)(w * 64 + __builtin_ctzll(b)))) return;
+        }
+    }
+};
+
+// A bitmap of the ids with a positive event count, so undoing one event
+// leaves the id in place while others remain.
+struct CountedBitmap {
+    RoaringBitmap bits;
+    IdIndex counts;
+
+    void inc(int id) { if (++counts[id] == 1) bits.add((uint32_t)id); }
+    void dec(int id) {
+        int* n = counts.find(id);
+        if (!n) return;
+        if (--*n == 0) { counts.erase(id); bits.remove((uint32_t)id); }
+    }
+    void clear() { bits.clear(); counts.clear(); }
+};
+
+// Patients are banded by age in kAgeBandYears steps; the last band is open.
+const int kAgeBandYears = 10;
+const int kAgeBands = 10;
+inline int ageBand(int age) { return age < 0 ? 0 : min(age / kAgeBandYears, kAgeBands - 1); }
+
+// Filters for HospitalSystem::cohortCount; every set filter must hold.
+// Ages match by band, so minAge 35 takes in the whole 30-39 band.
+struct CohortQuery {
+    int minAge = 0, maxAge = INT_MAX;
+    bool pending = false;      // holds a walk-in, slot, triage, group or appointment token
+    bool triagedToday = false; // triaged since the day began
+    string seenBy;             // served by a doctor of this specialization, "" = any
+};
+
+// ----------------------------- Visit History -----------------------------
+enum VisitKind : uint8_t { VISIT_WALK_IN, VISIT_SLOT, VISIT_EMERGENCY, VISIT_GROUP, VISIT_APPOINTMENT };
+const char* const kVisitKindNames[] = { "walk-in", "slot", "emergency", "group", "appointment" };
+
+struct VisitRecord {
+    int64_t at = 0; // microseconds since epoch
+    int tokenId = -1, patientId = -1, doctorId = -1;
+    int slotId = -1; // slot or group session, -1 for walk-ins and emergencies
+    VisitKind kind = VISIT_WALK_IN;
+};
+
+// Append-only log of served visits, keeping the newest `retention` in a
+// ring, with a per-patient index into it: a chain of 64-byte chunks of log
+// sequence numbers, newest chunk first, taken from one arena with a free
+// list. Reading a patient's last k visits walks k entries, and a serve
+// appends one number to the head chunk. Chains keep at least perPatient
+// visits (whole chunks, so a few more) and drop chunks once the ring has
+// overwritten all their visits, so memory is bounded by the retention.
+class VisitHistory {
+private:
+    static const int kPerChunk = 7;
+    struct Chunk {
+        uint64_t seqs[kPerChunk]; // oldest first
+        int next = -1;            // older chunk, or the next free one
+        uint16_t used = 0;
+        uint16_t chainLen = 0;    // chunks in the chain, kept on its head
+    };
+    vector<VisitRecord> ring;          // seq s lives at s % cap; grows up to cap
+    size_t cap = 1 << 18;
+    uint64_t firstSeq = 0, endSeq = 0; // live visits are [firstSeq, endSeq)
+    size_t perPatient = 64;
+    vector<Chunk, HugePageAllocator<Chunk>> chunks;
+    int freeChunk = -1;
+    size_t chunksInUse = 0;
+    IdIndex heads; // patient id -> head chunk
+
+    size_t maxChain() const { return (perPatient + kPerChunk - 1) / kPerChunk + 1; }
+    int allocChunk() {
+        int c = freeChunk;
+        if (c != -1) freeChunk = chunks[c].next;
+        else { c = (int)chunks.size(); chunks.push_back(Chunk()); }
+        chunks[c] = Chunk();
+        ++chunksInUse;
+        return c;
+    }
+    void freeChain(int c) {
+        while (c != -1) {
+            int older = chunks[c].next;
+            chunks[c].next = freeChunk; freeChunk = c; --chunksInUse;
+            c = older;
+        }
+    }
+    // Cuts the patient's chain after maxChain() chunks and before the
+    // first chunk whose visits have all left the ring.
+    void trim(int patientId) {
+        int* h = heads.find(patientId);
+        if (!h) return;
+        int head = *h, c = head, prev = -1;
+        uint16_t len = 0;
+        while (c != -1 && len < maxChain() && chunks[c].seqs[chunks[c].used - 1] >= firstSeq) { prev = c; c = chunks[c].next; ++len; }
+        if (c == -1) return;
+        if (prev == -1) { heads.erase(patientId); freeChain(c); return; }
+        chunks[prev].next = -1; chunks[head].chainLen = len;
+        freeChain(c);
+    }
+
+public:
+    // Keeps the newest maxVisits visits (0 turns the history off) and at
+    // least perPatient of each patient's. Shrinking drops the oldest.
+    void setRetention(size_t maxVisits, size_t perPatientVisits) {
+        vector<VisitRecord> live;
+        for (uint64_t s = firstSeq; s < endSeq; ++s) live.push_back(ring[s % cap]);
+        clear();
+        vector<VisitRecord>().swap(ring);
+        cap = maxVisits;
+        perPatient = min<size_t>(max<size_t>(perPatientVisits, 1), (size_t)kPerChunk * 60000); // chainLen is 16 bits
+        for (const VisitRecord& v : live) append(v);
+    }
+    void clear() {
+        firstSeq = endSeq = 0;
+        chunks.clear(); freeChunk = -1; chunksInUse = 0;
+        heads.clear();
+    }
+
+    void append(const VisitRecord& v) {
+        if (!cap) return;
+        if (endSeq - firstSeq == cap) { // overwrite the oldest
+            int oldest = ring[firstSeq % cap].patientId;
+            ++firstSeq;
+            trim(oldest);
+        }
+        uint64_t seq = endSeq++;
+        if (seq % cap < ring.size()) ring[seq % cap] = v; else ring.push_back(v);
+        int* h = heads.find(v.patientId);
+        int head = h ? *h : -1;
+        if (head != -1 && chunks[head].used < kPerChunk) { chunks[head].seqs[chunks[head].used++] = seq; return; }
+        int c = allocChunk();
+        chunks[c].seqs[0] = seq; chunks[c].used = 1; chunks[c].next = head;
+        chunks[c].chainLen = (uint16_t)(head == -1 ? 1 : chunks[head].chainLen + 1);
+        heads[v.patientId] = c;
+        if (chunks[c].chainLen > maxChain()) trim(v.patientId);
+    }
+
+    // Takes back the newest visit if it is tokenId's, for undo of a serve.
+    bool popNewest(int tokenId) {
+        if (endSeq == firstSeq || ring[(endSeq - 1) % cap].tokenId != tokenId) return false;
+        uint64_t seq = --endSeq;
+        int patientId = ring[seq % cap].patientId;
+        int* h = heads.find(patientId);
+        if (!h) return true;
+        int head = *h;
+        Chunk& c = chunks[head];
+        if (c.seqs[c.used - 1] != seq) return true;
+        if (!--c.used) {
+            int older = c.next;
+            if (older == -1) { heads.erase(patientId); c.next = -1; freeChain(head); return true; }
+            chunks[older].chainLen = (uint16_t)(c.chainLen - 1); *h = older;
+            c.next = -1; freeChain(head);
+        }
+        trim(patientId); // what is left may already have left the ring
+        return true;
+    }
+
+    // The patient's last k visits still retained, newest first.
+    size_t recent(int patientId, size_t k, vector<VisitRecord>& out) const {
+        out.clear();
+        const int* h = heads.find(patientId);
+        for (int c = h ? *h : -1; c != -1 && out.size() < k; c = chunks[c].next)
+            for (int i = chunks[c].used - 1; i >= 0 && out.size() < k; --i) {
+                uint64_t s = chunks[c].seqs[i];
+                if (s < firstSeq) return out.size();
+                out.push_back(ring[s % cap]);
+            }
+        return out.size();
+    }
+
+    size_t size() const { return (size_t)(endSeq - firstSeq); }
+    size_t retention() const { return cap; }
+    size_t chunkCount() const { return chunksInUse; }
+    size_t bytes() const { return ring.capacity() * sizeof(VisitRecord) + chunks.capacity() * sizeof(Chunk); }
+};
+
+// ----------------------------- Free-Time Allocator -----------------------------
+// A doctor's bookable time as disjoint [start, end) gaps (minutes of the week)
+// in a treap keyed by start. Every node also stores the longest gap in its
+// subtree, so first-fit for a length follows a single path down the tree.
+// Freeing time merges it with touching neighbours, like a free-list allocator
+// that coalesces on release. Nodes live in a vector pool, so copies are deep.
+class FreeTimeTree {
+private:
+    struct Node {
+        int start, end, maxLen;
+        uint32_t prio;
+        int l, r;
+    };
+    vector<Node> nodes;
+    vector<int> freeNodes;
+    int root = -1;
+    int gaps = 0;
+    uint32_t rngState = 0x2545F491u;
+
+    int len(int n) const { return nodes[n].end - nodes[n].start; }
+    int maxLen(int n) const { return n < 0 ? 0 : nodes[n].maxLen; }
+    void pull(int n) { nodes[n].maxLen = max(len(n), max(maxLen(nodes[n].l), maxLen(nodes[n].r))); }
+
+    int newNode(int start, int end) {
+        rngState ^= rngState << 13; rngState ^= rngState >> 17; rngState ^= rngState << 5;
+        Node nd{start, end, end - start, rngState, -1, -1};
+        if (!freeNodes.empty()) { int i = freeNodes.back(); freeNodes.pop_back(); nodes[i] = nd; return i; }
+        nodes.push_back(nd);
+        return (int)nodes.size() - 1;
+    }
+
+    // Splits t into keys < key and keys >= key.
+    void split(int t, int key, int& a, int& b) {
+        if (t < 0) { a = b = -1; return; }
+        if (nodes[t].start < key) { split(nodes[t].r, key, nodes[t].r, b); a = t; }
+        else { split(nodes[t].l, key, a, nodes[t].l); b = t; }
+        pull(t);
+    }
+
+    int merge(int a, int b) {
+        if (a < 0) return b;
+        if (b < 0) return a;
+        if (nodes[a].prio > nodes[b].prio) { nodes[a].r = merge(nodes[a].r, b); pull(a); return a; }
+        nodes[b].l = merge(a, nodes[b].l); pull(b); return b;
+    }
+
+    void insertGap(int start, int end) {
+        int a, b; split(root, start, a, b);
+        root = merge(merge(a, newNode(start, end)), b);
+        ++gaps;
+    }
+
+    void eraseGap(int start) {
+        int a, b, mid, c; split(root, start, a, b); split(b, start + 1, mid, c);
+        if (mid >= 0) { freeNodes.push_back(mid); --gaps; }
+        root = merge(a, c);
+    }
+
+    // Gap with the largest start <= x, or -1.
+    int floorGap(int x) const {
+        int t = root, best = -1;
+        while (t >= 0) {
+            if (nodes[t].start <= x) { best = t; t = nodes[t].r; }
+            else t = nodes[t].l;
+        }
+        return best;
+    }
+
+    // Leftmost gap with start >= from and length >= need, or -1.
+    int firstFit(int t, int from, int need) const {
+        if (t < 0 || nodes[t].maxLen < need) return -1;
+        if (nodes[t].start >= from) {
+            int res = firstFit(nodes[t].l, from, need);
+            if (res >= 0) return res;
+            if (len(t) >= need) return t;
+        }
+        return firstFit(nodes[t].r, from, need);
+    }
+
+public:
+    int gapCount() const { return gaps; }
+    int longestGap() const { return maxLen(root); }
+
+    void addFree(int start, int end) {
+        if (start >= end) return;
+        int p = floorGap(start);
+        if (p >= 0 && nodes[p].end >= start) {
+            start = nodes[p].start; end = max(end, nodes[p].end);
+            eraseGap(start);
+        }
+        while (true) {
+            int n = floorGap(end);
+            if (n < 0 || nodes[n].start < start) break;
+            end = max(end, nodes[n].end);
+            eraseGap(nodes[n].start);
+        }
+        insertGap(start, end);
+    }
+
+    // Removes [start, end) from the gap that contains it.
+    bool reserve(int start, int end) {
+        int g = floorGap(start);
+        if (g < 0 || nodes[g].end < end || start >= end) return false;
+        int gs = nodes[g].start, ge = nodes[g].end;
+        eraseGap(gs);
+        if (gs < start) insertGap(gs, start);
+        if (end < ge) insertGap(end, ge);
+        return true;
+    }
+
+    // Earliest t >= from with [t, t + need) free, or -1.
+    int earliestFit(int from, int need) const {
+        int g = floorGap(from);
+        if (g >= 0 && nodes[g].start < from && nodes[g].end - from >= need) return from;
+        int f = firstFit(root, from, need);
+        return f < 0 ? -1 : nodes[f].start;
+    }
+};
+
+// A variable-length booking carved out of a doctor's FreeTimeTree.
+struct Appointment {
+    int doctorId = -1;
+    int patientId = -1;
+    int start = 0, end = 0;
+};
+
+// ----------------------------- Routine Rings -----------------------------
+// Circular queue with capacity chosen at runtime (vector buffer).
+struct DynamicRoutineRing {
+    vector<Token> buf;
+    int frontIdx = 0, rearIdx = -1;
+    int capacity = 10;
+    int sizeQ = 0;
+
+    explicit DynamicRoutineRing(int cap = 10) : buf(cap), capacity(cap) {}
+
+    bool full() const { return sizeQ == capacity; }
+    bool empty() const { return sizeQ == 0; }
+    int size() const { return sizeQ; }
+    int limit() const { return capacity; }
+
+    bool push(const Token& t) {
+        if (full()) return false;
         rearIdx = (rearIdx + 1) % capacity;
-        circBuffer[rearIdx] = t;
+        buf[rearIdx] = t;
         sizeQ++;
         return true;
     }
 
-    bool dequeueRoutine(Token& out) {
-        if (isEmpty()) return false;
-        out = circBuffer[frontIdx];
+    bool pop(Token& out) {
+        if (empty()) return false;
+        out = buf[frontIdx];
         frontIdx = (frontIdx + 1) % capacity;
         sizeQ--;
         if (sizeQ == 0) { frontIdx = 0; rearIdx = -1; }
         return true;
     }
 
-    bool peekRoutine(Token& out) const {
-        if (isEmpty()) return false;
-        out = circBuffer[frontIdx];
+    bool peek(Token& out) const {
+        if (empty()) return false;
+        out = buf[frontIdx];
         return true;
     }
 
-    int pendingCount() const { return sizeQ; }
+    // Undo support: put a served token back at the head, take the newest off the tail.
+    bool pushFront(const Token& t) {
+        if (full()) return false;
+        frontIdx = (frontIdx + capacity - 1) % capacity;
+        if (sizeQ == 0) rearIdx = frontIdx;
+        buf[frontIdx] = t;
+        sizeQ++;
+        return true;
+    }
 
-    void insertSlot(int slotId, const string& s, const string& e) {
-        SlotNode* node = new SlotNode(slotId, s, e);
-        if (!slotHead) { slotHead = node; return; }
-        SlotNode* cur = slotHead;
-        while (cur->next) cur = cur->next;
-        cur->next = node;
+    bool popRear(Token& out) {
+        if (empty()) return false;
+        out = buf[rearIdx];
+        rearIdx = (rearIdx + capacity - 1) % capacity;
+        sizeQ--;
+        if (sizeQ == 0) { frontIdx = 0; rearIdx = -1; }
+        return true;
     }
 
-    bool cancelSlot(int slotId) {
-        SlotNode* cur = slotHead;
-        SlotNode* prev = nullptr;
-        while (cur) {
-            if (cur->slotId == slotId) {
-                if (prev) prev->next = cur->next;
-                else slotHead = cur->next;
-                delete cur;
-                return true;
-            }
+    bool peekRear(Token& out) const {
+        if (empty()) return false;
+        out = buf[rearIdx];
+        return true;
+    }
+
+    template <class F>
+    void forEach(F f) const {
+        for (int i = 0, idx = frontIdx; i < sizeQ; ++i, idx = (idx + 1) % capacity) f(buf[idx]);
+    }
+};
+
+// Circular queue with storage fixed at compile time. N must be a power of two:
+// head/tail are free-running counters masked with N-1, so no division per op.
+// A doctor configured with a smaller capacity is limited to that many entries.
+template <size_t N>
+struct FixedRoutineRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "FixedRoutineRing capacity must be a power of two");
+    static const uint32_t kMask = (uint32_t)N - 1;
+    array<Token, N> buf;
+    uint32_t head = 0, tail = 0;
+    uint32_t cap = (uint32_t)N;
+
+    explicit FixedRoutineRing(int c = (int)N) : cap(c > 0 && (size_t)c < N ? (uint32_t)c : (uint32_t)N) {}
+
+    bool full() const { return tail - head == cap; }
+    bool empty() const { return tail == head; }
+    int size() const { return (int)(tail - head); }
+    int limit() const { return (int)cap; }
+
+    bool push(const Token& t) {
+        if (full()) return false;
+        buf[tail & kMask] = t;
+        ++tail;
+        return true;
+    }
+
+    bool pop(Token& out) {
+        if (empty()) return false;
+        out = buf[head & kMask];
+        ++head;
+        return true;
+    }
+
+    bool peek(Token& out) const {
+        if (empty()) return false;
+        out = buf[head & kMask];
+        return true;
+    }
+
+    bool pushFront(const Token& t) {
+        if (full()) return false;
+        --head;
+        buf[head & kMask] = t;
+        return true;
+    }
+
+    bool popRear(Token& out) {
+        if (empty()) return false;
+        --tail;
+        out = buf[tail & kMask];
+        return true;
+    }
+
+    bool peekRear(Token& out) const {
+        if (empty()) return false;
+        out = buf[(tail - 1) & kMask];
+        return true;
+    }
+
+    template <class F>
+    void forEach(F f) const {
+        for (uint32_t i = head; i != tail; ++i) f(buf[i & kMask]);
+    }
+};
+
+#ifdef HOSPITAL_FIXED_QUEUE_CAP
+typedef FixedRoutineRing<HOSPITAL_FIXED_QUEUE_CAP> RoutineRing;
+#else
+typedef DynamicRoutineRing RoutineRing;
+#endif
+
+// ----------------------------- Routine Classes -----------------------------
+// Each doctor keeps one walk-in ring per class; serveNext takes from the
+// lowest non-empty class (a bitmask makes that O(1)) and FIFO within it.
+// The doctor's capacity is shared by all classes.
+enum RoutineClass { ROUTINE_PRIORITY, ROUTINE_FOLLOW_UP, ROUTINE_STANDARD, ROUTINE_CLASS_COUNT };
+const char* const kRoutineClassNames[] = { "priority", "follow-up", "standard" };
+
+// Booking flags for enqueueRoutine walk-ins.
+enum WalkInFlag { WALKIN_FOLLOW_UP = 1, WALKIN_PRIORITY = 2 };
+
+struct RoutineClassPolicy {
+    int elderlyFromAge = 75;    // this age and older: priority class
+    int pediatricBelowAge = 12; // younger than this: priority class
+};
+
+inline RoutineClass routineClassFor(const Patient& p, unsigned walkInFlags, const RoutineClassPolicy& policy) {
+    if ((walkInFlags & WALKIN_PRIORITY) || p.age >= policy.elderlyFromAge || p.age < policy.pediatricBelowAge) return ROUTINE_PRIORITY;
+    if (walkInFlags & WALKIN_FOLLOW_UP) return ROUTINE_FOLLOW_UP;
+    return ROUTINE_STANDARD;
+}
+
+// ----------------------------- Persistent Queue Store -----------------------------
+// Routine rings and slot taken-state kept in a memory-mapped file, so a
+// restarted process recovers them by mapping the file again.
+//
+// Update protocol: a token is written into its ring entry before the tail is
+// published (release store), and the head moves only after the entry is read,
+// so the live indices in the page cache are always consistent and survive a
+// process crash. Every syncEvery writes the whole mapping is msync'ed and
+// then the live indices are copied to durableHead/durableTail and synced
+// again; after a machine restart (different boot id) recovery rolls back to
+// those. Entries between durableHead and the live head are not reused before
+// the next sync, so the rolled-back range is never overwritten.
+//
+// Each (doctor, routine class) pair has its own region; slot states live in
+// the doctor's class-0 region, one entry per slot plus one per overbooked
+// token. Entries of cancelled slots are reused.
+#ifdef HOSPITAL_HAVE_MMAP
+class PersistentQueueStore;
+
+struct MappedQueueHeader {
+    int32_t doctorId;
+    uint32_t capacity;
+    atomic<uint32_t> head;
+    atomic<uint32_t> tail;
+    uint32_t durableHead;
+    uint32_t durableTail;
+    uint32_t slotCount;
+    uint32_t routineClass;
+};
+
+// state: 0 free slot, 1 taken slot, kOverbookedState + i the slot's i-th
+// overbooked token. slotId kFreeEntry marks an entry open for reuse.
+struct alignas(16) PersistedSlot {
+    int32_t slotId;
+    int32_t tokenId;
+    uint32_t state;
+    int32_t patientId;
+};
+const int32_t kFreeEntry = INT32_MIN;
+const uint32_t kOverbookedState = 2;
+
+class MappedRoutineRing {
+private:
+    MappedQueueHeader* hdr;
+    Token* entries;
+    uint32_t physical; // entries in the file, power of two
+    uint32_t cap;      // logical capacity for this doctor
+    PersistentQueueStore* owner;
+
+public:
+    MappedRoutineRing(MappedQueueHeader* h, Token* e, uint32_t phys, uint32_t c, PersistentQueueStore* o)
+        : hdr(h), entries(e), physical(phys), cap(c < phys ? c : phys), owner(o) {}
+
+    bool full() const { return size() >= (int)cap; }
+    bool empty() const { return hdr->head.load(memory_order_relaxed) == hdr->tail.load(memory_order_relaxed); }
+    int size() const { return (int)(hdr->tail.load(memory_order_relaxed) - hdr->head.load(memory_order_relaxed)); }
+    int limit() const { return (int)cap; }
+
+    inline bool push(const Token& t);
+    inline bool pop(Token& out);
+    inline bool pushFront(const Token& t);
+    inline bool popRear(Token& out);
+
+    bool peek(Token& out) const {
+        if (empty()) return false;
+        out = entries[hdr->head.load(memory_order_relaxed) & (physical - 1)];
+        return true;
+    }
+
+    bool peekRear(Token& out) const {
+        if (empty()) return false;
+        out = entries[(hdr->tail.load(memory_order_relaxed) - 1) & (physical - 1)];
+        return true;
+    }
+
+    template <class F>
+    void forEach(F f) const {
+        uint32_t end = hdr->tail.load(memory_order_relaxed);
+        for (uint32_t i = hdr->head.load(memory_order_relaxed); i != end; ++i) f(entries[i & (physical - 1)]);
+    }
+};
+
+class PersistentQueueStore {
+private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t maxDoctors;
+        uint32_t ringEntries;
+        uint32_t slotEntries;
+        uint32_t doctorsUsed;
+        char bootId[40];
+    };
+    static const uint32_t kMagic = 0x48505153; // "HPQS"
+    static const uint32_t kVersion = 4;        // 2: per-class regions, 3: Token::patientHandle, 4: slot patients, overbooking
+    static const size_t kHeaderBytes = 4096;
+
+    int fd = -1;
+    uint8_t* base = nullptr;
+    size_t mappedBytes = 0;
+    size_t regionBytes = 0;
+    uint32_t syncEvery = 64;
+    uint32_t writesSinceSync = 0;
+    bool recoveredFile = false;
+    vector<unique_ptr<MappedRoutineRing>> rings;        // by region index
+    unordered_map<uint64_t, int> regionOf;              // (doctorId, routine class) -> region index
+    unordered_map<uint64_t, PersistedSlot*> slotIndex;  // (doctorId, slotId) -> entry
+    unordered_map<uint64_t, vector<PersistedSlot*>> overbookIndex; // (doctorId, slotId) -> line, in order
+    unordered_map<int, vector<PersistedSlot*>> freeEntries;        // region -> entries open for reuse
+
+    FileHeader* header() const { return reinterpret_cast<FileHeader*>(base); }
+    MappedQueueHeader* regionHeader(int r) const { return reinterpret_cast<MappedQueueHeader*>(base + kHeaderBytes + r * regionBytes); }
+    Token* regionRing(int r) const { return reinterpret_cast<Token*>(base + kHeaderBytes + r * regionBytes + sizeof(MappedQueueHeader)); }
+    PersistedSlot* regionSlots(int r) const {
+        return reinterpret_cast<PersistedSlot*>(base + kHeaderBytes + r * regionBytes + sizeof(MappedQueueHeader)
+                                                + header()->ringEntries * sizeof(Token));
+    }
+    static uint64_t slotKey(int doctorId, int slotId) { return (uint64_t)(uint32_t)doctorId << 32 | (uint32_t)slotId; }
+    static uint64_t ringKey(int doctorId, uint32_t routineClass) { return (uint64_t)(uint32_t)doctorId << 32 | routineClass; }
+
+    static string currentBootId() {
+        string id;
+        FILE* fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+        if (fp) {
+            char buf[64] = {0};
+            if (fgets(buf, sizeof(buf), fp)) id = buf;
+            fclose(fp);
+        }
+        while (!id.empty() && (id.back() == '\n' || id.back() == '\r')) id.pop_back();
+        return id.substr(0, 39);
+    }
+
+    void bindRegion(int r) {
+        FileHeader* fh = header();
+        MappedQueueHeader* h = regionHeader(r);
+        regionOf[ringKey(h->doctorId, h->routineClass)] = r;
+        if ((int)rings.size() <= r) rings.resize(r + 1);
+        rings[r].reset(new MappedRoutineRing(h, regionRing(r), fh->ringEntries, h->capacity, this));
+        PersistedSlot* slots = regionSlots(r);
+        vector<uint64_t> lines;
+        for (uint32_t i = 0; i < h->slotCount; ++i) {
+            PersistedSlot* ps = &slots[i];
+            if (ps->slotId == kFreeEntry) { freeEntries[r].push_back(ps); continue; }
+            uint64_t key = slotKey(h->doctorId, ps->slotId);
+            if (ps->state < kOverbookedState) { slotIndex[key] = ps; continue; }
+            vector<PersistedSlot*>& line = overbookIndex[key];
+            if (line.empty()) lines.push_back(key);
+            size_t at = ps->state - kOverbookedState;
+            if (line.size() <= at) line.resize(at + 1, nullptr);
+            line[at] = ps;
+        }
+        // a crash while a line was rewritten can leave holes; close them up
+        for (uint64_t key : lines) {
+            vector<PersistedSlot*>& line = overbookIndex[key];
+            line.erase(remove(line.begin(), line.end(), nullptr), line.end());
+        }
+    }
+
+    // An unused entry in doctorId's slot table, or nullptr when it is full.
+    // The caller fills it in and then sets slotId, which publishes it.
+    PersistedSlot* allocEntry(int doctorId) {
+        auto rit = regionOf.find(ringKey(doctorId, 0));
+        if (rit == regionOf.end()) return nullptr;
+        vector<PersistedSlot*>& spare = freeEntries[rit->second];
+        if (!spare.empty()) { PersistedSlot* ps = spare.back(); spare.pop_back(); return ps; }
+        MappedQueueHeader* h = regionHeader(rit->second);
+        if (h->slotCount >= header()->slotEntries) return nullptr;
+        PersistedSlot* ps = &regionSlots(rit->second)[h->slotCount];
+        ps->slotId = kFreeEntry;
+        atomic_thread_fence(memory_order_release);
+        ++h->slotCount;
+        return ps;
+    }
+    void releaseEntry(int doctorId, PersistedSlot* ps) {
+        ps->slotId = kFreeEntry;
+        freeEntries[regionOf[ringKey(doctorId, 0)]].push_back(ps);
+    }
+
+public:
+    PersistentQueueStore() = default;
+    PersistentQueueStore(const PersistentQueueStore&) = delete;
+    PersistentQueueStore& operator=(const PersistentQueueStore&) = delete;
+    ~PersistentQueueStore() { close(); }
+
+    // Maps path, creating it if needed. An existing file with the same geometry
+    // is recovered. maxDoctors counts regions: a doctor takes one per routine class.
+    bool open(const string& path, uint32_t maxDoctors = 64, uint32_t ringEntries = 256, uint32_t slotEntries = 256, uint32_t syncEveryWrites = 64) {
+        close();
+        if (ringEntries == 0 || (ringEntries & (ringEntries - 1))) return false;
+        regionBytes = (sizeof(MappedQueueHeader) + ringEntries * sizeof(Token) + slotEntries * sizeof(PersistedSlot) + 63) & ~(size_t)63;
+        mappedBytes = kHeaderBytes + maxDoctors * regionBytes;
+        syncEvery = syncEveryWrites ? syncEveryWrites : 1;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) return false;
+        struct stat st;
+        bool existing = fstat(fd, &st) == 0 && (size_t)st.st_size == mappedBytes;
+        if (!existing && ftruncate(fd, mappedBytes) != 0) { close(); return false; }
+        void* mem = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) { base = nullptr; close(); return false; }
+        base = static_cast<uint8_t*>(mem);
+        FileHeader* fh = header();
+        string boot = currentBootId();
+        if (existing && fh->magic == kMagic && fh->version == kVersion && fh->maxDoctors == maxDoctors && fh->ringEntries == ringEntries && fh->slotEntries == slotEntries) {
+            recoveredFile = true;
+            bool rebooted = boot != string(fh->bootId);
+            for (uint32_t r = 0; r < fh->doctorsUsed; ++r) {
+                MappedQueueHeader* h = regionHeader(r);
+                if (rebooted) { h->head.store(h->durableHead); h->tail.store(h->durableTail); }
+                bindRegion(r);
+            }
+        } else {
+            memset(base, 0, mappedBytes);
+            fh->magic = kMagic; fh->version = kVersion; fh->maxDoctors = maxDoctors;
+            fh->ringEntries = ringEntries; fh->slotEntries = slotEntries; fh->doctorsUsed = 0;
+        }
+        memset(fh->bootId, 0, sizeof(fh->bootId));
+        memcpy(fh->bootId, boot.data(), boot.size());
+        flush();
+        return true;
+    }
+
+    void close() {
+        if (base) { flush(); munmap(base, mappedBytes); base = nullptr; }
+        if (fd >= 0) { ::close(fd); fd = -1; }
+        rings.clear(); regionOf.clear(); slotIndex.clear(); overbookIndex.clear(); freeEntries.clear();
+        recoveredFile = false;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    bool recovered() const { return recoveredFile; }
+
+    // Ring for one routine class of doctorId; existed reports whether it came from the file.
+    MappedRoutineRing* ringFor(int doctorId, int routineClass, int capacity, bool& existed) {
+        auto it = regionOf.find(ringKey(doctorId, (uint32_t)routineClass));
+        if (it != regionOf.end()) { existed = true; return rings[it->second].get(); }
+        existed = false;
+        FileHeader* fh = header();
+        if (fh->doctorsUsed >= fh->maxDoctors) return nullptr;
+        int r = (int)fh->doctorsUsed;
+        MappedQueueHeader* h = regionHeader(r);
+        h->doctorId = doctorId; h->capacity = (uint32_t)max(capacity, 1);
+        h->head.store(0); h->tail.store(0); h->durableHead = h->durableTail = 0; h->slotCount = 0;
+        h->routineClass = (uint32_t)routineClass;
+        fh->doctorsUsed = r + 1;
+        bindRegion(r);
+        noteWrite();
+        return rings[r].get();
+    }
+
+    // The stored state of a slot: holder token and patient when taken, and
+    // its overbooked line as (tokenId, patientId) in order.
+    bool getSlot(int doctorId, int slotId, bool& taken, int& tokenId, int& patientId, vector<pair<int,int>>& overbooked) const {
+        uint64_t key = slotKey(doctorId, slotId);
+        auto it = slotIndex.find(key);
+        if (it == slotIndex.end()) return false;
+        taken = it->second->state != 0; tokenId = it->second->tokenId; patientId = it->second->patientId;
+        overbooked.clear();
+        auto ob = overbookIndex.find(key);
+        if (ob != overbookIndex.end())
+            for (const PersistedSlot* ps : ob->second) overbooked.push_back(make_pair(ps->tokenId, ps->patientId));
+        return true;
+    }
+
+    // Whether setSlot can record slotId: it already has an entry or one is free.
+    bool canTrackSlot(int doctorId, int slotId) const {
+        if (slotIndex.count(slotKey(doctorId, slotId))) return true;
+        return entriesLeft(doctorId) > 0;
+    }
+    size_t entriesLeft(int doctorId) const {
+        auto rit = regionOf.find(ringKey(doctorId, 0));
+        if (rit == regionOf.end()) return 0;
+        auto fit = freeEntries.find(rit->second);
+        return header()->slotEntries - regionHeader(rit->second)->slotCount + (fit == freeEntries.end() ? 0 : fit->second.size());
+    }
+
+    // Token and patient are stored before the state they belong to. False
+    // when the doctor's slot table is full.
+    bool setSlot(int doctorId, int slotId, bool taken, int tokenId, int patientId) {
+        PersistedSlot* ps;
+        auto it = slotIndex.find(slotKey(doctorId, slotId));
+        if (it != slotIndex.end()) ps = it->second;
+        else {
+            ps = allocEntry(doctorId);
+            if (!ps) return false;
+            ps->state = 0;
+            atomic_thread_fence(memory_order_release);
+            ps->slotId = slotId;
+            slotIndex[slotKey(doctorId, slotId)] = ps;
+        }
+        ps->tokenId = tokenId; ps->patientId = patientId;
+        atomic_thread_fence(memory_order_release);
+        ps->state = taken ? 1 : 0;
+        noteWrite();
+        return true;
+    }
+
+    // Replaces the slot's stored overbooked line. False, with the line cut
+    // short, when the doctor's slot table is full.
+    bool setOverbooked(int doctorId, int slotId, const vector<pair<int,int>>& line) {
+        vector<PersistedSlot*>& cur = overbookIndex[slotKey(doctorId, slotId)];
+        while (cur.size() > line.size()) { releaseEntry(doctorId, cur.back()); cur.pop_back(); }
+        bool ok = true;
+        for (size_t i = 0; i < line.size(); ++i) {
+            PersistedSlot* ps = i < cur.size() ? cur[i] : allocEntry(doctorId);
+            if (!ps) { ok = false; break; }
+            ps->tokenId = line[i].first; ps->patientId = line[i].second;
+            ps->state = kOverbookedState + (uint32_t)i;
+            atomic_thread_fence(memory_order_release);
+            if (i >= cur.size()) { ps->slotId = slotId; cur.push_back(ps); }
+        }
+        noteWrite();
+        return ok;
+    }
+
+    // Gives the entries of a cancelled slot back for reuse.
+    void removeSlot(int doctorId, int slotId) {
+        uint64_t key = slotKey(doctorId, slotId);
+        auto it = slotIndex.find(key);
+        if (it != slotIndex.end()) { releaseEntry(doctorId, it->second); slotIndex.erase(it); }
+        auto ob = overbookIndex.find(key);
+        if (ob != overbookIndex.end()) {
+            for (PersistedSlot* ps : ob->second) releaseEntry(doctorId, ps);
+            overbookIndex.erase(ob);
+        }
+        noteWrite();
+    }
+
+    void noteWrite() { if (++writesSinceSync >= syncEvery) flush(); }
+
+    // Makes everything written so far durable, then publishes the durable indices.
+    void flush() {
+        if (!base) return;
+        msync(base, mappedBytes, MS_SYNC);
+        FileHeader* fh = header();
+        for (uint32_t r = 0; r < fh->doctorsUsed; ++r) {
+            MappedQueueHeader* h = regionHeader(r);
+            h->durableHead = h->head.load(memory_order_acquire);
+            h->durableTail = h->tail.load(memory_order_acquire);
+            msync(reinterpret_cast<uint8_t*>(h) - (reinterpret_cast<uintptr_t>(h) & 4095), 4096, MS_SYNC);
+        }
+        writesSinceSync = 0;
+    }
+};
+
+inline bool MappedRoutineRing::push(const Token& t) {
+    if (full()) return false;
+    uint32_t tl = hdr->tail.load(memory_order_relaxed);
+    // Entries from durableHead on are kept for rollback; sync to release them.
+    if (tl - hdr->durableHead >= physical) owner->flush();
+    entries[tl & (physical - 1)] = t;
+    hdr->tail.store(tl + 1, memory_order_release);
+    owner->noteWrite();
+    return true;
+}
+
+inline bool MappedRoutineRing::pop(Token& out) {
+    if (empty()) return false;
+    uint32_t hd = hdr->head.load(memory_order_relaxed);
+    out = entries[hd & (physical - 1)];
+    hdr->head.store(hd + 1, memory_order_release);
+    owner->noteWrite();
+    return true;
+}
+
+// The undo moves run the indices backwards, into entries the durable range
+// may still cover; those are synced first so a rollback finds them intact.
+inline bool MappedRoutineRing::pushFront(const Token& t) {
+    if (full()) return false;
+    uint32_t hd = hdr->head.load(memory_order_relaxed) - 1;
+    if (hd - hdr->durableHead < hdr->durableTail - hdr->durableHead) owner->flush();
+    entries[hd & (physical - 1)] = t;
+    hdr->head.store(hd, memory_order_release);
+    owner->noteWrite();
+    return true;
+}
+
+inline bool MappedRoutineRing::popRear(Token& out) {
+    if (empty()) return false;
+    uint32_t tl = hdr->tail.load(memory_order_relaxed) - 1;
+    out = entries[tl & (physical - 1)];
+    hdr->tail.store(tl, memory_order_release);
+    if ((int32_t)(hdr->durableTail - tl) > 0) owner->flush(); // the next push would overwrite a durable entry
+    else owner->noteWrite();
+    return true;
+}
+#endif
+
+// ----------------------------- Overbooking -----------------------------
+// A taken slot may accept more tokens when the doctor's observed no-show
+// rate for that weekday-hour makes it likely that at most one of them
+// turns up. With show probability q estimated as (shows + 1) / (n + 2),
+// k tokens overrun the slot with probability 1 - (1-q)^k - k q (1-q)^(k-1);
+// the limit is the largest k whose overrun risk stays within the policy.
+struct OverbookPolicy {
+    int maxPerSlot = 1;            // 1 = no overbooking
+    double maxOvertimeRisk = 0.2;  // allowed P(two or more booked patients show)
+    int minSamples = 20;           // observations needed in a bucket before overbooking there
+};
+
+inline double overtimeRisk(double showProb, int k) {
+    double miss = 1 - showProb;
+    return 1 - pow(miss, k) - k * showProb * pow(miss, k - 1);
+}
+
+inline int overbookLimit(const SlotAttendance& a, const OverbookPolicy& policy) {
+    int n = a.shows + a.noShows;
+    if (policy.maxPerSlot <= 1 || n < policy.minSamples) return 1;
+    double q = (a.shows + 1.0) / (n + 2.0);
+    int k = 1;
+    while (k < policy.maxPerSlot && overtimeRisk(q, k + 1) <= policy.maxOvertimeRisk) ++k;
+    return k;
+}
+
+// ----------------------------- Timeline -----------------------------
+// Which of a doctor's two lines serveNext takes from when both wait: the
+// walk-in ring or the earliest booked slot. A slot is due once the clock
+// (HospitalSystem::setClock) has reached its start; without a clock no slot
+// is ever due. Emergencies always go first.
+enum TimelinePolicy {
+    TIMELINE_WALKINS_FIRST,     // booked slots only when no walk-in waits
+    TIMELINE_APPOINTMENTS_FIRST, // due slots first, then walk-ins, then early slots
+    TIMELINE_ALTERNATE           // due slots and walk-ins take turns
+};
+
+// ----------------------------- Failure Counters -----------------------------
+// Why a booking or triage call was refused. Data problems (unknown ids, bad
+// arguments) point at callers; capacity problems at the schedule.
+enum FailReason {
+    FAIL_NONE,
+    FAIL_UNKNOWN_DOCTOR, FAIL_UNKNOWN_PATIENT, FAIL_UNKNOWN_SLOT, FAIL_UNKNOWN_RESOURCE, FAIL_BAD_REQUEST,
+    FAIL_SLOT_TAKEN, FAIL_QUEUE_FULL, FAIL_NO_FREE_SLOT, FAIL_RESOURCE_BUSY, FAIL_NO_FREE_TIME, FAIL_SESSION_FULL,
+    FAIL_STORE_FULL,
+    FAIL_REASON_COUNT
+};
+const char* const kFailReasonNames[] = { "ok", "unknown-doctor", "unknown-patient", "unknown-slot", "unknown-resource",
+                                         "bad-request", "slot-taken", "queue-full", "no-free-slot", "resource-busy",
+                                         "no-free-time", "session-full", "store-full" };
+
+inline bool isCapacityFailure(FailReason r) { return r >= FAIL_SLOT_TAKEN; }
+
+typedef array<uint64_t, FAIL_REASON_COUNT> FailCounts;
+
+// Process-wide failure counts. Each thread bumps a block of its own
+// (relaxed atomics with a single writer, so counting costs no shared cache
+// line); reads sum the live blocks plus what exited threads left behind.
+class FailCounters {
+private:
+    struct Block { array<atomic<uint64_t>, FAIL_REASON_COUNT> n; };
+    struct Handle {
+        Block* b;
+        Handle() : b(new Block()) {
+            for (auto &x : b->n) x.store(0, memory_order_relaxed);
+            FailCounters& c = instance();
+            lock_guard<mutex> g(c.mu); c.live.push_back(b);
+        }
+        ~Handle() {
+            FailCounters& c = instance();
+            lock_guard<mutex> g(c.mu);
+            for (int r = 0; r < FAIL_REASON_COUNT; ++r) c.retired[r] += b->n[r].load(memory_order_relaxed);
+            c.live.erase(find(c.live.begin(), c.live.end(), b));
+            delete b;
+        }
+    };
+    mutex mu;
+    vector<Block*> live;
+    FailCounts retired{};
+
+public:
+    static FailCounters& instance() { static FailCounters* c = new FailCounters(); return *c; }
+
+    void bump(FailReason r) {
+        thread_local Handle h;
+        atomic<uint64_t>& n = h.b->n[r];
+        n.store(n.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    FailCounts snapshot() {
+        lock_guard<mutex> g(mu);
+        FailCounts out = retired;
+        for (Block* b : live)
+            for (int r = 0; r < FAIL_REASON_COUNT; ++r) out[r] += b->n[r].load(memory_order_relaxed);
+        return out;
+    }
+};
+
+// ----------------------------- Group Sessions -----------------------------
+// A session slot for vaccination drives and screening clinics: one window
+// with room for capacity patients, checked in and served in batches with
+// one undo record per batch instead of one per patient. The roster keeps
+// check-in order and fills up to capacity; its first `served` tokens have
+// been seen, the rest wait. Sessions are served on their own, apart from
+// the triage heap and the doctor's walk-ins and slots.
+struct GroupSession {
+    string startTime, endTime;
+    int weekday = 0;
+    int capacity = 0;
+    vector<Token> roster;
+    size_t served = 0;
+
+    size_t waiting() const { return roster.size() - served; }
+};
+
+// ----------------------------- Doctor -----------------------------
+struct Doctor {
+    int id = 0;
+    string name;
+    string specialization;
+    SlotNode* slotHead = nullptr;
+    array<RoutineRing, ROUTINE_CLASS_COUNT> circBuffer; // walk-ins, one ring per RoutineClass
+    unsigned nonEmpty = 0;                               // bit c set while class c has walk-ins
+    int capacity = 10;                                   // walk-ins across all classes
+    SlotHeatmap* heat = nullptr; // this doctor's specialization heatmap, owned by HospitalSystem
+    CountedBitmap* seen = nullptr; // patients served in this specialization, owned by HospitalSystem
+    map<pair<int,int>, SlotNode*> freeSlots; // timed free slots by (weekStart, slotId)
+    vector<SlotNode*> byTime;                  // all timed slots by (weekStart, slotId), for claimFirstFreeAfter
+    int longestSlot = 0;                       // minutes, never lowered; bounds the byTime search in slotClashEnd
+    // Booked slots as a min-heap on (weekStart, slotId) with lazy deletion:
+    // an entry is current while its slot is taken by the booking (seq) it was
+    // pushed for. Untimed slots sort after every timed one.
+    struct BookedEntry { int start; int slotId; unsigned seq; SlotNode* slot; };
+    vector<BookedEntry> booked;
+    int slotCount = 0;
+    bool servedSlotLast = false;               // for TIMELINE_ALTERNATE
+    FreeTimeTree freeTime;                     // for variable-length appointments
+    vector<pair<int,int>> availability;        // as configured, for checksums
+    array<SlotAttendance, kHeatBuckets> attendance; // by SlotNode::heatBucket()
+    FailCounts failures{};                     // refused bookings for this doctor, by FailReason
+    map<int, GroupSession> sessions;           // by session id
+#ifdef HOSPITAL_HAVE_MMAP
+    array<MappedRoutineRing*, ROUTINE_CLASS_COUNT> mapped{}; // set in persistent mode; replace circBuffer
+#define DOCTOR_RING(c, expr) (mapped[c] ? mapped[c]->expr : circBuffer[c].expr)
+#else
+#define DOCTOR_RING(c, expr) (circBuffer[c].expr)
+#endif
+
+    Doctor() = default;
+    Doctor(int _id, const string& _name, const string& _spec, int cap = 10)
+        : id(_id), name(_name), specialization(_spec), slotHead(nullptr) {
+        for (auto &ring : circBuffer) ring = RoutineRing(cap);
+        capacity = circBuffer[0].limit();
+    }
+
+    ~Doctor() {
+        SlotNode* cur = slotHead;
+        while (cur) {
+            SlotNode* nxt = cur->next;
+            delete cur;
+            cur = nxt;
+        }
+        slotHead = nullptr;
+    }
+
+    static int classOf(const Token& t) { return t.routineClass < ROUTINE_CLASS_COUNT ? (int)t.routineClass : (int)ROUTINE_STANDARD; }
+    int firstClass() const { return __builtin_ctz(nonEmpty); } // nonEmpty must be non-zero
+
+    bool isFull() const { return pendingCount() >= capacity; }
+    bool isEmpty() const { return nonEmpty == 0; }
+
+    bool enqueueRoutine(const Token& t) {
+        int c = classOf(t);
+        if (isFull() || !DOCTOR_RING(c, push(t))) return false;
+        nonEmpty |= 1u << c;
+        return true;
+    }
+
+    bool dequeueRoutine(Token& out) {
+        if (!nonEmpty) return false;
+        int c = firstClass();
+        DOCTOR_RING(c, pop(out));
+        if (DOCTOR_RING(c, empty())) nonEmpty &= ~(1u << c);
+        return true;
+    }
+
+    bool peekRoutine(Token& out) const { return nonEmpty && DOCTOR_RING(firstClass(), peek(out)); }
+
+    // Undo of a walk-in serve: t goes back to the head of its class.
+    bool requeueFront(const Token& t) {
+        int c = classOf(t);
+        if (isFull() || !DOCTOR_RING(c, pushFront(t))) return false;
+        nonEmpty |= 1u << c;
+        return true;
+    }
+
+    // Undo of a walk-in booking: takes tokenId out of t's class. Undo runs
+    // newest first, so it is at the tail; otherwise only that ring is rebuilt.
+    bool unqueueRoutine(const Token& t, Token& out) {
+        int c = classOf(t);
+        Token last;
+        if (DOCTOR_RING(c, peekRear(last)) && last.tokenId == t.tokenId) DOCTOR_RING(c, popRear(out));
+        else {
+            vector<Token> keep;
+            bool found = false;
+            while (DOCTOR_RING(c, pop(last))) {
+                if (!found && last.tokenId == t.tokenId) { found = true; out = last; }
+                else keep.push_back(last);
+            }
+            for (auto &k : keep) DOCTOR_RING(c, push(k));
+            if (!found) return false;
+        }
+        if (DOCTOR_RING(c, empty())) nonEmpty &= ~(1u << c);
+        return true;
+    }
+
+    int pendingCount() const {
+        int n = 0;
+        for (int c = 0; c < ROUTINE_CLASS_COUNT; ++c) n += DOCTOR_RING(c, size());
+        return n;
+    }
+    int pendingInClass(int c) const { return DOCTOR_RING(c, size()); }
+
+    // After the rings were swapped for mapped ones.
+    void resyncClasses() {
+        nonEmpty = 0;
+        for (int c = 0; c < ROUTINE_CLASS_COUNT; ++c)
+            if (!DOCTOR_RING(c, empty())) nonEmpty |= 1u << c;
+    }
+
+    // Walk-ins in serve order.
+    template <class F>
+    void forEachQueued(F f) const {
+        for (int c = 0; c < ROUTINE_CLASS_COUNT; ++c) forEachQueuedIn(c, f);
+    }
+
+    template <class F>
+    void forEachQueuedIn(int c, F f) const {
+#ifdef HOSPITAL_HAVE_MMAP
+        if (mapped[c]) { mapped[c]->forEach(f); return; }
+#endif
+        circBuffer[c].forEach(f);
+    }
+
+    static bool earlier(const SlotNode* a, const SlotNode* b) {
+        return a->weekStart() != b->weekStart() ? a->weekStart() < b->weekStart() : a->slotId < b->slotId;
+    }
+
+    static bool laterEntry(const BookedEntry& a, const BookedEntry& b) {
+        return a.start != b.start ? a.start > b.start : a.slotId > b.slotId;
+    }
+    static bool current(const BookedEntry& e) { return e.slot->taken() && e.slot->bookingSeq == e.seq; }
+
+    // Called for every booking of s (HospitalSystem::takeSlot); releases are
+    // not reported, their entries go stale instead.
+    void noteBooked(SlotNode* s) {
+        booked.push_back(BookedEntry{s->timed() ? s->weekStart() : INT_MAX, s->slotId, ++s->bookingSeq, s});
+        push_heap(booked.begin(), booked.end(), laterEntry);
+        if (booked.size() > 2 * (size_t)slotCount + 16) {
+            booked.erase(remove_if(booked.begin(), booked.end(), [](const BookedEntry& e) { return !current(e); }), booked.end());
+            make_heap(booked.begin(), booked.end(), laterEntry);
+        }
+    }
+
+    // Earliest booked slot, or nullptr. Amortized O(1): stale entries are
+    // dropped here as they reach the top.
+    SlotNode* nextBooked() {
+        while (!booked.empty() && !current(booked.front())) {
+            pop_heap(booked.begin(), booked.end(), laterEntry);
+            booked.pop_back();
+        }
+        return booked.empty() ? nullptr : booked.front().slot;
+    }
+
+    void rebuildTimeline() {
+        booked.clear();
+        for (SlotNode* s = slotHead; s; s = s->next)
+            if (s->taken()) noteBooked(s);
+    }
+
+    SlotNode* insertSlot(int slotId, const string& s, const string& e, int weekday = 0) {
+        SlotNode* node = new SlotNode(slotId, s, e, weekday);
+        ++slotCount;
+        if (node->timed()) {
+            byTime.insert(upper_bound(byTime.begin(), byTime.end(), node, earlier), node);
+            longestSlot = max(longestSlot, node->weekEnd() - node->weekStart());
+        }
+        if (!slotHead) { slotHead = node; return node; }
+        SlotNode* cur = slotHead;
+        while (cur->next) cur = cur->next;
+        cur->next = node;
+        return node;
+    }
+
+    bool cancelSlot(int slotId) {
+        SlotNode* cur = slotHead;
+        SlotNode* prev = nullptr;
+        while (cur) {
+            if (cur->slotId == slotId) {
+                if (prev) prev->next = cur->next;
+                else slotHead = cur->next;
+                auto bt = find(byTime.begin(), byTime.end(), cur);
+                if (bt != byTime.end()) byTime.erase(bt);
+                booked.erase(remove_if(booked.begin(), booked.end(), [cur](const BookedEntry& e) { return e.slot == cur; }), booked.end());
+                make_heap(booked.begin(), booked.end(), laterEntry);
+                --slotCount;
+                delete cur;
+                return true;
+            }
             prev = cur; cur = cur->next;
         }
         return false;
     }
 
-    SlotNode* findSlot(int slotId) {
-        SlotNode* cur = slotHead;
-        while (cur) {
-            if (cur->slotId == slotId) return cur;
-            cur = cur->next;
+    SlotNode* findSlot(int slotId) {
+        SlotNode* cur = slotHead;
+        while (cur) {
+            if (cur->slotId == slotId) return cur;
+            cur = cur->next;
+        }
+        return nullptr;
+    }
+
+    // Lock-free booking: claims the earliest free timed slot starting at or
+    // after fromMinute for tokenId with one compare-and-swap. Any number of
+    // threads may call it at once; slots must not be added or removed
+    // meanwhile. A lost race backs off and moves on to the next slot.
+    SlotNode* claimFirstFreeAfter(int fromMinute, int tokenId, int* lostRaces = nullptr) {
+        auto it = lower_bound(byTime.begin(), byTime.end(), fromMinute,
+                              [](const SlotNode* s, int m) { return s->weekStart() < m; });
+        int losses = 0;
+        for (; it != byTime.end(); ++it) {
+            if ((*it)->taken()) continue;
+            if ((*it)->tryClaim(tokenId)) break;
+            contentionBackoff(++losses);
+        }
+        if (lostRaces) *lostRaces += losses;
+        return it == byTime.end() ? nullptr : *it;
+    }
+
+    // Latest end of the timed slots, free or booked, overlapping [start, end)
+    // (minutes of the week), or -1 when none does.
+    int slotClashEnd(int start, int end) const {
+        auto it = lower_bound(byTime.begin(), byTime.end(), end,
+                              [](const SlotNode* s, int m) { return s->weekStart() < m; });
+        int clash = -1;
+        while (it != byTime.begin()) {
+            const SlotNode* s = *--it;
+            if (s->weekStart() + longestSlot <= start) break;
+            if (s->weekEnd() > start) clash = max(clash, s->weekEnd());
+        }
+        return clash;
+    }
+
+    SlotNode* nextFreeSlot() {
+        SlotNode* cur = slotHead;
+        while (cur) {
+            if (!cur->taken()) return cur;
+            cur = cur->next;
+        }
+        return nullptr;
+    }
+
+    void printSlots() {
+        cout << "Slots for Dr. " << name << " (id " << id << "):\n";
+        SlotNode* cur = slotHead;
+        while (cur) {
+            cout << "  SlotId: " << cur->slotId << " [" << cur->startTime << "-" << cur->endTime << "]"
+                 << (cur->taken() ? " (TAKEN)" : " (FREE)") << "\n";
+            cur = cur->next;
+        }
+    }
+};
+#undef DOCTOR_RING
+
+// ----------------------------- Resource Calendars -----------------------------
+// Free time of a shared resource (exam room, ECG, ultrasound) as disjoint,
+// coalesced [start, end) intervals in minutes of the week, keyed by start.
+struct ResourceCalendar {
+    int id = 0;
+    string name;
+    string kind;
+    map<int,int> freeIntervals;
+    vector<pair<int,int>> availability; // as configured, for checksums
+
+    ResourceCalendar() = default;
+    ResourceCalendar(int _id, const string& _name, const string& _kind) : id(_id), name(_name), kind(_kind) {}
+
+    void addFree(int start, int end) {
+        if (start >= end) return;
+        auto it = freeIntervals.upper_bound(start);
+        if (it != freeIntervals.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= start) { start = prev->first; end = max(end, prev->second); freeIntervals.erase(prev); }
+        }
+        while (it != freeIntervals.end() && it->first <= end) {
+            end = max(end, it->second);
+            it = freeIntervals.erase(it);
+        }
+        freeIntervals[start] = end;
+    }
+
+    // Free interval containing [start, end), or end().
+    map<int,int>::const_iterator covering(int start, int end) const {
+        auto it = freeIntervals.upper_bound(start);
+        if (it == freeIntervals.begin()) return freeIntervals.end();
+        --it;
+        return it->second >= end ? it : freeIntervals.end();
+    }
+
+    bool reserve(int start, int end) {
+        auto it = covering(start, end);
+        if (it == freeIntervals.end()) return false;
+        int s = it->first, e = it->second;
+        freeIntervals.erase(it);
+        if (s < start) freeIntervals[s] = start;
+        if (end < e) freeIntervals[end] = e;
+        return true;
+    }
+
+    // Earliest t >= from with [t, t + len) free, or -1.
+    int nextFit(int from, int len) const {
+        auto it = freeIntervals.upper_bound(from);
+        if (it != freeIntervals.begin() && std::prev(it)->second > from) --it;
+        for (; it != freeIntervals.end(); ++it) {
+            int t = max(from, it->first);
+            if (t + len <= it->second) return t;
+        }
+        return -1;
+    }
+};
+
+// Resources held by one booked token.
+struct ResourceBooking {
+    int start = 0, end = 0;
+    vector<int> resourceIds;
+    bool held = false; // false while the token's slot is released (served, cancelled, no-show)
+};
+
+// ----------------------------- Emergency Triage -----------------------------
+struct TriagedToken {
+    int severity;
+    Token token;
+    bool operator>(TriagedToken const& other) const {
+        if (severity != other.severity) return severity > other.severity;
+        return token.tokenId > other.token.tokenId;
+    }
+};
+
+// The triage min-heap; reserve() sizes its arena up front.
+struct TriageHeap : priority_queue<TriagedToken, vector<TriagedToken, HugePageAllocator<TriagedToken>>, greater<TriagedToken>> {
+    void reserve(size_t n) { c.reserve(n); }
+    size_t capacity() const { return c.capacity(); }
+    template <class F>
+    void forEach(F f) const { for (const TriagedToken& t : c) f(t); }
+};
+
+// ----------------------------- Undo Stack -----------------------------
+enum ActionType { BOOK, CANCEL, SERVE, REGISTER_PATIENT, TRIAGE_INSERT, UNDO, NO_SHOW, RESOURCE_BOOK,
+                  APPT_BOOK, APPT_CANCEL, PATIENT_DELETE, GROUP_CHECK_IN, GROUP_SERVE, APPT_SERVE, APPT_NO_SHOW };
+const char* const kActionNames[] = { "book", "cancel", "serve", "register-patient", "triage-insert", "undo", "no-show",
+                                     "resource-book", "appt-book", "appt-cancel", "patient-delete", "group-check-in",
+                                     "group-serve", "appt-serve", "appt-no-show" };
+
+// Actions carrying an appointment's [apptStart, apptEnd).
+inline bool hasApptRange(ActionType t) { return t == APPT_BOOK || t == APPT_CANCEL || t == APPT_SERVE || t == APPT_NO_SHOW; }
+
+struct Action {
+    ActionType type;
+    Token token;
+    int slotId = -1;
+    int doctorId = -1;
+    Patient patientSnapshot;
+    bool slotPreviouslyTaken = false;
+    int severity = 0;
+    int patientIdForUpsert = -1;
+    bool patientExistedBefore = false;
+    vector<int> resourceIds; // RESOURCE_BOOK only
+    int apptStart = -1, apptEnd = -1; // APPT_* only, see hasApptRange
+    vector<int> groupPatients; // GROUP_CHECK_IN only; their tokens run on from token.tokenId
+    int groupCount = 0;        // GROUP_SERVE only; served from token on, in roster order
+    vector<pair<int,int>> overbooked; // CANCEL only: the slot's overbooked line, (tokenId, patientId) in order
+    int64_t timestamp = 0; // microseconds since epoch, stamped when recorded
+};
+
+// ----------------------------- Byte Encoding -----------------------------
+// Little helpers shared by the operation log: LEB128 varints with zigzag for
+// signed values, and length-prefixed strings.
+struct ByteWriter {
+    vector<uint8_t> buf;
+
+    void u8(uint8_t v) { buf.push_back(v); }
+    void varint(uint64_t v) {
+        while (v >= 0x80) { buf.push_back((uint8_t)(v | 0x80)); v >>= 7; }
+        buf.push_back((uint8_t)v);
+    }
+    void svarint(int64_t v) { varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+    void fixed32(uint32_t v) { for (int i = 0; i < 4; ++i) buf.push_back((uint8_t)(v >> (8 * i))); }
+    void fixed64(uint64_t v) { for (int i = 0; i < 8; ++i) buf.push_back((uint8_t)(v >> (8 * i))); }
+    void str(const string& s) { varint(s.size()); buf.insert(buf.end(), s.begin(), s.end()); }
+};
+
+struct ByteReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+
+    ByteReader(const uint8_t* data, size_t n) : p(data), end(data + n) {}
+    explicit ByteReader(const vector<uint8_t>& v) : p(v.data()), end(v.data() + v.size()) {}
+
+    bool atEnd() const { return p >= end; }
+    uint8_t u8() {
+        if (p >= end) { ok = false; return 0; }
+        return *p++;
+    }
+    uint64_t varint() {
+        uint64_t v = 0; int shift = 0;
+        while (p < end && shift < 64) {
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+            shift += 7;
+        }
+        ok = false; return 0;
+    }
+    int64_t svarint() { uint64_t v = varint(); return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+    uint32_t fixed32() {
+        if (end - p < 4) { ok = false; p = end; return 0; }
+        uint32_t v = 0; for (int i = 0; i < 4; ++i) v |= (uint32_t)*p++ << (8 * i);
+        return v;
+    }
+    uint64_t fixed64() {
+        if (end - p < 8) { ok = false; p = end; return 0; }
+        uint64_t v = 0; for (int i = 0; i < 8; ++i) v |= (uint64_t)*p++ << (8 * i);
+        return v;
+    }
+    string str() {
+        uint64_t n = varint();
+        if (!ok || (uint64_t)(end - p) < n) { ok = false; p = end; return string(); }
+        string s((const char*)p, (size_t)n); p += n;
+        return s;
+    }
+};
+
+// ----------------------------- LZ Codec -----------------------------
+// Small LZ77 block codec in the LZ4 style: each sequence is a token byte
+// (literal length nibble, match length nibble), the literals, a 16-bit
+// offset and optional length extension bytes. The block starts with the
+// uncompressed size as a varint. No entropy stage, so decode is a tight copy loop.
+namespace lz {
+    const int kMinMatch = 4;
+    const int kHashBits = 12;
+    const size_t kMaxOffset = 65535;
+
+    inline uint32_t read32(const uint8_t* p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; }
+    inline uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - kHashBits); }
+
+    inline void putLength(vector<uint8_t>& out, size_t len) {
+        while (len >= 255) { out.push_back(255); len -= 255; }
+        out.push_back((uint8_t)len);
+    }
+
+    // dict (optional) is a prefix the encoder may reference but does not emit.
+    inline vector<uint8_t> compress(const uint8_t* src, size_t n, const uint8_t* dict = nullptr, size_t dictLen = 0) {
+        ByteWriter hdr; hdr.varint(n);
+        vector<uint8_t> out = move(hdr.buf);
+        out.reserve(out.size() + n / 2 + 16);
+        vector<uint8_t> joined;
+        const uint8_t* base = src;
+        size_t start = 0;
+        if (dictLen) {
+            joined.reserve(dictLen + n);
+            joined.insert(joined.end(), dict, dict + dictLen);
+            joined.insert(joined.end(), src, src + n);
+            base = joined.data(); start = dictLen;
+        }
+        size_t total = start + n;
+        vector<int> table((size_t)1 << kHashBits, -1);
+        for (size_t i = 0; i + kMinMatch <= start; ++i) table[hash4(read32(base + i))] = (int)i;
+
+        size_t anchor = start, ip = start;
+        while (ip + kMinMatch <= total) {
+            uint32_t h = hash4(read32(base + ip));
+            int cand = table[h]; table[h] = (int)ip;
+            if (cand < 0 || ip - (size_t)cand > kMaxOffset || read32(base + cand) != read32(base + ip)) { ++ip; continue; }
+            size_t mlen = kMinMatch;
+            while (ip + mlen < total && base[cand + mlen] == base[ip + mlen]) ++mlen;
+            size_t lit = ip - anchor;
+            size_t mext = mlen - kMinMatch;
+            out.push_back((uint8_t)((min(lit, (size_t)15) << 4) | min(mext, (size_t)15)));
+            if (lit >= 15) putLength(out, lit - 15);
+            out.insert(out.end(), base + anchor, base + ip);
+            size_t off = ip - (size_t)cand;
+            out.push_back((uint8_t)off); out.push_back((uint8_t)(off >> 8));
+            if (mext >= 15) putLength(out, mext - 15);
+            ip += mlen; anchor = ip;
+        }
+        size_t lit = total - anchor;
+        out.push_back((uint8_t)(min(lit, (size_t)15) << 4));
+        if (lit >= 15) putLength(out, lit - 15);
+        out.insert(out.end(), base + anchor, base + total);
+        return out;
+    }
+
+    // Matches may reach back into dict; it is read in place, not copied.
+    inline bool decompress(const uint8_t* src, size_t n, vector<uint8_t>& out, const uint8_t* dict = nullptr, size_t dictLen = 0) {
+        ByteReader hdr(src, n);
+        uint64_t rawLen = hdr.varint();
+        // No input byte expands to more than 255 output bytes, so a larger
+        // length is corrupt; refuse it before sizing the output.
+        if (!hdr.ok || rawLen > (uint64_t)n * 255 + kMinMatch) return false;
+        const uint8_t* ip = hdr.p;
+        const uint8_t* end = src + n;
+        out.resize((size_t)rawLen);
+        uint8_t* op = out.data();
+        size_t pos = 0;
+        auto readLen = [&](size_t len) -> size_t {
+            if (len != 15) return len;
+            uint8_t b;
+            do { if (ip >= end) return (size_t)-1; b = *ip++; len += b; } while (b == 255);
+            return len;
+        };
+        while (ip < end) {
+            uint8_t tok = *ip++;
+            size_t lit = readLen(tok >> 4);
+            if (lit == (size_t)-1 || (size_t)(end - ip) < lit || rawLen - pos < lit) return false;
+            if (lit) memcpy(op + pos, ip, lit);
+            ip += lit; pos += lit;
+            if (ip >= end) break;
+            if (end - ip < 2) return false;
+            size_t off = (size_t)ip[0] | (size_t)ip[1] << 8; ip += 2;
+            size_t mlen = readLen(tok & 15);
+            if (mlen == (size_t)-1 || off == 0 || off > pos + dictLen) return false;
+            mlen += kMinMatch;
+            if (rawLen - pos < mlen) return false;
+            if (off > pos) { // starts inside the dictionary
+                size_t fromDict = min(off - pos, mlen);
+                memcpy(op + pos, dict + dictLen - (off - pos), fromDict);
+                pos += fromDict; mlen -= fromDict;
+            }
+            const uint8_t* from = op + pos - off;
+            if (off >= mlen) memcpy(op + pos, from, mlen);
+            else for (size_t i = 0; i < mlen; ++i) op[pos + i] = from[i]; // overlapping run
+            pos += mlen;
+        }
+        return pos == rawLen;
+    }
+
+    // Builds a dictionary of up to maxBytes from sample texts: 32-byte windows
+    // are scored by how common their 8-byte substrings are across the samples,
+    // then picked greedily, discounting substrings already covered. The best
+    // window goes last, where matches get the shortest offsets.
+    inline string trainDictionary(const vector<string>& samples, size_t maxBytes) {
+        const size_t kGram = 8, kSeg = 32, kStride = 16;
+        const int kCountBits = 20;
+        maxBytes = min(maxBytes, kMaxOffset);
+        vector<uint32_t> counts((size_t)1 << kCountBits, 0);
+        auto gramHash = [&](const char* p) {
+            uint64_t v; memcpy(&v, p, sizeof(v));
+            return (size_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - kCountBits));
+        };
+        for (auto &s : samples)
+            for (size_t i = 0; i + kGram <= s.size(); ++i) ++counts[gramHash(s.data() + i)];
+        auto score = [&](const string& s, size_t at) {
+            uint64_t sc = 0;
+            for (size_t i = at; i + kGram <= at + kSeg; ++i) sc += counts[gramHash(s.data() + i)];
+            return sc;
+        };
+        // (score, sample, offset); scores only drop, so re-check on pop
+        priority_queue<tuple<uint64_t, size_t, size_t>> heap;
+        for (size_t k = 0; k < samples.size(); ++k)
+            for (size_t at = 0; at + kSeg <= samples[k].size(); at += kStride) heap.push(make_tuple(score(samples[k], at), k, at));
+        vector<string> picked;
+        size_t used = 0;
+        while (!heap.empty() && used + kSeg <= maxBytes) {
+            auto top = heap.top(); heap.pop();
+            const string& s = samples[get<1>(top)];
+            size_t at = get<2>(top);
+            uint64_t now = score(s, at);
+            if (now == 0) break;
+            if (!heap.empty() && now < get<0>(heap.top())) { heap.push(make_tuple(now, get<1>(top), at)); continue; }
+            picked.push_back(s.substr(at, kSeg)); used += kSeg;
+            for (size_t i = at; i + kGram <= at + kSeg; ++i) counts[gramHash(s.data() + i)] = 0;
+        }
+        string dict;
+        for (size_t i = picked.size(); i-- > 0;) dict += picked[i];
+        return dict;
+    }
+}
+
+// ----------------------------- Operation Log -----------------------------
+// Append-only log of every Action the system records (plus UNDO markers);
+// REGISTER_PATIENT records carry the patient as written, not the undo snapshot,
+// PATIENT_DELETE records the deleted patient.
+// New records go to the active segment in a fixed-width raw layout. Once the
+// active segment holds segmentRecords records it is sealed: the records are
+// re-encoded with per-field deltas against the previous record (varints) and
+// the block is LZ compressed.
+struct LogSegment {
+    bool compressed = false;
+    uint32_t records = 0;
+    uint64_t rawBytes = 0;     // size of the same records in the raw layout
+    vector<uint8_t> bytes;
+};
+
+class OpLog {
+private:
+    friend class UndoHistory; // spills undo actions in the sealed-segment encoding
+    vector<LogSegment> sealed;
+    ByteWriter active;
+    uint32_t activeRecords = 0;
+    uint32_t segmentRecords;
+    bool compressSealed;
+
+    static void putRaw(ByteWriter& w, const Action& a) {
+        w.u8((uint8_t)a.type);
+        w.fixed64((uint64_t)a.timestamp);
+        w.fixed32((uint32_t)a.token.tokenId); w.fixed32((uint32_t)a.token.patientId);
+        w.fixed32((uint32_t)a.token.doctorId); w.fixed32((uint32_t)a.token.slotId);
+        w.u8((uint8_t)(a.token.type | a.token.routineClass << 1));
+        w.fixed32((uint32_t)a.slotId); w.fixed32((uint32_t)a.doctorId);
+        w.fixed32((uint32_t)a.severity); w.fixed32((uint32_t)a.patientIdForUpsert);
+        w.u8((uint8_t)(a.slotPreviouslyTaken | (a.patientExistedBefore << 1)));
+        if (a.type == REGISTER_PATIENT || a.type == PATIENT_DELETE) {
+            const Patient& p = a.patientSnapshot;
+            w.fixed32((uint32_t)p.id); w.str(p.name); w.fixed32((uint32_t)p.age); w.str(p.history); w.fixed32((uint32_t)p.freq);
+        }
+        if (a.type == RESOURCE_BOOK) {
+            w.fixed32((uint32_t)a.resourceIds.size());
+            for (int r : a.resourceIds) w.fixed32((uint32_t)r);
+        }
+        if (hasApptRange(a.type)) { w.fixed32((uint32_t)a.apptStart); w.fixed32((uint32_t)a.apptEnd); }
+        if (a.type == GROUP_CHECK_IN) {
+            w.fixed32((uint32_t)a.groupPatients.size());
+            for (int p : a.groupPatients) w.fixed32((uint32_t)p);
+        }
+        if (a.type == GROUP_SERVE) w.fixed32((uint32_t)a.groupCount);
+        if (a.type == CANCEL) {
+            w.fixed32((uint32_t)a.overbooked.size());
+            for (auto &o : a.overbooked) { w.fixed32((uint32_t)o.first); w.fixed32((uint32_t)o.second); }
+        }
+    }
+
+    static bool getRaw(ByteReader& r, Action& a) {
+        a = Action();
+        a.type = (ActionType)r.u8();
+        a.timestamp = (int64_t)r.fixed64();
+        a.token.tokenId = (int)r.fixed32(); a.token.patientId = (int)r.fixed32();
+        a.token.doctorId = (int)r.fixed32(); a.token.slotId = (int)r.fixed32();
+        uint8_t kind = r.u8();
+        a.token.type = (TokenType)(kind & 1); a.token.routineClass = kind >> 1;
+        a.slotId = (int)r.fixed32(); a.doctorId = (int)r.fixed32();
+        a.severity = (int)r.fixed32(); a.patientIdForUpsert = (int)r.fixed32();
+        uint8_t flags = r.u8();
+        a.slotPreviouslyTaken = flags & 1; a.patientExistedBefore = (flags >> 1) & 1;
+        if (a.type == REGISTER_PATIENT || a.type == PATIENT_DELETE) {
+            Patient& p = a.patientSnapshot;
+            p.id = (int)r.fixed32(); p.name = r.str(); p.age = (int)r.fixed32(); p.history = r.str(); p.freq = (int)r.fixed32();
+        }
+        if (a.type == RESOURCE_BOOK) {
+            uint32_t n = r.fixed32();
+            for (uint32_t i = 0; i < n && r.ok; ++i) a.resourceIds.push_back((int)r.fixed32());
+        }
+        if (hasApptRange(a.type)) { a.apptStart = (int)r.fixed32(); a.apptEnd = (int)r.fixed32(); }
+        if (a.type == GROUP_CHECK_IN) {
+            uint32_t n = r.fixed32();
+            for (uint32_t i = 0; i < n && r.ok; ++i) a.groupPatients.push_back((int)r.fixed32());
+        }
+        if (a.type == GROUP_SERVE) a.groupCount = (int)r.fixed32();
+        if (a.type == CANCEL) {
+            uint32_t n = r.fixed32();
+            for (uint32_t i = 0; i < n && r.ok; ++i) { int t = (int)r.fixed32(); a.overbooked.push_back(make_pair(t, (int)r.fixed32())); }
+        }
+        return r.ok;
+    }
+
+    // Delta state carried between consecutive records of one sealed segment.
+    struct DeltaState { int64_t ts = 0; int tokenId = 0; int doctorId = 0; int patientId = 0; };
+
+    static void putDelta(ByteWriter& w, const Action& a, DeltaState& st) {
+        bool classed = a.token.routineClass != 0; // bit 7: a routine class byte follows
+        w.u8((uint8_t)(a.type | (a.token.type << 4) | (a.slotPreviouslyTaken << 5) | (a.patientExistedBefore << 6) | (classed << 7)));
+        if (classed) w.u8(a.token.routineClass);
+        w.svarint(a.timestamp - st.ts); st.ts = a.timestamp;
+        w.svarint((int64_t)a.token.tokenId - st.tokenId); st.tokenId = a.token.tokenId;
+        w.svarint((int64_t)a.token.patientId - st.patientId); st.patientId = a.token.patientId;
+        w.svarint((int64_t)a.token.doctorId - st.doctorId); st.doctorId = a.token.doctorId;
+        w.svarint(a.token.slotId);
+        w.svarint((int64_t)a.doctorId - a.token.doctorId);
+        w.svarint((int64_t)a.slotId - a.token.slotId);
+        w.svarint(a.severity);
+        w.svarint((int64_t)a.patientIdForUpsert - a.token.patientId);
+        if (a.type == REGISTER_PATIENT || a.type == PATIENT_DELETE) {
+            const Patient& p = a.patientSnapshot;
+            w.svarint((int64_t)p.id - a.patientIdForUpsert); w.str(p.name); w.svarint(p.age); w.str(p.history); w.svarint(p.freq);
+        }
+        if (a.type == RESOURCE_BOOK) {
+            w.varint(a.resourceIds.size());
+            for (int r : a.resourceIds) w.svarint(r);
+        }
+        if (hasApptRange(a.type)) { w.svarint(a.apptStart); w.svarint(a.apptEnd - a.apptStart); }
+        if (a.type == GROUP_CHECK_IN) { // each patient id as a delta from the one before
+            w.varint(a.groupPatients.size());
+            int prev = a.token.patientId;
+            for (int p : a.groupPatients) { w.svarint((int64_t)p - prev); prev = p; }
+        }
+        if (a.type == GROUP_SERVE) w.varint((uint64_t)a.groupCount);
+        if (a.type == CANCEL) { // tokens as deltas from the slot's token, patients as deltas from its patient
+            w.varint(a.overbooked.size());
+            for (auto &o : a.overbooked) { w.svarint((int64_t)o.first - a.token.tokenId); w.svarint((int64_t)o.second - a.token.patientId); }
+        }
+    }
+
+    static bool getDelta(ByteReader& r, Action& a, DeltaState& st) {
+        a = Action();
+        uint8_t head = r.u8();
+        a.type = (ActionType)(head & 15); a.token.type = (TokenType)((head >> 4) & 1);
+        a.slotPreviouslyTaken = (head >> 5) & 1; a.patientExistedBefore = (head >> 6) & 1;
+        if (head >> 7) a.token.routineClass = r.u8();
+        st.ts += r.svarint(); a.timestamp = st.ts;
+        st.tokenId += (int)r.svarint(); a.token.tokenId = st.tokenId;
+        st.patientId += (int)r.svarint(); a.token.patientId = st.patientId;
+        st.doctorId += (int)r.svarint(); a.token.doctorId = st.doctorId;
+        a.token.slotId = (int)r.svarint();
+        a.doctorId = a.token.doctorId + (int)r.svarint();
+        a.slotId = a.token.slotId + (int)r.svarint();
+        a.severity = (int)r.svarint();
+        a.patientIdForUpsert = a.token.patientId + (int)r.svarint();
+        if (a.type == REGISTER_PATIENT || a.type == PATIENT_DELETE) {
+            Patient& p = a.patientSnapshot;
+            p.id = a.patientIdForUpsert + (int)r.svarint(); p.name = r.str(); p.age = (int)r.svarint(); p.history = r.str(); p.freq = (int)r.svarint();
+        }
+        if (a.type == RESOURCE_BOOK) {
+            uint64_t n = r.varint();
+            for (uint64_t i = 0; i < n && r.ok; ++i) a.resourceIds.push_back((int)r.svarint());
+        }
+        if (hasApptRange(a.type)) { a.apptStart = (int)r.svarint(); a.apptEnd = a.apptStart + (int)r.svarint(); }
+        if (a.type == GROUP_CHECK_IN) {
+            uint64_t n = r.varint();
+            int prev = a.token.patientId;
+            for (uint64_t i = 0; i < n && r.ok; ++i) { prev += (int)r.svarint(); a.groupPatients.push_back(prev); }
+        }
+        if (a.type == GROUP_SERVE) a.groupCount = (int)r.varint();
+        if (a.type == CANCEL) {
+            uint64_t n = r.varint();
+            for (uint64_t i = 0; i < n && r.ok; ++i) {
+                int t = a.token.tokenId + (int)r.svarint();
+                a.overbooked.push_back(make_pair(t, a.token.patientId + (int)r.svarint()));
+            }
+        }
+        return r.ok;
+    }
+
+    template <class F>
+    static size_t replayRaw(const uint8_t* data, size_t n, F& f) {
+        ByteReader r(data, n); Action a; size_t cnt = 0;
+        while (!r.atEnd() && getRaw(r, a)) { f(a); ++cnt; }
+        return cnt;
+    }
+
+public:
+    explicit OpLog(uint32_t recordsPerSegment = 4096, bool compress = true)
+        : segmentRecords(recordsPerSegment ? recordsPerSegment : 1), compressSealed(compress) {}
+
+    void append(const Action& a) {
+        putRaw(active, a);
+        if (++activeRecords >= segmentRecords) seal();
+    }
+
+    void seal() {
+        if (activeRecords == 0) return;
+        LogSegment seg;
+        seg.records = activeRecords;
+        seg.rawBytes = active.buf.size();
+        if (compressSealed) {
+            ByteReader r(active.buf);
+            ByteWriter delta; DeltaState st; Action a;
+            while (!r.atEnd() && getRaw(r, a)) putDelta(delta, a, st);
+            seg.bytes = lz::compress(delta.buf.data(), delta.buf.size());
+            seg.compressed = true;
+        } else {
+            seg.bytes = move(active.buf);
+        }
+        sealed.push_back(move(seg));
+        active.buf.clear(); activeRecords = 0;
+    }
+
+    size_t recordCount() const {
+        size_t n = activeRecords;
+        for (auto &s : sealed) n += s.records;
+        return n;
+    }
+    uint64_t rawBytes() const {
+        uint64_t n = active.buf.size();
+        for (auto &s : sealed) n += s.rawBytes;
+        return n;
+    }
+    uint64_t storedBytes() const {
+        uint64_t n = active.buf.size();
+        for (auto &s : sealed) n += s.bytes.size();
+        return n;
+    }
+    size_t segmentCount() const { return sealed.size() + (activeRecords ? 1 : 0); }
+
+    // Calls f(const Action&) for every record in log order; returns the count.
+    template <class F>
+    size_t replay(F f) const {
+        size_t cnt = 0;
+        vector<uint8_t> raw;
+        for (auto &seg : sealed) {
+            if (!seg.compressed) { cnt += replayRaw(seg.bytes.data(), seg.bytes.size(), f); continue; }
+            if (!lz::decompress(seg.bytes.data(), seg.bytes.size(), raw)) return cnt;
+            ByteReader r(raw); DeltaState st; Action a;
+            while (!r.atEnd() && getDelta(r, a, st)) { f(a); ++cnt; }
+        }
+        cnt += replayRaw(active.buf.data(), active.buf.size(), f);
+        return cnt;
+    }
+
+    // On-disk form: the sealed segments followed by the raw active tail.
+    bool saveToFile(const string& path) const {
+        FILE* fp = fopen(path.c_str(), "wb");
+        if (!fp) return false;
+        ByteWriter w;
+        w.varint(sealed.size() + 1);
+        for (auto &s : sealed) {
+            w.u8(s.compressed); w.varint(s.records); w.varint(s.rawBytes); w.varint(s.bytes.size());
+            w.buf.insert(w.buf.end(), s.bytes.begin(), s.bytes.end());
+        }
+        w.u8(0); w.varint(activeRecords); w.varint(active.buf.size()); w.varint(active.buf.size());
+        w.buf.insert(w.buf.end(), active.buf.begin(), active.buf.end());
+        bool ok = fwrite(w.buf.data(), 1, w.buf.size(), fp) == w.buf.size();
+        return fclose(fp) == 0 && ok;
+    }
+
+    bool loadFromFile(const string& path) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp) return false;
+        vector<uint8_t> data; uint8_t chunk[1 << 16]; size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), fp)) > 0) data.insert(data.end(), chunk, chunk + got);
+        fclose(fp);
+        ByteReader r(data);
+        uint64_t n = r.varint();
+        vector<LogSegment> segs;
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            LogSegment s;
+            s.compressed = r.u8() != 0; s.records = (uint32_t)r.varint(); s.rawBytes = r.varint();
+            uint64_t len = r.varint();
+            if (!r.ok || (uint64_t)(r.end - r.p) < len) return false;
+            s.bytes.assign(r.p, r.p + len); r.p += len;
+            segs.push_back(move(s));
+        }
+        if (!r.ok || segs.empty()) return false;
+        active.buf = move(segs.back().bytes); activeRecords = segs.back().records;
+        segs.pop_back();
+        sealed = move(segs);
+        return true;
+    }
+};
+
+// ----------------------------- Undo History -----------------------------
+// The undo stack at bounded memory. The newest actions stay in a deque; once
+// it holds more than keepInMemory, the oldest half is encoded like a sealed
+// OpLog segment (field deltas + LZ) and written to the spill file as one
+// block. When pop() empties the deque it reads the newest block back and
+// the file end moves back to that block, so the file is a stack too. With
+// no spill file every action stays in memory.
+class UndoHistory {
+private:
+    struct Block { uint64_t offset; uint32_t bytes; uint32_t records; };
+    deque<Action> recent;   // oldest first
+    vector<Block> blocks;   // spilled, oldest first
+    size_t spilled = 0;     // actions in blocks
+    FILE* spill = nullptr;
+    string spillPath;
+    size_t keepInMemory = 0;
+    uint64_t fileEnd = 0;
+
+    bool spillOldest() {
+        size_t n = max<size_t>(1, keepInMemory / 2);
+        ByteWriter w; OpLog::DeltaState st;
+        for (size_t i = 0; i < n; ++i) OpLog::putDelta(w, recent[i], st);
+        vector<uint8_t> packed = lz::compress(w.buf.data(), w.buf.size());
+        if (fseek(spill, (long)fileEnd, SEEK_SET) != 0 || fwrite(packed.data(), 1, packed.size(), spill) != packed.size())
+            return false; // keep them in memory
+        blocks.push_back(Block{fileEnd, (uint32_t)packed.size(), (uint32_t)n});
+        fileEnd += packed.size(); spilled += n;
+        recent.erase(recent.begin(), recent.begin() + n);
+        return true;
+    }
+
+    bool pageIn() {
+        const Block b = blocks.back();
+        vector<uint8_t> packed(b.bytes), raw;
+        if (fflush(spill) != 0 || fseek(spill, (long)b.offset, SEEK_SET) != 0 ||
+            fread(packed.data(), 1, packed.size(), spill) != packed.size()) return false;
+        if (!lz::decompress(packed.data(), packed.size(), raw)) return false;
+        ByteReader r(raw); OpLog::DeltaState st; Action a;
+        deque<Action> older;
+        while (!r.atEnd() && OpLog::getDelta(r, a, st)) older.push_back(a);
+        if (older.size() != b.records) return false;
+        recent.insert(recent.begin(), older.begin(), older.end());
+        blocks.pop_back(); spilled -= b.records; fileEnd = b.offset;
+        return true;
+    }
+
+    void closeSpill() {
+        if (!spill) return;
+        fclose(spill); spill = nullptr;
+        remove(spillPath.c_str());
+        blocks.clear(); spilled = 0; fileEnd = 0; keepInMemory = 0;
+    }
+
+public:
+    UndoHistory() = default;
+    UndoHistory(const UndoHistory&) = delete;
+    UndoHistory& operator=(const UndoHistory&) = delete;
+    ~UndoHistory() { closeSpill(); }
+
+    // Spills to path (created or overwritten) beyond keep actions in memory;
+    // an empty path goes back to keeping everything in memory, after reading
+    // spilled actions back. Returns false if the file cannot be opened.
+    bool setSpill(const string& path, size_t keep) {
+        while (!blocks.empty() && pageIn()) {}
+        if (!blocks.empty()) return false;
+        closeSpill();
+        if (path.empty()) return true;
+        spill = fopen(path.c_str(), "w+b");
+        if (!spill) return false;
+        spillPath = path; keepInMemory = max<size_t>(keep, 2);
+        while (recent.size() > keepInMemory && spillOldest()) {}
+        return true;
+    }
+
+    void push(const Action& a) {
+        recent.push_back(a);
+        if (spill && recent.size() > keepInMemory) spillOldest();
+    }
+
+    // Newest action; false when empty or a spilled block cannot be read back.
+    bool pop(Action& out) {
+        if (recent.empty() && (blocks.empty() || !pageIn())) return false;
+        out = move(recent.back()); recent.pop_back();
+        return true;
+    }
+
+    bool empty() const { return recent.empty() && blocks.empty(); }
+    size_t size() const { return recent.size() + spilled; }
+    size_t inMemory() const { return recent.size(); }
+    uint64_t spillBytes() const { return fileEnd; }
+
+    void clear() { recent.clear(); blocks.clear(); spilled = 0; fileEnd = 0; }
+};
+
+// ----------------------------- Slow-Op Watchdog -----------------------------
+// Each watched operation has a latency budget. An operation that finishes
+// over budget leaves a record (arguments, state sizes, phase timings) in a
+// fixed ring of the most recent kSlowOpSlots; fast ones only pay for two
+// clock reads and a compare.
+enum OpKind { OP_ENQUEUE, OP_SERVE, OP_TRIAGE, OP_UNDO, OP_PATIENT_UPSERT, OP_TOPK, OP_BOOK_RESOURCES,
+              OP_BOOK_APPOINTMENT, OP_CHECKPOINT_WRITE, OP_CHECKPOINT_LOAD, OP_GROUP_CHECK_IN, OP_GROUP_SERVE, OP_KIND_COUNT };
+const char* const kOpKindNames[OP_KIND_COUNT] = { "enqueueRoutine", "serveNext", "triageInsert", "undoPop",
+    "patientUpsert", "topKFrequentPatients", "bookWithResources", "bookAppointment", "writeCheckpoint", "loadCheckpoint",
+    "groupCheckIn", "groupServe" };
+
+const int kSlowOpArgs = 3;
+const int kSlowOpPhases = 4;
+const int kSlowOpSlots = 64;
+
+struct SlowOpRecord {
+    OpKind kind = OP_ENQUEUE;
+    int64_t wallMicros = 0;  // when it started
+    int64_t totalNs = 0;
+    int args[kSlowOpArgs] = { -1, -1, -1 };
+    size_t patients = 0, doctors = 0, pending = 0, undoDepth = 0;
+    int phases = 0;
+    const char* phaseName[kSlowOpPhases] = {};
+    int64_t phaseNs[kSlowOpPhases] = {};
+};
+
+class SlowOpLog {
+private:
+    array<SlowOpRecord, kSlowOpSlots> ring;
+    uint64_t written = 0; // total records ever; the ring keeps the last kSlowOpSlots
+    array<int64_t, OP_KIND_COUNT> budgetNs;
+
+public:
+    bool enabled = true;
+
+    SlowOpLog() {
+        budgetNs.fill(2000000); // 2 ms for desk operations
+        budgetNs[OP_TOPK] = 20000000;
+        budgetNs[OP_CHECKPOINT_WRITE] = 50000000;
+        budgetNs[OP_CHECKPOINT_LOAD] = 500000000;
+    }
+
+    int64_t budget(OpKind k) const { return budgetNs[k]; }
+    void setBudget(OpKind k, int64_t micros) { budgetNs[k] = micros * 1000; }
+
+    void record(const SlowOpRecord& r) { ring[written % kSlowOpSlots] = r; ++written; }
+    uint64_t total() const { return written; }
+    void clear() { written = 0; }
+
+    // Oldest first.
+    template <class F>
+    void forEach(F f) const {
+        uint64_t first = written > (uint64_t)kSlowOpSlots ? written - kSlowOpSlots : 0;
+        for (uint64_t i = first; i < written; ++i) f(ring[i % kSlowOpSlots]);
+    }
+
+    void dump(ostream& os) const {
+        os << "Slow operations: " << written << " over budget";
+        if (written > (uint64_t)kSlowOpSlots) os << " (last " << kSlowOpSlots << " kept)";
+        os << "\n";
+        forEach([&](const SlowOpRecord& r) {
+            os << "  " << kOpKindNames[r.kind] << "(";
+            for (int i = 0; i < kSlowOpArgs && r.args[i] != -1; ++i) os << (i ? ", " : "") << r.args[i];
+            os << ") " << r.totalNs / 1000 << " us, budget " << budgetNs[r.kind] / 1000 << " us; patients "
+               << r.patients << ", doctors " << r.doctors << ", pending " << r.pending << ", undo depth " << r.undoDepth << "\n";
+            for (int i = 0; i < r.phases; ++i) os << "    " << r.phaseName[i] << ": " << r.phaseNs[i] / 1000 << " us\n";
+        });
+    }
+};
+
+// ----------------------------- HospitalSystem -----------------------------
+class HospitalSystem {
+private:
+    unordered_map<int, Doctor> doctors;
+    PatientStore patients;
+    TriageHeap triageHeap;
+    UndoHistory undoStack;
+    atomic<int> nextTokenId{1}; // atomic for claimSlotAfter
+    int servedCount = 0;
+    int pendingCountTotal = 0;
+    OpLog* opLog = nullptr;
+    uint64_t stateSum = 0; // sum of per-record hashes, see stateChecksum()
+    unordered_map<string, SlotHeatmap> heatmaps; // by specialization
+    unordered_map<int, ResourceCalendar> resources;
+    unordered_map<int, ResourceBooking> resourceBookings; // by tokenId
+    unordered_map<int, Appointment> appointments;          // by tokenId
+#ifdef HOSPITAL_HAVE_MMAP
+    PersistentQueueStore* queueStore = nullptr;
+#endif
+    // Changed since the last checkpoint (see writeCheckpoint). Patients are
+    // tracked by page (kPatientPageShift bits of id), the rest by record.
+    static const int kPatientPageShift = 6;
+    unordered_set<int> dirtyDoctors, dirtyPatientPages, dirtyAppointments;
+    bool triageDirty = false, resourcesDirty = false;
+    int checkpointDeltas = -1;        // deltas chained on the current base, -1 before the first base
+    uint64_t checkpointGeneration = 0; // id of the current base, repeated in its deltas
+    size_t checkpointBytes = 0;        // size of the last checkpoint file written
+    SlowOpLog slowLog;
+    OverbookPolicy overbookPolicy;
+    TimelinePolicy timelinePolicy = TIMELINE_APPOINTMENTS_FIRST;
+    RoutineClassPolicy routineClassPolicy;
+    int clockMinute = -1;              // minutes into the week, -1 = no clock (see setClock)
+    IdIndex slotPatient; // tokenId -> patient, for tokens holding or waiting on a slot
+    static const size_t kCompactMovesPerAction = 64; // patient-store compaction piggybacks on each action
+    // Cold patient history: LZ-packed bytes by patient id while the Patient's
+    // own history string is empty. The checksum always covers the plain text.
+    unordered_map<int, vector<uint8_t>> coldHistory;
+    string historyDict;                        // shared LZ dictionary, see trainHistoryDictionary
+    uint64_t touchClock = 0;      // counts patient mutations; rows keep the value of their last one
+    uint64_t checkpointTouch = 0; // touchClock when the dirty sets were last cleared
+    // Cohort bitmaps (see cohortCount). Age bands and pending tokens are
+    // rebuilt from the state on load; the event ones (triaged today, seen by
+    // specialization) are not stored and start empty after a checkpoint load.
+    array<RoaringBitmap, kAgeBands> ageBands;
+    CountedBitmap pendingPatients, triagedToday;
+    unordered_map<string, CountedBitmap> seenBySpec; // Doctor::seen points in here
+    int cohortDay = INT_MIN; // day triagedToday covers
+    VisitHistory visits;     // served visits; not stored, starts empty after a checkpoint load
+    // Slots claimed by claimSlotAfter and not yet booked by
+    // applyConcurrentClaims; a lock-free stack, newest first.
+    struct SlotClaim { int doctorId; SlotNode* slot; Token token; SlotClaim* next; };
+    atomic<SlotClaim*> claimInbox{nullptr};
+    atomic<int> claimsInFlight{0};
+    // Runs first in every watched operation, recordAction and slot add or
+    // cancel: waits out claimSlotAfter calls still running, then books any
+    // claims left in the inbox, so a missed applyConcurrentClaims can never
+    // leave the checksum, heatmap or undo log without them. Two loads when
+    // there is nothing to do.
+    void settleClaims() {
+        int spins = 0;
+        while (claimsInFlight.load(memory_order_acquire)) cpuRelax(spins);
+        if (claimInbox.load(memory_order_relaxed)) applyConcurrentClaims();
+    }
+
+    static int64_t nowMicros() {
+        return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Every token a patient waits on goes through these, which keep the
+    // pending total and the pending cohort together. Recovered tokens may
+    // have no patient (-1) and count in the total only.
+    void openToken(int patientId) { ++pendingCountTotal; if (patientId != -1) pendingPatients.inc(patientId); }
+    void closeToken(int patientId) { --pendingCountTotal; if (patientId != -1) pendingPatients.dec(patientId); }
+    void cohortAdd(const Patient& p) { ageBands[ageBand(p.age)].add((uint32_t)p.id); }
+    void cohortRemove(const Patient& p) { ageBands[ageBand(p.age)].remove((uint32_t)p.id); }
+    // Days follow setClock when it is on, else the wall clock (UTC).
+    void rollCohortDay() {
+        int day = clockMinute >= 0 ? clockMinute / (24 * 60) : (int)(nowMicros() / 86400000000LL);
+        if (day != cohortDay) { triagedToday.clear(); cohortDay = day; }
+    }
+
+    // Splits q into its age bands [lo, hi] and the intersection of its
+    // filters, built in acc from the smallest up; filtered is false when q
+    // sets none. Returns false when q cannot match anyone.
+    bool cohortOperands(const CohortQuery& q, int& lo, int& hi, RoaringBitmap& acc, bool& filtered) {
+        if (q.maxAge < q.minAge) return false;
+        lo = ageBand(q.minAge); hi = ageBand(q.maxAge);
+        vector<const RoaringBitmap*> ops;
+        if (q.pending) ops.push_back(&pendingPatients.bits);
+        if (q.triagedToday) { rollCohortDay(); ops.push_back(&triagedToday.bits); }
+        if (!q.seenBy.empty()) {
+            auto it = seenBySpec.find(q.seenBy);
+            if (it == seenBySpec.end()) return false;
+            ops.push_back(&it->second.bits);
+        }
+        filtered = !ops.empty();
+        if (!filtered) return true;
+        sort(ops.begin(), ops.end(), [](const RoaringBitmap* a, const RoaringBitmap* b) { return a->cardinality() < b->cardinality(); });
+        acc = *ops[0];
+        for (size_t i = 1; i < ops.size(); ++i) acc.andWith(*ops[i]);
+        return true;
+    }
+
+    void logVisit(const Token& t, int doctorId, VisitKind kind, int64_t at) {
+        if (t.patientId == -1) return;
+        VisitRecord v;
+        v.at = at; v.tokenId = t.tokenId; v.patientId = t.patientId; v.doctorId = doctorId; v.slotId = t.slotId; v.kind = kind;
+        visits.append(v);
+    }
+
+    // upserted: for REGISTER_PATIENT the log gets the new record, the undo stack the old one.
+    // Actions that cannot be undone only go to the log. Returns the action's timestamp.
+    int64_t recordAction(Action act, const Patient* upserted = nullptr, bool undoable = true) {
+        settleClaims();
+        if (patients.needsCompaction()) patients.compactStep(kCompactMovesPerAction);
+        act.timestamp = nowMicros();
+        if (opLog) {
+            if (upserted) { Action logged = act; logged.patientSnapshot = *upserted; opLog->append(logged); }
+            else opLog->append(act);
+        }
+        if (undoable) undoStack.push(act);
+        return act.timestamp;
+    }
+
+    // Times one watched operation from construction to destruction; phase()
+    // closes the open phase and starts the next. Reports to slowLog only when
+    // the total exceeds the operation's budget.
+    class OpWatch {
+    private:
+        HospitalSystem& H;
+        SlowOpRecord rec;
+        chrono::steady_clock::time_point t0, mark;
+        bool on;
+
+    public:
+        OpWatch(HospitalSystem& h, OpKind kind, int a0 = -1, int a1 = -1, int a2 = -1) : H(h), on(h.slowLog.enabled) {
+            h.settleClaims();
+            if (!on) return;
+            rec.kind = kind; rec.args[0] = a0; rec.args[1] = a1; rec.args[2] = a2;
+            t0 = mark = chrono::steady_clock::now();
+        }
+        void phase(const char* name) {
+            if (!on || rec.phases == kSlowOpPhases) return;
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            if (rec.phases > 0) rec.phaseNs[rec.phases - 1] = chrono::duration_cast<chrono::nanoseconds>(now - mark).count();
+            rec.phaseName[rec.phases++] = name;
+            mark = now;
+        }
+        ~OpWatch() {
+            if (!on) return;
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            rec.totalNs = chrono::duration_cast<chrono::nanoseconds>(now - t0).count();
+            if (rec.totalNs <= H.slowLog.budget(rec.kind)) return;
+            if (rec.phases > 0) rec.phaseNs[rec.phases - 1] = chrono::duration_cast<chrono::nanoseconds>(now - mark).count();
+            rec.wallMicros = nowMicros() - rec.totalNs / 1000;
+            rec.patients = H.patients.size(); rec.doctors = H.doctors.size();
+            rec.pending = H.pendingCountTotal; rec.undoDepth = H.undoStack.size();
+            H.slowLog.record(rec);
+        }
+    };
+
+    // ---- incremental state checksum ----
+    // Each record (doctor, patient, slot, queued token, triage entry) hashes to a
+    // 64-bit value; stateSum is their wrapping sum, so records can be added and
+    // removed in any order in O(1) and duplicates still count.
+    static uint64_t mix64(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+    static uint64_t hashStr(const string& s) {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+        return h;
+    }
+    static uint64_t hashCombine(uint64_t h, uint64_t v) { return mix64(h ^ (v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2))); }
+    static uint64_t hashToken(uint64_t tag, const Token& t) {
+        uint64_t h = hashCombine(tag, (uint32_t)t.tokenId);
+        h = hashCombine(h, (uint32_t)t.patientId); h = hashCombine(h, (uint32_t)t.doctorId);
+        h = hashCombine(h, (uint32_t)t.slotId); return hashCombine(h, (uint32_t)t.type);
+    }
+    static uint64_t hashDoctor(const Doctor& D) {
+        uint64_t h = hashCombine(1, (uint32_t)D.id);
+        h = hashCombine(h, hashStr(D.name)); h = hashCombine(h, hashStr(D.specialization));
+        return hashCombine(h, (uint32_t)D.capacity);
+    }
+    static uint64_t hashPatientFields(const Patient& p) { // all but freq, which changes most
+        uint64_t h = hashCombine(2, (uint32_t)p.id);
+        h = hashCombine(h, hashStr(p.name)); h = hashCombine(h, (uint32_t)p.age);
+        return hashCombine(h, hashStr(p.history));
+    }
+    static uint64_t hashPatient(const Patient& p) { return hashCombine(hashPatientFields(p), (uint32_t)p.freq); }
+    static uint64_t hashSlot(int doctorId, const SlotNode* s) { return hashSlotAs(doctorId, s, s->taken(), s->tokenId()); }
+    // The slot's hash as if its state word held (taken, tokenId).
+    static uint64_t hashSlotAs(int doctorId, const SlotNode* s, bool taken, int tokenId) {
+        uint64_t h = hashCombine(3, (uint32_t)doctorId);
+        h = hashCombine(h, (uint32_t)s->slotId); h = hashCombine(h, hashStr(s->startTime));
+        h = hashCombine(h, hashStr(s->endTime)); h = hashCombine(h, (uint32_t)s->weekday);
+        h = hashCombine(h, taken);
+        for (int t : s->overbooked) h = hashCombine(h, (uint32_t)t);
+        return hashCombine(h, (uint32_t)tokenId);
+    }
+    static uint64_t hashQueued(const Token& t) { return hashToken(4, t); }
+    static uint64_t hashSession(int doctorId, int sessionId, const GroupSession& g) {
+        uint64_t h = hashCombine(hashCombine(9, (uint32_t)doctorId), (uint32_t)sessionId);
+        h = hashCombine(h, hashStr(g.startTime)); h = hashCombine(h, hashStr(g.endTime));
+        h = hashCombine(h, (uint32_t)g.weekday); h = hashCombine(h, (uint32_t)g.capacity);
+        return hashCombine(h, (uint32_t)g.served);
+    }
+    static uint64_t hashCheckedIn(const Token& t) { return hashToken(10, t); }
+    static uint64_t hashAvailability(int resId, int start, int end) {
+        return hashCombine(hashCombine(hashCombine(7, (uint32_t)resId), (uint32_t)start), (uint32_t)end);
+    }
+    static uint64_t hashDoctorAvailability(int doctorId, int start, int end) {
+        return hashCombine(hashCombine(hashCombine(8, (uint32_t)doctorId), (uint32_t)start), (uint32_t)end);
+    }
+    static uint64_t hashAppointment(int tokenId, const Appointment& a) {
+        uint64_t h = hashCombine(hashDoctorAvailability(a.doctorId, a.start, a.end), (uint32_t)tokenId);
+        return hashCombine(h, (uint32_t)a.patientId);
+    }
+    static uint64_t hashReservation(int resId, int tokenId, const ResourceBooking& rb) {
+        return hashCombine(hashAvailability(resId, rb.start, rb.end), (uint32_t)tokenId);
+    }
+
+    void holdResources(int tokenId) {
+        auto it = resourceBookings.find(tokenId);
+        if (it == resourceBookings.end() || it->second.held) return;
+        ResourceBooking& rb = it->second;
+        for (int rid : rb.resourceIds) { resources[rid].reserve(rb.start, rb.end); stateSum += hashReservation(rid, tokenId, rb); }
+        rb.held = true; resourcesDirty = true;
+    }
+
+    void freeResources(int tokenId) {
+        auto it = resourceBookings.find(tokenId);
+        if (it == resourceBookings.end() || !it->second.held) return;
+        ResourceBooking& rb = it->second;
+        for (int rid : rb.resourceIds) { resources[rid].addFree(rb.start, rb.end); stateSum -= hashReservation(rid, tokenId, rb); }
+        rb.held = false; resourcesDirty = true;
+    }
+    static uint64_t hashTriage(const TriagedToken& tt) { return hashCombine(hashToken(5, tt.token), (uint32_t)tt.severity); }
+
+    uint64_t countersHash() const {
+        uint64_t h = hashCombine(6, (uint32_t)nextTokenId);
+        h = hashCombine(h, (uint32_t)servedCount);
+        return hashCombine(h, (uint32_t)pendingCountTotal);
+    }
+
+    enum SlotOutcome { SLOT_RELEASED, SLOT_SERVED, SLOT_NO_SHOW };
+
+    // claimed: the state word was already set by claimSlotAfter; only the
+    // bookkeeping is done here. The token's slotPatient entry is set first so
+    // the store records the patient with it.
+    void takeSlot(Doctor& D, SlotNode* s, int tokenId, bool claimed = false) {
+        stateSum -= claimed ? hashSlotAs(D.id, s, false, -1) : hashSlot(D.id, s);
+        s->setState(true, tokenId);
+        stateSum += hashSlot(D.id, s);
+        dirtyDoctors.insert(D.id);
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore && D.mapped[0] && !queueStore->setSlot(D.id, s->slotId, true, tokenId, slotPatientOf(tokenId)))
+            refuse(FAIL_STORE_FULL, &D, nullptr);
+#endif
+        SlotBucketCounts& b = D.heat->buckets[s->heatBucket()];
+        --b.free; ++b.booked;
+        if (s->timed()) D.freeSlots.erase(make_pair(s->weekStart(), s->slotId));
+        D.noteBooked(s);
+        holdResources(tokenId);
+    }
+
+    void releaseSlot(Doctor& D, SlotNode* s, SlotOutcome outcome = SLOT_RELEASED) {
+        freeResources(s->tokenId());
+        if (s->timed()) D.freeSlots[make_pair(s->weekStart(), s->slotId)] = s;
+        stateSum -= hashSlot(D.id, s);
+        s->setState(false, -1);
+        stateSum += hashSlot(D.id, s);
+        dirtyDoctors.insert(D.id);
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore && D.mapped[0] && !queueStore->setSlot(D.id, s->slotId, false, -1, -1))
+            refuse(FAIL_STORE_FULL, &D, nullptr);
+#endif
+        SlotBucketCounts& b = D.heat->buckets[s->heatBucket()];
+        --b.booked; ++b.free;
+        if (outcome == SLOT_SERVED) { ++b.served; ++D.attendance[s->heatBucket()].shows; }
+        else if (outcome == SLOT_NO_SHOW) { ++b.noShow; ++D.attendance[s->heatBucket()].noShows; }
+    }
+
+    // Overbooked tokens wait behind the slot's token; once the slot is
+    // released the first of them takes it.
+    void promoteOverbooked(Doctor& D, SlotNode* s) {
+        if (s->taken() || s->overbooked.empty()) return;
+        stateSum -= hashSlot(D.id, s);
+        int next = s->overbooked.front();
+        s->overbooked.erase(s->overbooked.begin());
+        stateSum += hashSlot(D.id, s);
+        takeSlot(D, s, next);
+        persistOverbooked(D, s);
+    }
+
+    // Undo of a promotion: the slot's token goes back to the head of the line.
+    void demoteToOverbooked(Doctor& D, SlotNode* s) {
+        int tokenId = s->tokenId();
+        releaseSlot(D, s);
+        stateSum -= hashSlot(D.id, s);
+        s->overbooked.insert(s->overbooked.begin(), tokenId);
+        stateSum += hashSlot(D.id, s);
+        persistOverbooked(D, s);
+    }
+
+    void setOverbooked(Doctor& D, SlotNode* s, const vector<int>& tokens) {
+        stateSum -= hashSlot(D.id, s);
+        s->overbooked = tokens;
+        stateSum += hashSlot(D.id, s);
+        dirtyDoctors.insert(D.id);
+        persistOverbooked(D, s);
+    }
+
+    // Writes the slot's overbooked line, with each token's patient, to the
+    // store. A line the slot table has no room for is counted as store-full.
+    void persistOverbooked(Doctor& D, SlotNode* s) {
+#ifdef HOSPITAL_HAVE_MMAP
+        if (!queueStore || !D.mapped[0]) return;
+        vector<pair<int,int>> line;
+        for (int t : s->overbooked) line.push_back(make_pair(t, slotPatientOf(t)));
+        if (!queueStore->setOverbooked(D.id, s->slotId, line)) refuse(FAIL_STORE_FULL, &D, nullptr);
+#else
+        (void)D; (void)s;
+#endif
+    }
+
+    // Whether the store can take one more slot entry for D: refused
+    // bookings beat ones that quietly go unpersisted.
+    bool storeHasRoom(const Doctor& D) const {
+#ifdef HOSPITAL_HAVE_MMAP
+        return !queueStore || !D.mapped[0] || queueStore->entriesLeft(D.id) > 0;
+#else
+        (void)D; return true;
+#endif
+    }
+
+    // Counts a refused booking or triage call, globally and for D when it is
+    // known, and reports the reason through why. Returns -1 for the caller.
+    int refuse(FailReason r, Doctor* D, FailReason* why) {
+        FailCounters::instance().bump(r);
+        if (D) ++D->failures[r];
+        if (why) *why = r;
+        return -1;
+    }
+
+    int slotPatientOf(int tokenId) const {
+        const int* p = slotPatient.find(tokenId);
+        return p ? *p : -1;
+    }
+    void setSlotPatient(int tokenId, int patientId) { if (patientId != -1) slotPatient[tokenId] = patientId; }
+
+    // A row stamped since the last checkpoint already has its page marked.
+    void markPatientDirty(int patientId, int handle = -1) {
+        ++touchClock;
+        if (!patients.resolve(handle, patientId) || patients.touch(handle, touchClock) <= checkpointTouch)
+            dirtyPatientPages.insert(patientId >> kPatientPageShift);
+    }
+
+    // Rows are stamped on every mutation and on checkpoint load; an unstamped
+    // row has not been seen long enough to call idle.
+    bool idleFor(int patientId, uint64_t idleTouches) const {
+        uint64_t touched = patients.lastTouch(patientId);
+        return touched && touchClock - touched >= idleTouches;
+    }
+
+    bool erasePatient(int patientId, bool undoable) {
+        thawPatient(patientId);
+        const Patient* p = patients.find(patientId);
+        if (!p) return false;
+        Action act; act.type = PATIENT_DELETE;
+        act.patientIdForUpsert = patientId; act.patientExistedBefore = true; act.patientSnapshot = *p;
+        stateSum -= hashPatient(*p);
+        cohortRemove(*p);
+        patients.erase(patientId);
+        markPatientDirty(patientId);
+        recordAction(act, nullptr, undoable);
+        return true;
+    }
+
+    const uint8_t* dictData() const { return (const uint8_t*)historyDict.data(); }
+
+    string unpackHistory(const vector<uint8_t>& packed) const {
+        vector<uint8_t> raw;
+        if (!lz::decompress(packed.data(), packed.size(), raw, dictData(), historyDict.size())) return string();
+        return string(raw.begin(), raw.end());
+    }
+
+    // Every mutation of a patient goes through here first, so a cold record
+    // is plain again before it is hashed, snapshotted or changed.
+    void thawPatient(int patientId) {
+        auto cit = coldHistory.find(patientId);
+        if (cit == coldHistory.end()) return;
+        if (Patient* p = patients.find(patientId)) p->history = unpackHistory(cit->second);
+        coldHistory.erase(cit);
+        patients.setCold(patientId, false);
+    }
+
+    // The record as stored logically (cold history unpacked).
+    const Patient& plainPatient(const Patient& p, Patient& scratch) const {
+        auto cit = coldHistory.find(p.id);
+        if (cit == coldHistory.end()) return p;
+        scratch = p; scratch.history = unpackHistory(cit->second);
+        return scratch;
+    }
+
+    // handle is the patient's PatientStore handle (Token::patientHandle), refreshed
+    // if stale. With the row's field hash cached this touches no hash table and
+    // leaves a cold history packed.
+    void bumpFreq(int patientId, int& handle) {
+        Patient* pp = patients.resolve(handle, patientId);
+        if (!pp) return; // deleted while its token was pending
+        uint64_t fields = patients.fieldsHash(handle);
+        if (!fields) {
+            if (patients.isCold(handle)) thawPatient(patientId);
+            fields = hashPatientFields(*pp);
+            patients.setFieldsHash(handle, fields);
+        }
+        Patient& p = *pp;
+        stateSum -= hashCombine(fields, (uint32_t)p.freq);
+        ++p.freq;
+        stateSum += hashCombine(fields, (uint32_t)p.freq);
+        markPatientDirty(patientId, handle);
+    }
+
+#ifdef HOSPITAL_HAVE_MMAP
+    // Brings a slot in line with the store: a recovered state wins, otherwise the current one is written.
+    // Returns false when the store has no room for the slot.
+    bool syncSlotWithStore(Doctor& D, SlotNode* s) {
+        bool taken; int tokenId, patientId;
+        vector<pair<int,int>> line;
+        if (!queueStore->getSlot(D.id, s->slotId, taken, tokenId, patientId, line)) {
+            if (!queueStore->setSlot(D.id, s->slotId, s->taken(), s->tokenId(), s->taken() ? slotPatientOf(s->tokenId()) : -1))
+                return false;
+            persistOverbooked(D, s);
+            return true;
+        }
+        vector<int> tokens;
+        for (auto &e : line) tokens.push_back(e.first);
+        if (taken == s->taken() && tokenId == s->tokenId() && tokens == s->overbooked) return true;
+        if (!s->overbooked.empty()) {
+            for (int t : s->overbooked) { closeToken(slotPatientOf(t)); slotPatient.erase(t); }
+            stateSum -= hashSlot(D.id, s); s->overbooked.clear(); stateSum += hashSlot(D.id, s);
+        }
+        if (s->taken()) { closeToken(slotPatientOf(s->tokenId())); slotPatient.erase(s->tokenId()); releaseSlot(D, s); }
+        if (taken) {
+            setSlotPatient(tokenId, patientId);
+            takeSlot(D, s, tokenId); openToken(patientId);
+            nextTokenId = max(nextTokenId.load(), tokenId + 1);
+        }
+        for (auto &e : line) {
+            setSlotPatient(e.first, e.second); openToken(e.second);
+            nextTokenId = max(nextTokenId.load(), e.first + 1);
+        }
+        stateSum -= hashSlot(D.id, s); s->overbooked = tokens; stateSum += hashSlot(D.id, s);
+        dirtyDoctors.insert(D.id);
+        return true;
+    }
+
+    // Moves the doctor's routine queue into the store. A queue recovered from
+    // the file replaces the in-memory one; otherwise the in-memory one is copied in.
+    bool bindDoctorToStore(Doctor& D) {
+        array<MappedRoutineRing*, ROUTINE_CLASS_COUNT> rings;
+        array<bool, ROUTINE_CLASS_COUNT> existed;
+        for (int c = 0; c < ROUTINE_CLASS_COUNT; ++c) {
+            bool e = false;
+            rings[c] = queueStore->ringFor(D.id, c, D.capacity, e);
+            existed[c] = e;
+            if (!rings[c]) return false;
+        }
+        for (int c = 0; c < ROUTINE_CLASS_COUNT; ++c) {
+            MappedRoutineRing* ring = rings[c];
+            if (existed[c]) {
+                D.forEachQueuedIn(c, [&](const Token& t) { stateSum -= hashQueued(t); closeToken(t.patientId); });
+                ring->forEach([&](const Token& t) {
+                    stateSum += hashQueued(t); openToken(t.patientId);
+                    nextTokenId = max(nextTokenId.load(), t.tokenId + 1);
+                });
+            } else {
+                D.forEachQueuedIn(c, [&](const Token& t) { ring->push(t); });
+            }
+            D.mapped[c] = ring;
+        }
+        D.resyncClasses();
+        dirtyDoctors.insert(D.id);
+        for (SlotNode* s = D.slotHead; s; s = s->next)
+            if (!syncSlotWithStore(D, s)) refuse(FAIL_STORE_FULL, &D, nullptr);
+        return true;
+    }
+#endif
+
+    // ---- checkpoints ----
+    // File layout: header (magic, kind, base generation, delta index,
+    // counters), then sections for doctors, heatmaps, patient pages, triage,
+    // appointments and resources. A base holds every record; a delta only the
+    // dirty ones, with a present flag so removals replace the record too.
+    static const uint32_t kCheckpointMagic = 0x504B4348; // "HCKP"
+    enum { CKPT_BASE = 0, CKPT_DELTA = 1 };
+
+    static string deltaPath(const string& prefix, int n) { return prefix + ".delta." + to_string(n); }
+
+    static void putToken(ByteWriter& w, const Token& t) {
+        w.svarint(t.tokenId); w.svarint(t.patientId); w.svarint(t.doctorId); w.svarint(t.slotId); w.u8((uint8_t)(t.type | t.routineClass << 1));
+    }
+    static Token getToken(ByteReader& r) {
+        Token t;
+        t.tokenId = (int)r.svarint(); t.patientId = (int)r.svarint(); t.doctorId = (int)r.svarint();
+        t.slotId = (int)r.svarint();
+        uint8_t kind = r.u8();
+        t.type = (kind & 1) ? EMERGENCY : ROUTINE; t.routineClass = kind >> 1;
+        return t;
+    }
+    static void putIntervals(ByteWriter& w, const vector<pair<int,int>>& v) {
+        w.varint(v.size());
+        for (auto &iv : v) { w.svarint(iv.first); w.svarint(iv.second); }
+    }
+    static vector<pair<int,int>> getIntervals(ByteReader& r) {
+        vector<pair<int,int>> v;
+        uint64_t n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) { int a = (int)r.svarint(); int b = (int)r.svarint(); v.push_back(make_pair(a, b)); }
+        return v;
+    }
+
+    void putDoctor(ByteWriter& w, const Doctor& D) const {
+        w.str(D.name); w.str(D.specialization); w.varint(D.capacity);
+        size_t n = 0;
+        for (SlotNode* s = D.slotHead; s; s = s->next) ++n;
+        w.varint(n);
+        for (SlotNode* s = D.slotHead; s; s = s->next) {
+            w.svarint(s->slotId); w.str(s->startTime); w.str(s->endTime); w.u8((uint8_t)s->weekday);
+            w.u8(s->taken()); w.svarint(s->tokenId()); w.svarint(slotPatientOf(s->tokenId()));
+            w.varint(s->overbooked.size());
+            for (int t : s->overbooked) { w.svarint(t); w.svarint(slotPatientOf(t)); }
+        }
+        w.varint(D.pendingCount());
+        D.forEachQueued([&](const Token& t) { putToken(w, t); });
+        putIntervals(w, D.availability);
+        size_t used = 0;
+        for (auto &a : D.attendance) used += (a.shows || a.noShows);
+        w.varint(used);
+        for (int b = 0; b < kHeatBuckets; ++b)
+            if (D.attendance[b].shows || D.attendance[b].noShows) { w.varint(b); w.varint(D.attendance[b].shows); w.varint(D.attendance[b].noShows); }
+        w.varint(D.sessions.size());
+        for (auto &kv : D.sessions) {
+            const GroupSession& g = kv.second;
+            w.svarint(kv.first); w.str(g.startTime); w.str(g.endTime); w.u8((uint8_t)g.weekday);
+            w.varint(g.capacity); w.varint(g.served); w.varint(g.roster.size());
+            for (const Token& t : g.roster) putToken(w, t);
+        }
+    }
+    // Replaces doctor id with the encoded record; derived indexes are rebuilt later.
+    void getDoctor(ByteReader& r, int id) {
+        string name = r.str(), spec = r.str();
+        int cap = (int)r.varint();
+        doctors.erase(id);
+        Doctor& D = doctors.emplace(id, Doctor(id, name, spec, cap)).first->second;
+        uint64_t n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            int sid = (int)r.svarint(); string st = r.str(), en = r.str(); int day = r.u8();
+            SlotNode* s = D.insertSlot(sid, st, en, day);
+            bool taken = r.u8() != 0;
+            s->setState(taken, (int)r.svarint());
+            int holder = (int)r.svarint();
+            if (taken) setSlotPatient(s->tokenId(), holder);
+            uint64_t k = r.varint();
+            for (uint64_t j = 0; j < k && r.ok; ++j) {
+                int t = (int)r.svarint();
+                s->overbooked.push_back(t); setSlotPatient(t, (int)r.svarint());
+            }
+        }
+        n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) D.enqueueRoutine(getToken(r));
+        D.availability = getIntervals(r);
+        n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            uint64_t b = r.varint();
+            SlotAttendance a; a.shows = (int)r.varint(); a.noShows = (int)r.varint();
+            if (b < (uint64_t)kHeatBuckets) D.attendance[b] = a;
+        }
+        n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            GroupSession& g = D.sessions[(int)r.svarint()];
+            g.startTime = r.str(); g.endTime = r.str(); g.weekday = r.u8();
+            g.capacity = (int)r.varint(); g.served = r.varint();
+            uint64_t k = r.varint();
+            for (uint64_t j = 0; j < k && r.ok; ++j) g.roster.push_back(getToken(r));
+            if (g.served > g.roster.size()) { g.served = g.roster.size(); r.ok = false; }
+        }
+    }
+
+    void putHeatmap(ByteWriter& w, const SlotHeatmap& hm) const {
+        size_t used = 0;
+        for (auto &b : hm.buckets) used += (b.booked || b.free || b.served || b.noShow);
+        w.varint(used);
+        for (int i = 0; i < kHeatBuckets; ++i) {
+            const SlotBucketCounts& b = hm.buckets[i];
+            if (!(b.booked || b.free || b.served || b.noShow)) continue;
+            w.varint(i); w.svarint(b.booked); w.svarint(b.free); w.svarint(b.served); w.svarint(b.noShow);
+        }
+    }
+    static void getHeatmap(ByteReader& r, SlotHeatmap& hm) {
+        hm = SlotHeatmap();
+        uint64_t n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            uint64_t k = r.varint();
+            SlotBucketCounts b;
+            b.booked = (int)r.svarint(); b.free = (int)r.svarint(); b.served = (int)r.svarint(); b.noShow = (int)r.svarint();
+            if (k < (uint64_t)kHeatBuckets) hm.buckets[k] = b;
+        }
+    }
+
+    static void putPatient(ByteWriter& w, const Patient& p) {
+        w.svarint(p.id); w.str(p.name); w.svarint(p.age); w.str(p.history); w.svarint(p.freq);
+    }
+    static Patient getPatient(ByteReader& r) {
+        Patient p;
+        p.id = (int)r.svarint(); p.name = r.str(); p.age = (int)r.svarint(); p.history = r.str(); p.freq = (int)r.svarint();
+        return p;
+    }
+
+    void putResources(ByteWriter& w) const {
+        w.varint(resources.size());
+        for (auto &kv : resources) {
+            w.svarint(kv.first); w.str(kv.second.name); w.str(kv.second.kind); putIntervals(w, kv.second.availability);
+        }
+        w.varint(resourceBookings.size());
+        for (auto &kv : resourceBookings) {
+            const ResourceBooking& rb = kv.second;
+            w.svarint(kv.first); w.svarint(rb.start); w.svarint(rb.end); w.u8(rb.held);
+            w.varint(rb.resourceIds.size());
+            for (int rid : rb.resourceIds) w.svarint(rid);
+        }
+    }
+    void getResources(ByteReader& r) {
+        resources.clear(); resourceBookings.clear();
+        uint64_t n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            int id = (int)r.svarint(); string name = r.str(), kind = r.str();
+            ResourceCalendar& rc = resources.emplace(id, ResourceCalendar(id, name, kind)).first->second;
+            rc.availability = getIntervals(r);
+        }
+        n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            int tokenId = (int)r.svarint();
+            ResourceBooking& rb = resourceBookings[tokenId];
+            rb.start = (int)r.svarint(); rb.end = (int)r.svarint(); rb.held = r.u8() != 0;
+            uint64_t k = r.varint();
+            for (uint64_t j = 0; j < k && r.ok; ++j) rb.resourceIds.push_back((int)r.svarint());
+        }
+    }
+
+    void putTriage(ByteWriter& w) const {
+        auto heapCopy = triageHeap;
+        w.varint(heapCopy.size());
+        while (!heapCopy.empty()) { w.svarint(heapCopy.top().severity); putToken(w, heapCopy.top().token); heapCopy.pop(); }
+    }
+
+    void encodeCheckpoint(ByteWriter& w, bool base, uint64_t generation, int deltaIndex) const {
+        w.fixed32(kCheckpointMagic); w.u8(base ? CKPT_BASE : CKPT_DELTA);
+        w.fixed64(generation); w.varint(deltaIndex);
+        w.svarint(nextTokenId); w.svarint(servedCount); w.svarint(pendingCountTotal);
+
+        // doctors: id, present, record
+        vector<int> ids;
+        if (base) for (auto &kv : doctors) ids.push_back(kv.first);
+        else ids.assign(dirtyDoctors.begin(), dirtyDoctors.end());
+        w.varint(ids.size());
+        unordered_set<string> specs;
+        for (int id : ids) {
+            auto it = doctors.find(id);
+            w.svarint(id); w.u8(it != doctors.end());
+            if (it != doctors.end()) { putDoctor(w, it->second); specs.insert(it->second.specialization); }
+        }
+        // heatmaps of the specializations touched above
+        if (base) for (auto &kv : heatmaps) specs.insert(kv.first);
+        w.varint(specs.size());
+        for (auto &sp : specs) {
+            w.str(sp);
+            auto it = heatmaps.find(sp);
+            if (it != heatmaps.end()) putHeatmap(w, it->second); else putHeatmap(w, SlotHeatmap());
+        }
+
+        // patients: a base lists records, a delta whole pages (page, count, records)
+        if (base) {
+            w.varint(patients.size());
+            Patient scratch;
+            patients.forEach([&](const Patient& p) { putPatient(w, plainPatient(p, scratch)); });
+        } else {
+            w.varint(dirtyPatientPages.size());
+            for (int page : dirtyPatientPages) {
+                w.svarint(page);
+                vector<const Patient*> rows;
+                int first = (int)((unsigned)page << kPatientPageShift);
+                for (int i = 0; i < (1 << kPatientPageShift); ++i) {
+                    if (const Patient* p = patients.find(first + i)) rows.push_back(p);
+                }
+                w.varint(rows.size());
+                Patient scratch;
+                for (const Patient* p : rows) putPatient(w, plainPatient(*p, scratch));
+            }
+        }
+
+        w.u8(base || triageDirty);
+        if (base || triageDirty) putTriage(w);
+
+        // appointments: tokenId, present, record
+        ids.clear();
+        if (base) for (auto &kv : appointments) ids.push_back(kv.first);
+        else ids.assign(dirtyAppointments.begin(), dirtyAppointments.end());
+        w.varint(ids.size());
+        for (int id : ids) {
+            auto it = appointments.find(id);
+            w.svarint(id); w.u8(it != appointments.end());
+            if (it != appointments.end()) {
+                w.svarint(it->second.doctorId); w.svarint(it->second.patientId); w.svarint(it->second.start); w.svarint(it->second.end);
+            }
+        }
+
+        w.u8(base || resourcesDirty);
+        if (base || resourcesDirty) putResources(w);
+    }
+
+    // Applies one checkpoint file on top of the current state. A delta must
+    // carry the loaded base's generation and the next delta index.
+    bool applyCheckpoint(const vector<uint8_t>& data, bool base, int deltaIndex) {
+        ByteReader r(data);
+        if (r.fixed32() != kCheckpointMagic || r.u8() != (base ? CKPT_BASE : CKPT_DELTA)) return false;
+        uint64_t generation = r.fixed64();
+        if ((int)r.varint() != deltaIndex || !r.ok) return false;
+        if (!base && generation != checkpointGeneration) return false;
+        checkpointGeneration = generation;
+        nextTokenId = (int)r.svarint(); servedCount = (int)r.svarint(); pendingCountTotal = (int)r.svarint();
+
+        uint64_t n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            int id = (int)r.svarint();
+            if (r.u8()) getDoctor(r, id); else doctors.erase(id);
+        }
+        n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) { string sp = r.str(); getHeatmap(r, heatmaps[sp]); }
+
+        n = r.varint();
+        if (base) {
+            for (uint64_t i = 0; i < n && r.ok; ++i) { Patient p = getPatient(r); coldHistory.erase(p.id); patients.upsert(p.id) = p; }
+        } else {
+            for (uint64_t i = 0; i < n && r.ok; ++i) {
+                int first = (int)((unsigned)(int)r.svarint() << kPatientPageShift);
+                for (int k = 0; k < (1 << kPatientPageShift); ++k) { patients.erase(first + k); coldHistory.erase(first + k); }
+                uint64_t rows = r.varint();
+                for (uint64_t j = 0; j < rows && r.ok; ++j) { Patient p = getPatient(r); patients.upsert(p.id) = p; }
+            }
+        }
+
+        if (r.u8()) {
+            decltype(triageHeap) heap;
+            n = r.varint();
+            for (uint64_t i = 0; i < n && r.ok; ++i) { int sev = (int)r.svarint(); heap.push(TriagedToken{sev, getToken(r)}); }
+            triageHeap = heap;
+        }
+
+        n = r.varint();
+        for (uint64_t i = 0; i < n && r.ok; ++i) {
+            int id = (int)r.svarint();
+            if (!r.u8()) { appointments.erase(id); continue; }
+            Appointment ap;
+            ap.doctorId = (int)r.svarint(); ap.patientId = (int)r.svarint(); ap.start = (int)r.svarint(); ap.end = (int)r.svarint();
+            appointments[id] = ap;
+        }
+
+        if (r.u8()) getResources(r);
+        return r.ok && r.atEnd();
+    }
+
+    // Derived indexes (heatmap pointers, free-slot maps, booked-slot
+    // timelines, free time, resource calendars, cohort bitmaps) and the
+    // checksum are not stored; rebuild them after a load.
+    void rebuildDerived() {
+        for (auto &kv : doctors) {
+            Doctor& D = kv.second;
+            D.heat = &heatmaps[D.specialization];
+            D.seen = &seenBySpec[D.specialization];
+            D.freeSlots.clear();
+            for (SlotNode* s = D.slotHead; s; s = s->next)
+                if (!s->taken() && s->timed()) D.freeSlots[make_pair(s->weekStart(), s->slotId)] = s;
+            D.rebuildTimeline();
+            D.freeTime = FreeTimeTree();
+            for (auto &iv : D.availability) D.freeTime.addFree(iv.first, iv.second);
+        }
+        for (auto &kv : appointments) {
+            auto dit = doctors.find(kv.second.doctorId);
+            if (dit != doctors.end()) dit->second.freeTime.reserve(kv.second.start, kv.second.end);
+        }
+        for (auto &kv : resources) {
+            kv.second.freeIntervals.clear();
+            for (auto &iv : kv.second.availability) kv.second.addFree(iv.first, iv.second);
+        }
+        for (auto &kv : resourceBookings)
+            if (kv.second.held) for (int rid : kv.second.resourceIds) resources[rid].reserve(kv.second.start, kv.second.end);
+        rebuildCohorts();
+        stateSum = recomputeChecksum() - countersHash();
+    }
+
+    void rebuildCohorts() {
+        for (auto &band : ageBands) band.clear();
+        patients.forEach([&](const Patient& p) { cohortAdd(p); });
+        pendingPatients.clear();
+        auto pend = [&](int patientId) { if (patientId != -1) pendingPatients.inc(patientId); };
+        for (auto &kv : doctors) {
+            Doctor& D = kv.second;
+            D.forEachQueued([&](const Token& t) { pend(t.patientId); });
+            for (SlotNode* s = D.slotHead; s; s = s->next) {
+                if (s->taken()) pend(slotPatientOf(s->tokenId()));
+                for (int t : s->overbooked) pend(slotPatientOf(t));
+            }
+            for (auto &sv : D.sessions)
+                for (size_t i = sv.second.served; i < sv.second.roster.size(); ++i) pend(sv.second.roster[i].patientId);
+        }
+        triageHeap.forEach([&](const TriagedToken& t) { pend(t.token.patientId); });
+        for (auto &kv : appointments) pend(kv.second.patientId);
+    }
+
+    void clearDirty() {
+        dirtyDoctors.clear(); dirtyPatientPages.clear(); dirtyAppointments.clear();
+        triageDirty = resourcesDirty = false;
+        checkpointTouch = touchClock;
+    }
+
+    static bool readWholeFile(const string& path, vector<uint8_t>& out) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp) return false;
+        out.clear(); uint8_t chunk[1 << 16]; size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), fp)) > 0) out.insert(out.end(), chunk, chunk + got);
+        fclose(fp);
+        return true;
+    }
+
+    // Writes to path.tmp, syncs it and renames it over path, so a crash leaves
+    // either the old file or the new one.
+    static bool writeFileAtomic(const string& path, const vector<uint8_t>& data) {
+        string tmp = path + ".tmp";
+        FILE* fp = fopen(tmp.c_str(), "wb");
+        if (!fp) return false;
+        bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size() && fflush(fp) == 0;
+#ifdef HOSPITAL_HAVE_MMAP
+        ok = ok && fsync(fileno(fp)) == 0;
+#endif
+        ok = fclose(fp) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) { remove(tmp.c_str()); return false; }
+        return true;
+    }
+
+public:
+    HospitalSystem() = default;
+    ~HospitalSystem() {
+        SlotClaim* c = claimInbox.exchange(nullptr);
+        while (c) { SlotClaim* nxt = c->next; delete c; c = nxt; }
+    }
+
+    // Every recorded action (and undo) is appended to log until detached with nullptr.
+    void attachOpLog(OpLog* log) { opLog = log; }
+
+    // Keeps the newest keepInMemory undo actions in RAM and spills older ones
+    // to path, so undo depth is bounded by disk only; "" keeps all in RAM.
+    bool setUndoSpill(const string& path, size_t keepInMemory = 4096) { return undoStack.setSpill(path, keepInMemory); }
+    void undoStats(size_t& depth, size_t& inMemory, uint64_t& spillBytes) const {
+        depth = undoStack.size(); inMemory = undoStack.inMemory(); spillBytes = undoStack.spillBytes();
+    }
+    void triageStats(size_t& depth, size_t& reservedBytes) const {
+        depth = triageHeap.size(); reservedBytes = triageHeap.capacity() * sizeof(TriagedToken);
+    }
+
+#ifdef HOSPITAL_HAVE_MMAP
+    // Persistent mode: doctors' routine queues and slot states live in store
+    // from now on (including doctors and slots added later). Attach after
+    // re-creating doctors and slots on restart to recover them from the file.
+    bool attachQueueStore(PersistentQueueStore* store) {
+        queueStore = store;
+        bool ok = true;
+        for (auto &kv : doctors) ok = bindDoctorToStore(kv.second) && ok;
+        return ok;
+    }
+#endif
+
+    bool addDoctor(int docId, const string& name, const string& spec, int queueCap = 10) {
+        if (doctors.count(docId)) return false;
+        auto it = doctors.emplace(docId, Doctor(docId, name, spec, queueCap)).first;
+        it->second.heat = &heatmaps[spec];
+        it->second.seen = &seenBySpec[spec];
+        stateSum += hashDoctor(it->second);
+        dirtyDoctors.insert(docId);
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore) bindDoctorToStore(it->second);
+#endif
+        return true;
+    }
+
+    bool scheduleAddSlot(int doctorId, int slotId, const string& startTime, const string& endTime, int weekday = 0) {
+        settleClaims(); // claimFirstFreeAfter walks Doctor::byTime
+        auto it = doctors.find(doctorId);
+        if (it == doctors.end()) return false;
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore && it->second.mapped[0] && !queueStore->canTrackSlot(doctorId, slotId)) return false;
+#endif
+        SlotNode* node = it->second.insertSlot(slotId, startTime, endTime, weekday);
+        stateSum += hashSlot(doctorId, node);
+        dirtyDoctors.insert(doctorId);
+        ++it->second.heat->buckets[node->heatBucket()].free;
+        if (node->timed()) it->second.freeSlots[make_pair(node->weekStart(), node->slotId)] = node;
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore && it->second.mapped[0]) syncSlotWithStore(it->second, node);
+#endif
+        return true;
+    }
+
+    bool scheduleCancelSlot(int doctorId, int slotId) {
+        settleClaims();
+        auto it = doctors.find(doctorId); if (it == doctors.end()) return false;
+        SlotNode* slot = it->second.findSlot(slotId); if (!slot) return false;
+        if (slot->taken()) { // an overbooked line only exists behind a taken slot
+            Action act; act.type = CANCEL;
+            act.token = Token{slot->tokenId(), slotPatientOf(slot->tokenId()), doctorId, slotId, ROUTINE};
+            for (int t : slot->overbooked) act.overbooked.push_back(make_pair(t, slotPatientOf(t)));
+            act.slotId = slotId; act.doctorId = doctorId; act.slotPreviouslyTaken = true;
+            recordAction(act);
+            for (auto &o : act.overbooked) { closeToken(o.second); slotPatient.erase(o.first); }
+            if (!act.overbooked.empty()) setOverbooked(it->second, slot, vector<int>());
+            slotPatient.erase(act.token.tokenId);
+            closeToken(act.token.patientId);
+            releaseSlot(it->second, slot);
+        }
+        stateSum -= hashSlot(doctorId, slot);
+        dirtyDoctors.insert(doctorId);
+        --it->second.heat->buckets[slot->heatBucket()].free;
+        if (slot->timed()) it->second.freeSlots.erase(make_pair(slot->weekStart(), slot->slotId));
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore && it->second.mapped[0]) queueStore->removeSlot(doctorId, slotId);
+#endif
+        return it->second.cancelSlot(slotId);
+    }
+
+    void patientUpsert(const Patient& p) {
+        OpWatch watch(*this, OP_PATIENT_UPSERT, p.id);
+        thawPatient(p.id);
+        bool existed = patients.count(p.id);
+        Action act; act.type = REGISTER_PATIENT;
+        act.patientExistedBefore = existed;
+        act.patientIdForUpsert = p.id;
+        act.patientSnapshot = existed ? *patients.find(p.id) : Patient();
+        recordAction(act, &p);
+        if (existed) { stateSum -= hashPatient(act.patientSnapshot); cohortRemove(act.patientSnapshot); }
+        patients.upsert(p.id) = p;
+        cohortAdd(p);
+        stateSum += hashPatient(p);
+        markPatientDirty(p.id);
+    }
+
+    // Removes the patient record (undoable). Tokens already issued keep their
+    // patient id; serving them no longer counts a visit.
+    bool patientDelete(int patientId) { return erasePatient(patientId, true); }
+
+    // Appends every patient not mutated in the last idleTouches patient
+    // mutations, and not referenced by a queued token, booked or overbooked
+    // slot, group roster, triage entry or appointment, to archivePath and
+    // deletes it. Returns how many moved. Archiving cannot be undone: the
+    // deletes go to the op log but not the undo stack, and the archive file
+    // is the way back (archivedPatientGet).
+    size_t archiveInactivePatients(uint64_t idleTouches, const string& archivePath) {
+        unordered_set<int> referenced;
+        for (auto &kv : doctors) {
+            kv.second.forEachQueued([&](const Token& t) { referenced.insert(t.patientId); });
+            for (SlotNode* s = kv.second.slotHead; s; s = s->next)
+                for (int t : s->overbooked) referenced.insert(slotPatientOf(t));
+            for (auto &sv : kv.second.sessions)
+                for (size_t i = sv.second.served; i < sv.second.roster.size(); ++i) referenced.insert(sv.second.roster[i].patientId);
+        }
+        slotPatient.forEach([&](int, int patientId) { referenced.insert(patientId); });
+        auto heapCopy = triageHeap;
+        for (; !heapCopy.empty(); heapCopy.pop()) referenced.insert(heapCopy.top().token.patientId);
+        for (auto &kv : appointments) referenced.insert(kv.second.patientId);
+        vector<int> victims;
+        patients.forEach([&](const Patient& p) {
+            if (!idleFor(p.id, idleTouches) || pendingPatients.bits.contains((uint32_t)p.id)) return;
+            if (!referenced.count(p.id)) victims.push_back(p.id);
+        });
+        if (victims.empty()) return 0;
+        ByteWriter w;
+        Patient scratch;
+        for (int id : victims) putPatient(w, plainPatient(*patients.find(id), scratch));
+        FILE* fp = fopen(archivePath.c_str(), "ab");
+        if (!fp) return 0;
+        bool ok = fwrite(w.buf.data(), 1, w.buf.size(), fp) == w.buf.size();
+        if (fclose(fp) != 0 || !ok) return 0;
+        for (int id : victims) erasePatient(id, false);
+        return victims.size();
+    }
+
+    // Reads one record back from an archive written above; the newest copy wins.
+    static bool archivedPatientGet(const string& archivePath, int patientId, Patient& out) {
+        vector<uint8_t> data;
+        if (!readWholeFile(archivePath, data)) return false;
+        ByteReader r(data);
+        bool found = false;
+        while (!r.atEnd()) {
+            Patient p = getPatient(r);
+            if (!r.ok) break;
+            if (p.id == patientId) { out = p; found = true; }
+        }
+        return found;
+    }
+
+    // Patient store occupancy; compactPatientStore moves up to maxMoves rows
+    // (actions already do this in small steps once tombstones pile up).
+    void patientStoreStats(size_t& liveRows, size_t& totalRows, size_t& tombstones) const {
+        liveRows = patients.size(); totalRows = patients.rowCount(); tombstones = patients.tombstones();
+    }
+    size_t compactPatientStore(size_t maxMoves) { return patients.compactStep(maxMoves); }
+
+    // Sizes the patient table, slot token index and triage heap for the
+    // expected peak, so they are mapped (and, with hugePageConfig().prefault,
+    // faulted in) once at startup instead of growing under load.
+    void reserveCapacity(size_t patientsN, size_t slotTokensN, size_t triageN) {
+        patients.reserve(patientsN);
+        slotPatient.reserve(slotTokensN);
+        triageHeap.reserve(triageN);
+    }
+
+    bool patientGet(int patientId, Patient& out) {
+        const Patient* p = patients.find(patientId);
+        if (!p) return false;
+        out = *p;
+        auto cit = coldHistory.find(patientId);
+        if (cit != coldHistory.end()) out.history = unpackHistory(cit->second);
+        return true;
+    }
+
+    // Returns the token id, or -1 with the reason in *why.
+    // Walk-ins (slotId -1) join the routine class picked by routineClassFor
+    // from the patient's age and walkInFlags (WalkInFlag bits).
+    int enqueueRoutine(int patientId, int doctorId, int slotId = -1, FailReason* why = nullptr, unsigned walkInFlags = 0) {
+        OpWatch watch(*this, OP_ENQUEUE, patientId, doctorId, slotId);
+        if (why) *why = FAIL_NONE;
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return refuse(FAIL_UNKNOWN_DOCTOR, nullptr, why);
+        Doctor& D = dit->second;
+        Token tk;
+        const Patient* pat = patients.find(patientId, tk.patientHandle);
+        if (!pat) return refuse(FAIL_UNKNOWN_PATIENT, &D, why);
+        tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = doctorId; tk.slotId = slotId; tk.type = ROUTINE;
+        if (slotId != -1) {
+            SlotNode* slot = D.findSlot(slotId); if (!slot) return refuse(FAIL_UNKNOWN_SLOT, &D, why);
+            // the same compare-and-swap as claimSlotAfter, so a slot is never booked twice
+            bool overbook = !slot->tryClaim(tk.tokenId);
+            if (overbook && (int)slot->overbooked.size() + 1 >= overbookLimit(D.attendance[slot->heatBucket()], overbookPolicy))
+                return refuse(FAIL_SLOT_TAKEN, &D, why);
+            if (overbook && !storeHasRoom(D)) return refuse(FAIL_STORE_FULL, &D, why);
+            slotPatient[tk.tokenId] = patientId;
+            if (!overbook) takeSlot(D, slot, tk.tokenId, true);
+            else {
+                vector<int> line = slot->overbooked; line.push_back(tk.tokenId);
+                setOverbooked(D, slot, line);
+            }
+            Action act; act.type = BOOK; act.token = tk; act.slotId = slotId; act.doctorId = doctorId; recordAction(act);
+            openToken(patientId); bumpFreq(patientId, tk.patientHandle); return tk.tokenId;
+        } else {
+            if (D.isFull()) return refuse(FAIL_QUEUE_FULL, &D, why);
+            tk.routineClass = (uint8_t)routineClassFor(*pat, walkInFlags, routineClassPolicy);
+            D.enqueueRoutine(tk); stateSum += hashQueued(tk); dirtyDoctors.insert(doctorId);
+            Action act; act.type = BOOK; act.token = tk; act.doctorId = doctorId; recordAction(act);
+            openToken(patientId); bumpFreq(patientId, tk.patientHandle); return tk.tokenId;
+        }
+    }
+
+    // Books the doctor's first free timed slot starting at or after
+    // notBeforeMinute (minutes into the week, see SlotNode::weekStart) and
+    // returns its id, or -1. It is the one method that may run on many
+    // threads at once, alongside other claimSlotAfter calls only: the slot is
+    // claimed with a compare-and-swap on its state word, and the rest of the
+    // booking (checksum, heatmap, undo, log, persistence) waits in claimInbox
+    // until applyConcurrentClaims runs on the owning thread. Every other call
+    // must start after the claims have returned; it then books what is left
+    // in the inbox first (settleClaims). enqueueRoutine takes slots with the
+    // same compare-and-swap, so even a call that breaks the rule cannot book
+    // a slot twice. Refusals are counted globally only, as the doctor's
+    // counters are single-threaded.
+    int claimSlotAfter(int patientId, int doctorId, int notBeforeMinute, Token& out, int* lostRaces = nullptr,
+                       FailReason* why = nullptr) {
+        struct InFlight {
+            atomic<int>& n;
+            explicit InFlight(atomic<int>& c) : n(c) { n.fetch_add(1, memory_order_relaxed); }
+            ~InFlight() { n.fetch_sub(1, memory_order_release); }
+        } inFlight(claimsInFlight);
+        if (why) *why = FAIL_NONE;
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return refuse(FAIL_UNKNOWN_DOCTOR, nullptr, why);
+        Token tk;
+        if (!patients.find(patientId, tk.patientHandle)) return refuse(FAIL_UNKNOWN_PATIENT, nullptr, why);
+        tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = doctorId; tk.type = ROUTINE;
+        SlotNode* s = dit->second.claimFirstFreeAfter(notBeforeMinute, tk.tokenId, lostRaces);
+        if (!s) return refuse(FAIL_NO_FREE_SLOT, nullptr, why);
+        tk.slotId = s->slotId;
+        SlotClaim* c = new SlotClaim{doctorId, s, tk, claimInbox.load(memory_order_relaxed)};
+        while (!claimInbox.compare_exchange_weak(c->next, c, memory_order_release, memory_order_relaxed)) {}
+        out = tk;
+        return s->slotId;
+    }
+
+    // Finishes the bookings made by claimSlotAfter, oldest first, as if each
+    // had been an enqueueRoutine on this thread (one BOOK action apiece).
+    size_t applyConcurrentClaims() {
+        SlotClaim* c = claimInbox.exchange(nullptr, memory_order_acquire), *fifo = nullptr;
+        while (c) { SlotClaim* nxt = c->next; c->next = fifo; fifo = c; c = nxt; }
+        size_t n = 0;
+        for (; fifo; ++n) {
+            c = fifo; fifo = c->next;
+            slotPatient[c->token.tokenId] = c->token.patientId;
+            takeSlot(doctors.at(c->doctorId), c->slot, c->token.tokenId, true);
+            Action act; act.type = BOOK; act.token = c->token; act.slotId = c->token.slotId; act.doctorId = c->doctorId; recordAction(act);
+            openToken(c->token.patientId); bumpFreq(c->token.patientId, c->token.patientHandle);
+            delete c;
+        }
+        return n;
+    }
+
+    bool serveNext(int doctorId, Token& servedOut) {
+        OpWatch watch(*this, OP_SERVE, doctorId);
+        if (!triageHeap.empty()) {
+            TriagedToken tt = triageHeap.top(); triageHeap.pop();
+            stateSum -= hashTriage(tt); triageDirty = true;
+            Token served = tt.token; served.type = EMERGENCY;
+            ++servedCount; closeToken(served.patientId);
+            Action act; act.type = SERVE; act.token = served; act.severity = tt.severity;
+            logVisit(served, doctorId, VISIT_EMERGENCY, recordAction(act));
+            if (served.patientId != -1) bumpFreq(served.patientId, served.patientHandle);
+            servedOut = served;
+            return true;
+        }
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return false;
+        Doctor& D = dit->second;
+        SlotNode* s = D.nextBooked();
+        bool walkIn = !D.isEmpty();
+        bool due = s && clockMinute >= 0 && s->timed() && s->weekStart() <= clockMinute;
+        bool fromSlot = s && !walkIn;
+        if (s && walkIn && timelinePolicy == TIMELINE_APPOINTMENTS_FIRST) fromSlot = due;
+        if (s && walkIn && timelinePolicy == TIMELINE_ALTERNATE) fromSlot = due && !D.servedSlotLast;
+        if (fromSlot) {
+            Token served; served.tokenId = s->tokenId(); served.patientId = slotPatientOf(served.tokenId);
+            served.doctorId = doctorId; served.slotId = s->slotId; served.type = ROUTINE;
+            slotPatient.erase(served.tokenId);
+            releaseSlot(D, s, SLOT_SERVED);
+            promoteOverbooked(D, s);
+            ++servedCount; closeToken(served.patientId);
+            if (served.patientId != -1) D.seen->inc(served.patientId);
+            Action act; act.type = SERVE; act.token = served; act.slotId = s->slotId; act.doctorId = doctorId;
+            logVisit(served, doctorId, VISIT_SLOT, recordAction(act));
+            D.servedSlotLast = true;
+            servedOut = served;
+            return true;
+        }
+        Token served;
+        if (!D.dequeueRoutine(served)) return false;
+        stateSum -= hashQueued(served); dirtyDoctors.insert(doctorId);
+        ++servedCount; closeToken(served.patientId);
+        if (served.patientId != -1) D.seen->inc(served.patientId);
+        Action act; act.type = SERVE; act.token = served;
+        logVisit(served, doctorId, VISIT_WALK_IN, recordAction(act));
+        D.servedSlotLast = false;
+        servedOut = served;
+        return true;
+    }
+
+    // Group sessions (see GroupSession); session ids are per doctor.
+    bool scheduleAddGroupSession(int doctorId, int sessionId, const string& startTime, const string& endTime,
+                                 int capacity, int weekday = 0) {
+        auto dit = doctors.find(doctorId);
+        if (dit == doctors.end() || capacity <= 0 || dit->second.sessions.count(sessionId)) return false;
+        GroupSession& g = dit->second.sessions[sessionId];
+        g.startTime = startTime; g.endTime = endTime; g.weekday = weekday; g.capacity = capacity;
+        stateSum += hashSession(doctorId, sessionId, g);
+        dirtyDoctors.insert(doctorId);
+        return true;
+    }
+
+    // Removes a session nobody is waiting in, roster and all.
+    bool scheduleRemoveGroupSession(int doctorId, int sessionId) {
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return false;
+        auto sit = dit->second.sessions.find(sessionId);
+        if (sit == dit->second.sessions.end() || sit->second.waiting()) return false;
+        stateSum -= hashSession(doctorId, sessionId, sit->second);
+        for (const Token& t : sit->second.roster) stateSum -= hashCheckedIn(t);
+        dit->second.sessions.erase(sit);
+        dirtyDoctors.insert(doctorId);
+        return true;
+    }
+
+    // Checks patientIds into the session in order, as one action. Unknown
+    // patients are skipped, and once the session is full the rest are
+    // refused; each counts as a refusal and why gets the first. Returns how
+    // many were checked in, or -1 for an unknown doctor or session.
+    int groupCheckIn(int doctorId, int sessionId, const vector<int>& patientIds, FailReason* why = nullptr) {
+        OpWatch watch(*this, OP_GROUP_CHECK_IN, doctorId, sessionId, (int)patientIds.size());
+        if (why) *why = FAIL_NONE;
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return refuse(FAIL_UNKNOWN_DOCTOR, nullptr, why);
+        Doctor& D = dit->second;
+        auto sit = D.sessions.find(sessionId); if (sit == D.sessions.end()) return refuse(FAIL_UNKNOWN_SLOT, &D, why);
+        GroupSession& g = sit->second;
+        Action act; act.type = GROUP_CHECK_IN; act.doctorId = doctorId; act.slotId = sessionId;
+        for (int pid : patientIds) {
+            Token tk;
+            FailReason r = FAIL_NONE;
+            if ((int)g.roster.size() >= g.capacity) r = FAIL_SESSION_FULL;
+            else if (!patients.find(pid, tk.patientHandle)) r = FAIL_UNKNOWN_PATIENT;
+            if (r != FAIL_NONE) { refuse(r, &D, why && *why == FAIL_NONE ? why : nullptr); continue; }
+            tk.tokenId = nextTokenId++; tk.patientId = pid; tk.doctorId = doctorId; tk.slotId = sessionId; tk.type = ROUTINE;
+            g.roster.push_back(tk);
+            stateSum += hashCheckedIn(tk);
+            openToken(pid); bumpFreq(pid, g.roster.back().patientHandle);
+            act.groupPatients.push_back(pid);
+        }
+        if (act.groupPatients.empty()) return 0;
+        act.token = g.roster[g.roster.size() - act.groupPatients.size()];
+        dirtyDoctors.insert(doctorId);
+        recordAction(act);
+        return (int)act.groupPatients.size();
+    }
+
+    // Serves up to maxCount waiting patients of the session in check-in
+    // order, as one action, appending their tokens to servedOut if given.
+    // Returns how many were served, or -1 for an unknown doctor or session.
+    int groupServe(int doctorId, int sessionId, int maxCount, vector<Token>* servedOut = nullptr) {
+        OpWatch watch(*this, OP_GROUP_SERVE, doctorId, sessionId, maxCount);
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return -1;
+        Doctor& D = dit->second;
+        auto sit = D.sessions.find(sessionId); if (sit == D.sessions.end()) return -1;
+        GroupSession& g = sit->second;
+        size_t n = min((size_t)max(maxCount, 0), g.waiting());
+        if (!n) return 0;
+        Action act; act.type = GROUP_SERVE; act.token = g.roster[g.served]; act.doctorId = doctorId; act.slotId = sessionId;
+        act.groupCount = (int)n;
+        stateSum -= hashSession(doctorId, sessionId, g);
+        int64_t at = nowMicros();
+        for (size_t i = g.served; i < g.served + n; ++i) {
+            const Token& t = g.roster[i];
+            closeToken(t.patientId); D.seen->inc(t.patientId);
+            logVisit(t, doctorId, VISIT_GROUP, at);
+            if (servedOut) servedOut->push_back(t);
+        }
+        g.served += n; servedCount += (int)n;
+        stateSum += hashSession(doctorId, sessionId, g);
+        dirtyDoctors.insert(doctorId);
+        recordAction(act);
+        return (int)n;
+    }
+
+    // Orders each doctor's walk-ins against booked slots, see TimelinePolicy.
+    void setTimelinePolicy(TimelinePolicy policy) { timelinePolicy = policy; }
+    // Applies to walk-ins enqueued from now on.
+    void setRoutineClassPolicy(const RoutineClassPolicy& policy) { routineClassPolicy = policy; }
+    // Current time as minutes into the week (weekMinute), -1 to turn the clock off.
+    void setClock(int weekMinuteNow) { clockMinute = weekMinuteNow; }
+
+    bool triageInsert(int patientId, int severity, FailReason* why = nullptr) {
+        OpWatch watch(*this, OP_TRIAGE, patientId, severity);
+        if (why) *why = FAIL_NONE;
+        Token tk;
+        if (!patients.find(patientId, tk.patientHandle)) { refuse(FAIL_UNKNOWN_PATIENT, nullptr, why); return false; }
+        tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = -1; tk.slotId = -1; tk.type = EMERGENCY;
+        triageHeap.push(TriagedToken{severity, tk});
+        stateSum += hashTriage(TriagedToken{severity, tk}); triageDirty = true;
+        Action act; act.type = TRIAGE_INSERT; act.token = tk; act.severity = severity; recordAction(act);
+        rollCohortDay(); triagedToday.inc(patientId);
+        openToken(patientId); bumpFreq(patientId, tk.patientHandle); return true;
+    }
+
+    bool addResource(int resId, const string& name, const string& kind) {
+        if (resources.count(resId)) return false;
+        resources.emplace(resId, ResourceCalendar(resId, name, kind));
+        resourcesDirty = true;
+        return true;
+    }
+
+    // Marks [start, end) on weekday as bookable for the resource.
+    bool resourceAddAvailability(int resId, int weekday, const string& start, const string& end) {
+        auto it = resources.find(resId); if (it == resources.end()) return false;
+        int s = weekMinute(weekday, start), e = weekMinute(weekday, end);
+        if (s < 0 || e <= s) return false;
+        it->second.addFree(s, e);
+        it->second.availability.push_back(make_pair(s, e));
+        stateSum += hashAvailability(resId, s, e); resourcesDirty = true;
+        return true;
+    }
+
+    // Books the earliest free slot of the doctor starting at or after
+    // notBeforeMinute (minutes since Monday 00:00) for which every listed
+    // resource is free for the whole slot, and reserves all of them in one step.
+    // Candidates leapfrog: each calendar pushes the start time forward to its
+    // next fitting gap until the doctor and all resources agree. Returns tokenId or -1.
+    int bookWithResources(int patientId, int doctorId, const vector<int>& resourceIds, int notBeforeMinute, Token& bookedOut,
+                          FailReason* why = nullptr) {
+        OpWatch watch(*this, OP_BOOK_RESOURCES, patientId, doctorId, notBeforeMinute);
+        watch.phase("search");
+        if (why) *why = FAIL_NONE;
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return refuse(FAIL_UNKNOWN_DOCTOR, nullptr, why);
+        Doctor& D = dit->second;
+        int handle;
+        if (!patients.find(patientId, handle)) return refuse(FAIL_UNKNOWN_PATIENT, &D, why);
+        vector<ResourceCalendar*> cals;
+        for (int rid : resourceIds) {
+            auto rit = resources.find(rid); if (rit == resources.end()) return refuse(FAIL_UNKNOWN_RESOURCE, &D, why);
+            cals.push_back(&rit->second);
+        }
+        int t = max(0, notBeforeMinute);
+        SlotNode* chosen = nullptr;
+        while (!chosen) {
+            auto sit = D.freeSlots.lower_bound(make_pair(t, INT_MIN));
+            if (sit == D.freeSlots.end()) return refuse(FAIL_NO_FREE_SLOT, &D, why);
+            SlotNode* slot = sit->second;
+            int start = slot->weekStart(), len = slot->weekEnd() - start;
+            int agreed = start;
+            for (ResourceCalendar* c : cals) {
+                int fit = c->nextFit(agreed, len);
+                if (fit < 0) return refuse(FAIL_RESOURCE_BUSY, &D, why);
+                if (fit > agreed) { agreed = fit; break; }
+            }
+            if (agreed == start) chosen = slot;
+            else t = agreed;
+        }
+        Token tk; tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = doctorId; tk.slotId = chosen->slotId; tk.type = ROUTINE;
+        tk.patientHandle = handle;
+        watch.phase("book");
+        ResourceBooking& rb = resourceBookings[tk.tokenId];
+        resourcesDirty = true;
+        rb.start = chosen->weekStart(); rb.end = chosen->weekEnd(); rb.resourceIds = resourceIds;
+        slotPatient[tk.tokenId] = patientId;
+        takeSlot(D, chosen, tk.tokenId); // also reserves the resources
+        Action act; act.type = RESOURCE_BOOK; act.token = tk; act.slotId = chosen->slotId; act.doctorId = doctorId;
+        act.resourceIds = resourceIds; recordAction(act);
+        openToken(patientId); bumpFreq(patientId, tk.patientHandle);
+        bookedOut = tk;
+        return tk.tokenId;
+    }
+
+    // Opens [start, end) on weekday for variable-length appointments.
+    bool doctorAddAvailability(int doctorId, int weekday, const string& start, const string& end) {
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return false;
+        int s = weekMinute(weekday, start), e = weekMinute(weekday, end);
+        if (s < 0 || e <= s) return false;
+        dit->second.freeTime.addFree(s, e);
+        dit->second.availability.push_back(make_pair(s, e));
+        stateSum += hashDoctorAvailability(doctorId, s, e); dirtyDoctors.insert(doctorId);
+        return true;
+    }
+
+    // Books durationMin minutes at the earliest gap starting at or after
+    // notBeforeMinute (minutes since Monday 00:00) that does not overlap one
+    // of the doctor's fixed timed slots. Returns tokenId or -1. The
+    // appointment counts as pending until it is cancelled.
+    int bookAppointment(int patientId, int doctorId, int durationMin, int notBeforeMinute, Token& bookedOut,
+                        FailReason* why = nullptr) {
+        OpWatch watch(*this, OP_BOOK_APPOINTMENT, patientId, doctorId, durationMin);
+        if (why) *why = FAIL_NONE;
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return refuse(FAIL_UNKNOWN_DOCTOR, nullptr, why);
+        Doctor& D = dit->second;
+        int handle;
+        if (!patients.find(patientId, handle)) return refuse(FAIL_UNKNOWN_PATIENT, &D, why);
+        if (durationMin <= 0) return refuse(FAIL_BAD_REQUEST, &D, why);
+        int start = max(0, notBeforeMinute);
+        while (true) { // each clash moves start past a slot
+            start = D.freeTime.earliestFit(start, durationMin);
+            if (start < 0) return refuse(FAIL_NO_FREE_TIME, &D, why);
+            int clash = D.slotClashEnd(start, start + durationMin);
+            if (clash < 0) break;
+            start = clash;
+        }
+        D.freeTime.reserve(start, start + durationMin);
+        Token tk; tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = doctorId; tk.type = ROUTINE;
+        tk.patientHandle = handle;
+        Appointment ap; ap.doctorId = doctorId; ap.patientId = patientId; ap.start = start; ap.end = start + durationMin;
+        appointments[tk.tokenId] = ap;
+        stateSum += hashAppointment(tk.tokenId, ap); dirtyAppointments.insert(tk.tokenId);
+        Action act; act.type = APPT_BOOK; act.token = tk; act.doctorId = doctorId;
+        act.apptStart = ap.start; act.apptEnd = ap.end; recordAction(act);
+        openToken(patientId); bumpFreq(patientId, tk.patientHandle);
+        bookedOut = tk;
+        return tk.tokenId;
+    }
+
+    // Returns the appointment's time to the doctor's free gaps, merging neighbours.
+    bool cancelAppointment(int tokenId) {
+        auto it = appointments.find(tokenId); if (it == appointments.end()) return false;
+        Appointment ap = it->second;
+        auto dit = doctors.find(ap.doctorId); if (dit == doctors.end()) return false;
+        dit->second.freeTime.addFree(ap.start, ap.end);
+        stateSum -= hashAppointment(tokenId, ap); dirtyAppointments.insert(tokenId);
+        appointments.erase(it);
+        closeToken(ap.patientId);
+        Action act; act.type = APPT_CANCEL; act.token = Token{tokenId, ap.patientId, ap.doctorId, -1, ROUTINE};
+        act.doctorId = ap.doctorId; act.apptStart = ap.start; act.apptEnd = ap.end; recordAction(act);
+        return true;
+    }
+
+    // Ends an appointment: the patient was seen (served) or did not come. Either
+    // way the time goes back to the doctor's free gaps, as appointment times
+    // recur weekly, and the pending token closes. Undoable.
+    bool completeAppointment(int tokenId, bool served = true) {
+        auto it = appointments.find(tokenId); if (it == appointments.end()) return false;
+        Appointment ap = it->second;
+        auto dit = doctors.find(ap.doctorId); if (dit == doctors.end()) return false;
+        Doctor& D = dit->second;
+        D.freeTime.addFree(ap.start, ap.end);
+        stateSum -= hashAppointment(tokenId, ap); dirtyAppointments.insert(tokenId);
+        appointments.erase(it);
+        closeToken(ap.patientId);
+        Token tk{tokenId, ap.patientId, ap.doctorId, -1, ROUTINE};
+        Action act; act.type = served ? APPT_SERVE : APPT_NO_SHOW; act.token = tk;
+        act.doctorId = ap.doctorId; act.apptStart = ap.start; act.apptEnd = ap.end;
+        int64_t at = recordAction(act);
+        if (served) {
+            ++servedCount;
+            if (ap.patientId != -1) D.seen->inc(ap.patientId);
+            logVisit(tk, ap.doctorId, VISIT_APPOINTMENT, at);
+        }
+        return true;
+    }
+
+    bool appointmentGet(int tokenId, Appointment& out) const {
+        auto it = appointments.find(tokenId);
+        if (it == appointments.end()) return false;
+        out = it->second;
+        return true;
+    }
+
+    // Patient booked into slotId did not turn up: frees the slot and counts a no-show.
+    bool markNoShow(int doctorId, int slotId) {
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return false;
+        Doctor& D = dit->second;
+        SlotNode* slot = D.findSlot(slotId); if (!slot || !slot->taken()) return false;
+        Action act; act.type = NO_SHOW; act.token = Token{slot->tokenId(), slotPatientOf(slot->tokenId()), doctorId, slotId, ROUTINE};
+        act.slotId = slotId; act.doctorId = doctorId; recordAction(act);
+        slotPatient.erase(act.token.tokenId);
+        releaseSlot(D, slot, SLOT_NO_SHOW);
+        promoteOverbooked(D, slot);
+        closeToken(act.token.patientId);
+        return true;
+    }
+
+    // The UNDO marker goes to the op log only once the undo has been applied,
+    // so a replay never rolls back an action that is still in effect.
+    bool undoPop() {
+        OpWatch watch(*this, OP_UNDO);
+        Action act;
+        if (!undoStack.pop(act)) return false;
+        watch.phase(kActionNames[act.type]);
+        if (!applyUndo(act)) return false;
+        watch.phase("log");
+        if (opLog) {
+            Action mark; mark.type = UNDO; mark.token = act.token; mark.doctorId = act.doctorId; mark.timestamp = nowMicros();
+            opLog->append(mark);
+        }
+        return true;
+    }
+
+    bool applyUndo(const Action& act) {
+        switch (act.type) {
+            case BOOK: {
+                Token tk = act.token;
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                Doctor& D = dit->second;
+                if (tk.slotId != -1) {
+                    SlotNode* slot = D.findSlot(tk.slotId);
+                    if (!slot) return false;
+                    auto ob = find(slot->overbooked.begin(), slot->overbooked.end(), tk.tokenId);
+                    if (ob != slot->overbooked.end()) {
+                        vector<int> line = slot->overbooked; line.erase(line.begin() + (ob - slot->overbooked.begin()));
+                        setOverbooked(D, slot, line);
+                        slotPatient.erase(tk.tokenId);
+                        closeToken(tk.patientId);
+                        return true;
+                    }
+                    if (slot->taken() && slot->tokenId() == tk.tokenId) {
+                        slotPatient.erase(tk.tokenId);
+                        releaseSlot(D, slot);
+                        promoteOverbooked(D, slot);
+                        closeToken(tk.patientId);
+                        return true;
+                    }
+                } else {
+                    Token ot;
+                    if (!D.unqueueRoutine(tk, ot)) return false;
+                    closeToken(ot.patientId); stateSum -= hashQueued(ot); dirtyDoctors.insert(D.id);
+                    return true;
+                }
+                return false;
+            }
+            case CANCEL: {
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                Doctor& D = dit->second; SlotNode* slot = D.findSlot(act.slotId);
+                if (!slot || slot->taken()) return false;
+                setSlotPatient(act.token.tokenId, act.token.patientId); takeSlot(D, slot, act.token.tokenId); openToken(act.token.patientId);
+                vector<int> line;
+                for (auto &o : act.overbooked) { setSlotPatient(o.first, o.second); openToken(o.second); line.push_back(o.first); }
+                if (!line.empty()) setOverbooked(D, slot, line);
+                return true;
+            }
+            case SERVE: {
+                Token tk = act.token;
+                if (tk.type == EMERGENCY) {
+                    triageHeap.push(TriagedToken{act.severity, tk});
+                    stateSum += hashTriage(TriagedToken{act.severity, tk}); triageDirty = true;
+                    openToken(tk.patientId); --servedCount;
+                    visits.popNewest(tk.tokenId);
+                    return true;
+                } else {
+                    auto dit = doctors.find(tk.doctorId); if (dit == doctors.end()) return false;
+                    Doctor& D = dit->second;
+                    if (act.slotId != -1) {
+                        SlotNode* slot = D.findSlot(act.slotId);
+                        if (!slot) return false;
+                        if (slot->taken()) demoteToOverbooked(D, slot); // it was promoted by the serve
+                        setSlotPatient(tk.tokenId, tk.patientId);
+                        takeSlot(D, slot, tk.tokenId);
+                        --D.heat->buckets[slot->heatBucket()].served; --D.attendance[slot->heatBucket()].shows;
+                        if (tk.patientId != -1) D.seen->dec(tk.patientId);
+                        openToken(tk.patientId); --servedCount;
+                        visits.popNewest(tk.tokenId);
+                        return true;
+                    }
+                    if (!D.requeueFront(tk)) return false; // ring full: the serve stands
+                    stateSum += hashQueued(tk); dirtyDoctors.insert(D.id);
+                    D.seen->dec(tk.patientId);
+                    openToken(tk.patientId); --servedCount;
+                    visits.popNewest(tk.tokenId);
+                    return true;
+                }
+            }
+            case RESOURCE_BOOK: {
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                Doctor& D = dit->second; SlotNode* slot = D.findSlot(act.slotId);
+                if (!slot || !slot->taken() || slot->tokenId() != act.token.tokenId) return false;
+                slotPatient.erase(act.token.tokenId);
+                releaseSlot(D, slot);
+                resourceBookings.erase(act.token.tokenId); resourcesDirty = true;
+                closeToken(act.token.patientId);
+                return true;
+            }
+            case APPT_BOOK: {
+                auto it = appointments.find(act.token.tokenId); if (it == appointments.end()) return false;
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                dit->second.freeTime.addFree(act.apptStart, act.apptEnd);
+                stateSum -= hashAppointment(it->first, it->second); dirtyAppointments.insert(it->first);
+                closeToken(it->second.patientId);
+                appointments.erase(it);
+                return true;
+            }
+            case APPT_CANCEL:
+            case APPT_SERVE:
+            case APPT_NO_SHOW: {
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                if (!dit->second.freeTime.reserve(act.apptStart, act.apptEnd)) return false;
+                if (act.type == APPT_SERVE) {
+                    --servedCount;
+                    if (act.token.patientId != -1) dit->second.seen->dec(act.token.patientId);
+                    visits.popNewest(act.token.tokenId);
+                }
+                Appointment ap; ap.doctorId = act.doctorId; ap.patientId = act.token.patientId;
+                ap.start = act.apptStart; ap.end = act.apptEnd;
+                appointments[act.token.tokenId] = ap;
+                stateSum += hashAppointment(act.token.tokenId, ap); dirtyAppointments.insert(act.token.tokenId);
+                openToken(ap.patientId);
+                return true;
+            }
+            case NO_SHOW: {
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                Doctor& D = dit->second; SlotNode* slot = D.findSlot(act.slotId);
+                if (!slot) return false;
+                if (slot->taken()) demoteToOverbooked(D, slot); // it was promoted by the no-show
+                setSlotPatient(act.token.tokenId, act.token.patientId);
+                takeSlot(D, slot, act.token.tokenId);
+                --D.heat->buckets[slot->heatBucket()].noShow; --D.attendance[slot->heatBucket()].noShows;
+                openToken(act.token.patientId);
+                return true;
+            }
+            case REGISTER_PATIENT: {
+                thawPatient(act.patientIdForUpsert);
+                if (const Patient* cur = patients.find(act.patientIdForUpsert)) { stateSum -= hashPatient(*cur); cohortRemove(*cur); }
+                markPatientDirty(act.patientIdForUpsert);
+                if (act.patientExistedBefore) {
+                    patients.upsert(act.patientIdForUpsert) = act.patientSnapshot;
+                    stateSum += hashPatient(act.patientSnapshot); cohortAdd(act.patientSnapshot);
+                } else {
+                    patients.erase(act.patientIdForUpsert);
+                }
+                return true;
+            }
+            case PATIENT_DELETE: {
+                if (patients.count(act.patientIdForUpsert)) return false;
+                patients.upsert(act.patientIdForUpsert) = act.patientSnapshot;
+                stateSum += hashPatient(act.patientSnapshot); cohortAdd(act.patientSnapshot);
+                markPatientDirty(act.patientIdForUpsert);
+                return true;
+            }
+            case TRIAGE_INSERT: {
+                int remId = act.token.tokenId; vector<TriagedToken> all;
+                bool removed = false;
+                while (!triageHeap.empty()) {
+                    TriagedToken t = triageHeap.top(); triageHeap.pop();
+                    if (!removed && t.token.tokenId == remId) { removed = true; closeToken(t.token.patientId); stateSum -= hashTriage(t); triageDirty = true; }
+                    else all.push_back(t);
+                }
+                for (auto &x: all) triageHeap.push(x);
+                if (removed) triagedToday.dec(act.token.patientId);
+                return removed;
+            }
+            case GROUP_CHECK_IN: {
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                auto sit = dit->second.sessions.find(act.slotId); if (sit == dit->second.sessions.end()) return false;
+                GroupSession& g = sit->second;
+                size_t n = act.groupPatients.size(), from = g.roster.size() - n;
+                if (g.roster.size() < g.served + n || g.roster[from].tokenId != act.token.tokenId) return false;
+                for (size_t i = from; i < g.roster.size(); ++i) { stateSum -= hashCheckedIn(g.roster[i]); closeToken(g.roster[i].patientId); }
+                g.roster.resize(from);
+                dirtyDoctors.insert(act.doctorId);
+                return true;
+            }
+            case GROUP_SERVE: {
+                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
+                Doctor& D = dit->second;
+                auto sit = D.sessions.find(act.slotId); if (sit == D.sessions.end()) return false;
+                GroupSession& g = sit->second;
+                size_t n = (size_t)act.groupCount;
+                if (g.served < n || g.roster[g.served - n].tokenId != act.token.tokenId) return false;
+                stateSum -= hashSession(D.id, act.slotId, g);
+                g.served -= n; servedCount -= (int)n;
+                for (size_t i = g.served + n; i-- > g.served;) {
+                    openToken(g.roster[i].patientId); D.seen->dec(g.roster[i].patientId);
+                    visits.popNewest(g.roster[i].tokenId);
+                }
+                stateSum += hashSession(D.id, act.slotId, g);
+                dirtyDoctors.insert(act.doctorId);
+                return true;
+            }
+            default: return false;
+        }
+    }
+
+    void perDoctorReport(int doctorId) {
+        auto dit = doctors.find(doctorId);
+        if (dit == doctors.end()) { cout << "Doctor not found\n"; return; }
+        Doctor& D = dit->second;
+        cout << "Doctor: " << D.name << " (id " << D.id << "), Spec: " << D.specialization << "\n";
+        cout << "Pending routine queue: " << D.pendingCount();
+        if (D.pendingCount()) {
+            cout << " (";
+            for (int c = 0; c < ROUTINE_CLASS_COUNT; ++c) cout << (c ? ", " : "") << kRoutineClassNames[c] << " " << D.pendingInClass(c);
+            cout << ")";
+        }
+        cout << "\n";
+        SlotNode* nf = D.nextFreeSlot();
+        if (nf) cout << "Next free slot: " << nf->slotId << " [" << nf->startTime << "-" << nf->endTime << "]\n";
+        else cout << "No free slots\n";
+        if (D.freeTime.gapCount())
+            cout << "Free time: " << D.freeTime.gapCount() << " gaps, longest " << D.freeTime.longestGap() << " min\n";
+        for (auto &kv : D.sessions) {
+            const GroupSession& g = kv.second;
+            cout << "Group session " << kv.first << " [" << g.startTime << "-" << g.endTime << "]: " << g.roster.size() << "/"
+                 << g.capacity << " checked in, " << g.served << " served, " << g.waiting() << " waiting\n";
+        }
+        int shows = 0, noShows = 0, overbooked = 0;
+        for (auto &a : D.attendance) { shows += a.shows; noShows += a.noShows; }
+        for (SlotNode* s = D.slotHead; s; s = s->next) overbooked += (int)s->overbooked.size();
+        if (shows + noShows)
+            cout << "No-show rate: " << (100.0 * noShows / (shows + noShows)) << "% of " << (shows + noShows)
+                 << " slot visits, overbooked tokens waiting: " << overbooked << "\n";
+        bool refused = false;
+        for (int r = 1; r < FAIL_REASON_COUNT; ++r)
+            if (D.failures[r]) { cout << (refused ? ", " : "Refused: ") << kFailReasonNames[r] << " " << D.failures[r]; refused = true; }
+        if (refused) cout << "\n";
+    }
+
+    // Refusals by reason across every thread of the process (claimSlotAfter
+    // and unknown-doctor calls included), and per doctor of this system.
+    FailCounts failureCounts() const { return FailCounters::instance().snapshot(); }
+    bool doctorFailureCounts(int doctorId, FailCounts& out) const {
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return false;
+        out = dit->second.failures;
+        return true;
+    }
+
+    void failureReport(ostream& os) const {
+        FailCounts all = failureCounts();
+        uint64_t capacity = 0, data = 0;
+        for (int r = 1; r < FAIL_REASON_COUNT; ++r) (isCapacityFailure((FailReason)r) ? capacity : data) += all[r];
+        os << "Refused requests (process): " << capacity << " capacity, " << data << " data\n";
+        for (int r = 1; r < FAIL_REASON_COUNT; ++r)
+            if (all[r]) os << "  " << kFailReasonNames[r] << ": " << all[r] << (isCapacityFailure((FailReason)r) ? " (capacity)\n" : " (data)\n");
+        vector<int> ids;
+        for (auto &kv : doctors) ids.push_back(kv.first);
+        sort(ids.begin(), ids.end());
+        for (int id : ids) {
+            const FailCounts& f = doctors.at(id).failures;
+            uint64_t n = 0;
+            for (int r = 1; r < FAIL_REASON_COUNT; ++r) n += f[r];
+            if (!n) continue;
+            os << "  Dr " << id << ":";
+            for (int r = 1; r < FAIL_REASON_COUNT; ++r) if (f[r]) os << " " << kFailReasonNames[r] << "=" << f[r];
+            os << "\n";
+        }
+    }
+
+    // Cohort queries: set algebra over the cohort bitmaps, which every
+    // mutation keeps current, instead of a scan of the patient store. The
+    // bands are disjoint, so a count sums band by band without a union.
+    uint64_t cohortCount(const CohortQuery& q) {
+        int lo, hi; RoaringBitmap acc; bool filtered;
+        if (!cohortOperands(q, lo, hi, acc, filtered)) return 0;
+        uint64_t n = 0;
+        for (int b = lo; b <= hi; ++b)
+            n += filtered ? RoaringBitmap::andCount(ageBands[b], acc) : ageBands[b].cardinality();
+        return n;
+    }
+    // The first limit matching patient ids, ascending.
+    void cohortMembers(const CohortQuery& q, size_t limit, vector<int>& out) {
+        out.clear();
+        int lo, hi; RoaringBitmap acc; bool filtered;
+        if (!cohortOperands(q, lo, hi, acc, filtered)) return;
+        if (!filtered) {
+            acc = ageBands[lo];
+            for (int b = lo + 1; b <= hi; ++b) acc.orWith(ageBands[b]);
+        }
+        acc.forEach([&](uint32_t id) {
+            if (out.size() >= limit) return false;
+            if (filtered) {
+                int b = lo;
+                while (b <= hi && !ageBands[b].contains(id)) ++b;
+                if (b > hi) return true;
+            }
+            out.push_back((int)id);
+            return true;
+        });
+    }
+
+    size_t cohortBytes() const {
+        size_t n = pendingPatients.bits.bytes() + triagedToday.bits.bytes();
+        for (auto &band : ageBands) n += band.bytes();
+        for (auto &kv : seenBySpec) n += kv.second.bits.bytes();
+        return n;
+    }
+
+    void cohortReport(ostream& os) {
+        rollCohortDay();
+        os << "Cohorts by age band (patients, pending, triaged today):\n";
+        for (int b = 0; b < kAgeBands; ++b) {
+            const RoaringBitmap& band = ageBands[b];
+            if (band.empty()) continue;
+            os << "  " << b * kAgeBandYears;
+            if (b + 1 < kAgeBands) os << "-" << (b + 1) * kAgeBandYears - 1; else os << "+";
+            os << ": " << band.cardinality() << ", " << RoaringBitmap::andCount(band, pendingPatients.bits)
+               << ", " << RoaringBitmap::andCount(band, triagedToday.bits) << "\n";
+        }
+        map<string, uint64_t> seen;
+        for (auto &kv : seenBySpec) if (!kv.second.bits.empty()) seen[kv.first] = kv.second.bits.cardinality();
+        for (auto &kv : seen) os << "  seen by " << kv.first << ": " << kv.second << "\n";
+    }
+
+    // Served-visit history, see VisitHistory.
+    void setVisitRetention(size_t maxVisits, size_t perPatient) { visits.setRetention(maxVisits, perPatient); }
+    size_t recentVisits(int patientId, size_t k, vector<VisitRecord>& out) const { return visits.recent(patientId, k, out); }
+    void visitStats(size_t& retained, size_t& chunks, size_t& bytes) const {
+        retained = visits.size(); chunks = visits.chunkCount(); bytes = visits.bytes();
+    }
+
+    void visitReport(int patientId, size_t k, ostream& os) const {
+        vector<VisitRecord> v;
+        if (!visits.recent(patientId, k, v)) { os << "No retained visits for patient " << patientId << "\n"; return; }
+        int64_t now = nowMicros();
+        os << "Last " << v.size() << " visits of patient " << patientId << ":\n";
+        for (const VisitRecord& r : v) {
+            os << "  " << kVisitKindNames[r.kind] << ", token " << r.tokenId << ", Dr " << r.doctorId;
+            if (r.slotId != -1) os << (r.kind == VISIT_GROUP ? ", session " : ", slot ") << r.slotId;
+            os << ", " << (now - r.at) / 1000000 << " s ago\n";
+        }
+    }
+
+    // Overbooking: a taken slot accepts up to overbookLimit() tokens in all;
+    // the default policy allows one.
+    void setOverbookPolicy(const OverbookPolicy& policy) { overbookPolicy = policy; }
+
+    // Tokens the slot may hold right now, or -1 for an unknown slot.
+    int slotTokenLimit(int doctorId, int slotId) {
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return -1;
+        SlotNode* s = dit->second.findSlot(slotId); if (!s) return -1;
+        return overbookLimit(dit->second.attendance[s->heatBucket()], overbookPolicy);
+    }
+
+    // Tokens the slot holds now (its own plus overbooked), or -1.
+    int slotTokenCount(int doctorId, int slotId) {
+        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return -1;
+        SlotNode* s = dit->second.findSlot(slotId); if (!s) return -1;
+        return s->taken() + (int)s->overbooked.size();
+    }
+
+    // Weekday-hour slot utilization for one specialization, O(buckets).
+    bool slotHeatmap(const string& spec, SlotHeatmap& out) const {
+        auto it = heatmaps.find(spec);
+        if (it == heatmaps.end()) return false;
+        out = it->second;
+        return true;
+    }
+
+    void utilizationHeatmap(const string& spec) {
+        SlotHeatmap hm;
+        if (!slotHeatmap(spec, hm)) { cout << "No doctors with specialization " << spec << "\n"; return; }
+        cout << "Slot utilization for " << spec << " (booked/free, served, no-show):\n";
+        for (int b = 0; b < kHeatBuckets; ++b) {
+            const SlotBucketCounts& c = hm.buckets[b];
+            if (!c.booked && !c.free && !c.served && !c.noShow) continue;
+            int total = c.booked + c.free;
+            cout << "  " << kWeekdayNames[b / 24] << " " << (b % 24 < 10 ? "0" : "") << b % 24 << "h: "
+                 << c.booked << "/" << c.free << " (" << (total ? 100 * c.booked / total : 0) << "% booked), served "
+                 << c.served << ", no-show " << c.noShow << "\n";
+        }
+    }
+
+    void servedVsPendingSummary() {
+        cout << "Served: " << servedCount << " | Pending: " << pendingCountTotal << "\n";
+        cout << "Undo depth: " << undoStack.size() << " (" << undoStack.inMemory() << " in memory, "
+             << undoStack.spillBytes() << " bytes spilled)\n";
+    }
+
+    int servedTotal() const { return servedCount; }
+    int pendingTotal() const { return pendingCountTotal; }
+    size_t patientCount() const { return patients.size(); }
+    size_t doctorCount() const { return doctors.size(); }
+
+    // Order-independent fingerprint of the whole state; equal on any two systems
+    // holding the same records. O(1): maintained incrementally by every mutation.
+    uint64_t stateChecksum() const { return stateSum + countersHash(); }
+
+    // Full O(state) rebuild of the same value, for verifying the incremental one.
+    uint64_t recomputeChecksum() const {
+        uint64_t sum = 0;
+        for (auto &kv : doctors) {
+            const Doctor& D = kv.second;
+            sum += hashDoctor(D);
+            for (SlotNode* s = D.slotHead; s; s = s->next) sum += hashSlot(D.id, s);
+            D.forEachQueued([&](const Token& t) { sum += hashQueued(t); });
+            for (auto &iv : D.availability) sum += hashDoctorAvailability(D.id, iv.first, iv.second);
+            for (auto &sv : D.sessions) {
+                sum += hashSession(D.id, sv.first, sv.second);
+                for (const Token& t : sv.second.roster) sum += hashCheckedIn(t);
+            }
+        }
+        for (auto &kv : appointments) sum += hashAppointment(kv.first, kv.second);
+        Patient scratch;
+        patients.forEach([&](const Patient& p) { sum += hashPatient(plainPatient(p, scratch)); });
+        for (auto &kv : resources)
+            for (auto &iv : kv.second.availability) sum += hashAvailability(kv.first, iv.first, iv.second);
+        for (auto &kv : resourceBookings)
+            if (kv.second.held) for (int rid : kv.second.resourceIds) sum += hashReservation(rid, kv.first, kv.second);
+        auto heapCopy = triageHeap;
+        while (!heapCopy.empty()) { sum += hashTriage(heapCopy.top()); heapCopy.pop(); }
+        return sum + countersHash();
+    }
+
+    // Writes a checkpoint: a full base at prefix.base, or a delta at
+    // prefix.delta.N holding only what changed since the previous checkpoint
+    // (dirty doctors with their slots and queue, dirty patient pages, triage,
+    // appointments, resources). Every consolidateEvery deltas a new base is
+    // written instead and the old deltas are removed.
+    bool writeCheckpoint(const string& prefix, int consolidateEvery = 16) {
+        OpWatch watch(*this, OP_CHECKPOINT_WRITE, checkpointDeltas + 1, consolidateEvery);
+        watch.phase("encode");
+        bool base = checkpointDeltas < 0 || checkpointDeltas >= consolidateEvery;
+        uint64_t generation = base ? (uint64_t)nowMicros() : checkpointGeneration;
+        if (base && generation <= checkpointGeneration) generation = checkpointGeneration + 1;
+        int index = base ? 0 : checkpointDeltas + 1;
+        ByteWriter w;
+        encodeCheckpoint(w, base, generation, index);
+        watch.phase("write");
+        if (!writeFileAtomic(base ? prefix + ".base" : deltaPath(prefix, index), w.buf)) return false;
+        watch.phase("cleanup");
+        if (base) {
+            // stale deltas carry the old generation, so removing them is only tidying up
+            for (int i = 1; remove(deltaPath(prefix, i).c_str()) == 0 || i <= checkpointDeltas; ++i) {}
+            checkpointGeneration = generation;
+        }
+        checkpointDeltas = index;
+        checkpointBytes = w.buf.size();
+        clearDirty();
+        return true;
+    }
+
+    // Replaces the whole state with prefix.base plus its chain of deltas.
+    // The undo history is not part of a checkpoint and is cleared.
+    bool loadCheckpoint(const string& prefix) {
+#ifdef HOSPITAL_HAVE_MMAP
+        if (queueStore) return false; // queues already come from the store
+#endif
+        OpWatch watch(*this, OP_CHECKPOINT_LOAD);
+        watch.phase("base");
+        vector<uint8_t> data;
+        if (!readWholeFile(prefix + ".base", data)) return false;
+        doctors.clear(); patients.clear(); heatmaps.clear(); appointments.clear();
+        coldHistory.clear(); slotPatient.clear();
+        triagedToday.clear(); seenBySpec.clear(); visits.clear();
+        resources.clear(); resourceBookings.clear();
+        triageHeap = decltype(triageHeap)();
+        undoStack.clear();
+        bool ok = applyCheckpoint(data, true, 0);
+        watch.phase("deltas");
+        int deltas = 0;
+        while (ok && readWholeFile(deltaPath(prefix, deltas + 1), data)) {
+            if (!applyCheckpoint(data, false, deltas + 1)) break; // left over from an older base
+            ++deltas;
+        }
+        watch.phase("rebuild");
+        rebuildDerived();
+        patients.touchAll(++touchClock); // idle time counts from the load
+        clearDirty();
+        checkpointDeltas = ok ? deltas : -1;
+        return ok;
+    }
+
+    int checkpointDeltaCount() const { return checkpointDeltas; }
+    size_t lastCheckpointBytes() const { return checkpointBytes; }
+
+    // Packs the history of every patient whose last mutation is at least
+    // idleTouches patient mutations ago and whose history is minBytes or
+    // longer, if packing makes it smaller. Returns how many were packed.
+    size_t freezeColdHistories(uint64_t idleTouches, size_t minBytes = 64) {
+        size_t frozen = 0;
+        patients.forEach([&](Patient& p) {
+            if (p.history.size() < minBytes || coldHistory.count(p.id)) return;
+            if (!idleFor(p.id, idleTouches)) return;
+            vector<uint8_t> packed = lz::compress((const uint8_t*)p.history.data(), p.history.size(), dictData(), historyDict.size());
+            if (packed.size() >= p.history.size()) return;
+            packed.shrink_to_fit();
+            coldHistory[p.id] = move(packed);
+            patients.setCold(p.id, true);
+            string().swap(p.history);
+            ++frozen;
+        });
+        return frozen;
+    }
+
+    // Unpacks every cold history; returns how many there were.
+    size_t thawAllHistories() {
+        vector<int> ids;
+        for (auto &kv : coldHistory) ids.push_back(kv.first);
+        for (int id : ids) thawPatient(id);
+        return ids.size();
+    }
+
+    // Trains the shared dictionary on up to sampleCount current histories.
+    // Packed records depend on the dictionary, so all of them are unpacked
+    // first; freeze again afterwards.
+    void trainHistoryDictionary(size_t maxBytes = 16384, size_t sampleCount = 4000) {
+        thawAllHistories();
+        vector<string> samples;
+        patients.forEach([&](const Patient& p) {
+            if (samples.size() < sampleCount && !p.history.empty()) samples.push_back(p.history);
+        });
+        historyDict = lz::trainDictionary(samples, maxBytes);
+    }
+
+    // Bytes of history text held plain and packed, and the packed count.
+    void historyFootprint(size_t& plainBytes, size_t& packedBytes, size_t& coldCount) const {
+        plainBytes = packedBytes = 0; coldCount = coldHistory.size();
+        patients.forEach([&](const Patient& p) { plainBytes += p.history.size(); });
+        for (auto &kv : coldHistory) packedBytes += kv.second.size();
+    }
+    size_t historyDictionaryBytes() const { return historyDict.size(); }
+
+    // Slow-operation watchdog; budgets are per operation kind, in microseconds.
+    void setSlowOpBudget(OpKind kind, int64_t micros) { slowLog.setBudget(kind, micros); }
+    void setSlowOpWatch(bool on) { slowLog.enabled = on; }
+    uint64_t slowOpCount() const { return slowLog.total(); }
+    void dumpSlowOps(ostream& os) const { slowLog.dump(os); }
+
+    void topKFrequentPatients(int K) {
+        OpWatch watch(*this, OP_TOPK, K);
+        watch.phase("collect");
+        vector<pair<int,int>> arr;
+        patients.forEach([&](const Patient& p) { arr.push_back({p.freq, p.id}); });
+        watch.phase("sort");
+        sort(arr.begin(), arr.end(), greater<>());
+        watch.phase("print");
+        cout << "Top " << K << " frequent patients:\n";
+        for (int i = 0; i < K && i < (int)arr.size(); ++i) {
+            cout << "  PatientId " << arr[i].second << " freq " << arr[i].first << " name: " << patients.find(arr[i].second)->name << "\n";
+        }
+    }
+
+    void listDoctorSlots(int doctorId) {
+        auto it = doctors.find(doctorId);
+        if (it == doctors.end()) {
+            cout << "Doctor not found\n";
+            return;
+        }
+        it->second.printSlots();
+    }
+
+    void seedSampleData() {
+        addDoctor(1, "Dr_Ahuja", "General", 5);
+        addDoctor(2, "Dr_Mehta", "Cardio", 5);
+        scheduleAddSlot(1, 101, "09:00", "09:15");
+        scheduleAddSlot(1, 102, "09:15", "09:30");
+        scheduleAddSlot(2, 201, "10:00", "10:15");
+        patientUpsert(Patient{1,"Ananya",22,"No_history",0});
+        patientUpsert(Patient{2,"Lakshita",19,"Allergy_pollen",0});
+        patientUpsert(Patient{3,"Saieena",21,"Asthma",0});
+    }
+};
+
+// ----------------------------- Shared-memory Command Rings -----------------------------
+// Local clients (kiosks on the same host) talk to the server through a POSIX
+// shared-memory region holding, per client, a submission ring of encoded
+// commands and a completion ring of results. Each ring has exactly one
+// producer and one consumer, so head/tail are plain atomics published with
+// release/acquire and no syscall is made once both sides are attached.
+// Reports (SHM_DUMP_*) are written into the client's own text buffer in the
+// region; the completion that follows carries the byte count.
+// (On glibc older than 2.34 link with -lrt for shm_open.)
+#ifdef HOSPITAL_HAVE_SHM
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared-memory rings need address-free atomics");
+
+enum ShmOp : uint32_t { SHM_NOP, SHM_ENQUEUE_ROUTINE, SHM_TRIAGE_INSERT, SHM_SERVE_NEXT, SHM_UNDO,
+                        SHM_MARK_NO_SHOW, SHM_BOOK_APPOINTMENT, SHM_DUMP_SLOW_OPS, SHM_DUMP_FAILURES };
+
+struct ShmCommand {
+    uint64_t seq = 0;
+    uint32_t op = SHM_NOP;
+    int32_t args[4] = { -1, -1, -1, -1 };
+};
+
+struct ShmCompletion {
+    uint64_t seq = 0;
+    int32_t status = 0;   // operation result: tokenId, or 1/0 for boolean calls, -1 on failure
+    int32_t reason = FAIL_NONE; // FailReason of a refused booking or triage
+    Token token;          // served or booked token when there is one
+};
+
+template <class T, uint32_t N>
+struct ShmSpscRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+    alignas(64) atomic<uint32_t> head; // advanced by the consumer
+    alignas(64) atomic<uint32_t> tail; // advanced by the producer
+    alignas(64) T entries[N];
+
+    bool push(const T& v) {
+        uint32_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == N) return false;
+        entries[t & (N - 1)] = v;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& out) {
+        uint32_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        out = entries[h & (N - 1)];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+};
+
+const uint32_t kShmRingEntries = 256;
+const int kShmMaxClients = 16;
+const uint32_t kShmMagic = 0x48535152; // "HSQR"
+const uint32_t kShmReportBytes = 64 * 1024;
+
+// An ostream target over a fixed buffer: output past the end is dropped and
+// sets the stream's badbit.
+class FixedTextBuf : public streambuf {
+public:
+    FixedTextBuf(char* p, size_t n) { setp(p, p + n); }
+    size_t used() const { return (size_t)(pptr() - pbase()); }
+};
+
+struct ShmClientChannel {
+    atomic<uint32_t> attached;
+    ShmSpscRing<ShmCommand, kShmRingEntries> submissions;
+    ShmSpscRing<ShmCompletion, kShmRingEntries> completions;
+    char report[kShmReportBytes]; // text of the newest SHM_DUMP_* reply, published by its completion
+};
+
+struct ShmRegion {
+    atomic<uint32_t> magic;
+    ShmClientChannel channels[kShmMaxClients];
+};
+
+class ShmCommandServer {
+private:
+    string shmName;
+    ShmRegion* region = nullptr;
+
+    // Renders a report into ch.report; returns its length in bytes. A report
+    // that does not fit is cut at the buffer's end.
+    template <class F>
+    static int writeReport(ShmClientChannel& ch, F render) {
+        FixedTextBuf buf(ch.report, kShmReportBytes);
+        ostream os(&buf);
+        render(os);
+        return (int)buf.used();
+    }
+
+    static ShmCompletion execute(HospitalSystem& H, const ShmCommand& c, ShmClientChannel& ch) {
+        ShmCompletion r; r.seq = c.seq; r.status = -1;
+        FailReason why = FAIL_NONE;
+        switch (c.op) {
+            case SHM_ENQUEUE_ROUTINE: // args: patient, doctor, slot, WalkInFlag bits
+                r.status = H.enqueueRoutine(c.args[0], c.args[1], c.args[2], &why, c.args[3] > 0 ? (unsigned)c.args[3] : 0u); break;
+            case SHM_TRIAGE_INSERT: r.status = H.triageInsert(c.args[0], c.args[1], &why) ? 1 : 0; break;
+            case SHM_SERVE_NEXT: r.status = H.serveNext(c.args[0], r.token) ? 1 : 0; break;
+            case SHM_UNDO: r.status = H.undoPop() ? 1 : 0; break;
+            case SHM_MARK_NO_SHOW: r.status = H.markNoShow(c.args[0], c.args[1]) ? 1 : 0; break;
+            case SHM_BOOK_APPOINTMENT: r.status = H.bookAppointment(c.args[0], c.args[1], c.args[2], c.args[3], r.token, &why); break;
+            case SHM_DUMP_SLOW_OPS: r.status = writeReport(ch, [&](ostream& os) { H.dumpSlowOps(os); }); break;
+            case SHM_DUMP_FAILURES: r.status = writeReport(ch, [&](ostream& os) { H.failureReport(os); }); break;
+            default: break;
+        }
+        r.reason = why;
+        return r;
+    }
+
+public:
+    ShmCommandServer() = default;
+    ShmCommandServer(const ShmCommandServer&) = delete;
+    ShmCommandServer& operator=(const ShmCommandServer&) = delete;
+
+    ~ShmCommandServer() { close(); }
+
+    // Creates (or recreates) the named region, e.g. "/hospital_cmd".
+    bool open(const string& name) {
+        close();
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (fd < 0) return false;
+        if (ftruncate(fd, sizeof(ShmRegion)) != 0) { ::close(fd); shm_unlink(name.c_str()); return false; }
+        void* mem = mmap(nullptr, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) { shm_unlink(name.c_str()); return false; }
+        region = new (mem) ShmRegion();
+        for (auto &ch : region->channels) {
+            ch.attached.store(0); ch.submissions.head.store(0); ch.submissions.tail.store(0);
+            ch.completions.head.store(0); ch.completions.tail.store(0);
+        }
+        region->magic.store(kShmMagic, memory_order_release);
+        shmName = name;
+        return true;
+    }
+
+    void close() {
+        if (!region) return;
+        munmap(region, sizeof(ShmRegion));
+        shm_unlink(shmName.c_str());
+        region = nullptr;
+    }
+
+    // Executes up to maxPerClient pending commands from every attached client.
+    // A command is only taken when its completion can be posted. Returns the count.
+    int poll(HospitalSystem& H, int maxPerClient = 32) {
+        int done = 0;
+        for (auto &ch : region->channels) {
+            if (!ch.attached.load(memory_order_acquire)) continue;
+            for (int i = 0; i < maxPerClient; ++i) {
+                auto& cq = ch.completions;
+                if (cq.tail.load(memory_order_relaxed) - cq.head.load(memory_order_acquire) == kShmRingEntries) break;
+                ShmCommand cmd;
+                if (!ch.submissions.pop(cmd)) break;
+                cq.push(execute(H, cmd, ch));
+                ++done;
+            }
+        }
+        return done;
+    }
+
+    // Busy-polls until stop is set.
+    void run(HospitalSystem& H, const atomic<bool>& stop) {
+        int spins = 0;
+        while (!stop.load(memory_order_relaxed)) {
+            if (poll(H)) spins = 0;
+            else cpuRelax(spins);
+        }
+    }
+};
+
+class ShmCommandClient {
+private:
+    ShmRegion* region = nullptr;
+    ShmClientChannel* channel = nullptr;
+    uint64_t nextSeq = 1;
+
+public:
+    ShmCommandClient() = default;
+    ShmCommandClient(const ShmCommandClient&) = delete;
+    ShmCommandClient& operator=(const ShmCommandClient&) = delete;
+
+    ~ShmCommandClient() { detach(); }
+
+    // Maps the server's region and claims a free channel.
+    bool attach(const string& name) {
+        detach();
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) return false;
+        void* mem = mmap(nullptr, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) return false;
+        region = static_cast<ShmRegion*>(mem);
+        if (region->magic.load(memory_order_acquire) != kShmMagic) { detach(); return false; }
+        for (auto &ch : region->channels) {
+            uint32_t expected = 0;
+            if (ch.attached.compare_exchange_strong(expected, 1, memory_order_acq_rel)) { channel = &ch; return true; }
+        }
+        detach();
+        return false;
+    }
+
+    void detach() {
+        if (channel) { channel->attached.store(0, memory_order_release); channel = nullptr; }
+        if (region) { munmap(region, sizeof(ShmRegion)); region = nullptr; }
+    }
+
+    // Posts cmd without waiting; returns its sequence number, or 0 if the ring is full.
+    uint64_t submit(ShmCommand cmd) {
+        cmd.seq = nextSeq;
+        if (!channel->submissions.push(cmd)) return 0;
+        return nextSeq++;
+    }
+
+    bool pollCompletion(ShmCompletion& out) { return channel->completions.pop(out); }
+
+    // Runs a report op (SHM_DUMP_SLOW_OPS, SHM_DUMP_FAILURES) and returns the
+    // server's text. Each report reuses the channel's one buffer, so report
+    // ops must not be left in flight behind each other.
+    string report(uint32_t op) {
+        ShmCompletion c = call(op);
+        if (c.status <= 0) return string();
+        return string(channel->report, (size_t)min<int32_t>(c.status, (int32_t)kShmReportBytes));
+    }
+
+    // Submits and spins for the matching completion.
+    ShmCompletion call(uint32_t op, int a0 = -1, int a1 = -1, int a2 = -1, int a3 = -1) {
+        ShmCommand cmd; cmd.op = op;
+        cmd.args[0] = a0; cmd.args[1] = a1; cmd.args[2] = a2; cmd.args[3] = a3;
+        int spins = 0;
+        uint64_t seq;
+        while ((seq = submit(cmd)) == 0) cpuRelax(spins);
+        ShmCompletion c;
+        while (true) {
+            if (pollCompletion(c) && c.seq == seq) return c;
+            cpuRelax(spins);
+        }
+    }
+};
+#endif
+
+// ----------------------------- Multi-facility Front -----------------------------
+// Each facility is a HospitalSystem shard owned by one worker thread. All calls
+// into a shard are posted to its task queue, so shard state is never shared and
+// needs no locks. The shard is constructed and used only on its worker
+// thread, so its slots come from that thread's SlotPool arenas; other
+// allocations land in the thread's malloc arena with glibc, which is an
+// allocator behaviour rather than a guarantee.
+typedef unordered_map<int, Patient> PatientMasterMap;
+
+struct FacilityStats {
+    int facilityId = 0;
+    int served = 0;
+    int pending = 0;
+    size_t patients = 0;
+    size_t doctors = 0;
+};
+
+class FacilityShard {
+private:
+    int facilityId;
+    unique_ptr<HospitalSystem> system;
+    deque<function<void(HospitalSystem&)>> tasks;
+    mutex mu;
+    condition_variable cv;
+    bool stopping = false;
+    thread worker;
+
+    void run(int cpu) {
+#ifdef __linux__
+        if (cpu >= 0) {
+            cpu_set_t set; CPU_ZERO(&set); CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#else
+        (void)cpu;
+#endif
+        system.reset(new HospitalSystem());
+        while (true) {
+            function<void(HospitalSystem&)> task;
+            {
+                unique_lock<mutex> lk(mu);
+                cv.wait(lk, [this]{ return stopping || !tasks.empty(); });
+                if (tasks.empty()) break; // stopping and drained
+                task = move(tasks.front()); tasks.pop_front();
+            }
+            task(*system);
+        }
+        system.reset();
+    }
+
+public:
+    FacilityShard(int fid, int cpu) : facilityId(fid) {
+        worker = thread(&FacilityShard::run, this, cpu);
+    }
+
+    ~FacilityShard() {
+        { lock_guard<mutex> lk(mu); stopping = true; }
+        cv.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+
+    FacilityShard(const FacilityShard&) = delete;
+    FacilityShard& operator=(const FacilityShard&) = delete;
+
+    int id() const { return facilityId; }
+
+    // Runs f(HospitalSystem&) on the shard's thread; the result comes back through the future.
+    template <class F>
+    auto submit(F f) -> future<decltype(f(declval<HospitalSystem&>()))> {
+        typedef decltype(f(declval<HospitalSystem&>())) R;
+        auto task = make_shared<packaged_task<R(HospitalSystem&)>>(move(f));
+        future<R> fut = task->get_future();
+        {
+            lock_guard<mutex> lk(mu);
+            tasks.push_back([task](HospitalSystem& H) { (*task)(H); });
+        }
+        cv.notify_one();
+        return fut;
+    }
+};
+
+class HospitalNetwork {
+private:
+    map<int, unique_ptr<FacilityShard>> shards;
+    shared_ptr<const PatientMasterMap> master = make_shared<const PatientMasterMap>();
+    bool pinThreads;
+
+    FacilityShard* shardFor(int facilityId) {
+        auto it = shards.find(facilityId);
+        return it == shards.end() ? nullptr : it->second.get();
+    }
+
+public:
+    explicit HospitalNetwork(bool pin = true) : pinThreads(pin) {}
+
+    bool addFacility(int facilityId) {
+        if (shards.count(facilityId)) return false;
+        int cpu = -1;
+        if (pinThreads) {
+            unsigned hw = thread::hardware_concurrency();
+            if (hw > 0) cpu = (int)(shards.size() % hw);
+        }
+        shards.emplace(facilityId, unique_ptr<FacilityShard>(new FacilityShard(facilityId, cpu)));
+        return true;
+    }
+
+    size_t facilityCount() const { return shards.size(); }
+
+    // Routes f to the facility's shard. Returns an invalid future for unknown facilities.
+    template <class F>
+    auto route(int facilityId, F f) -> future<decltype(f(declval<HospitalSystem&>()))> {
+        FacilityShard* sh = shardFor(facilityId);
+        if (!sh) return future<decltype(f(declval<HospitalSystem&>()))>();
+        return sh->submit(move(f));
+    }
+
+    // ---- master patient index (read-only snapshot shared by all shards) ----
+    void publishMasterIndex(PatientMasterMap m) {
+        shared_ptr<const PatientMasterMap> next = make_shared<const PatientMasterMap>(move(m));
+        atomic_store(&master, next);
+    }
+
+    shared_ptr<const PatientMasterMap> masterIndex() const { return atomic_load(&master); }
+
+    bool registerFromMaster(int facilityId, int patientId) {
+        shared_ptr<const PatientMasterMap> snap = masterIndex();
+        auto it = snap->find(patientId);
+        if (it == snap->end()) return false;
+        Patient p = it->second;
+        auto fut = route(facilityId, [p](HospitalSystem& H) { H.patientUpsert(p); return true; });
+        return fut.valid() && fut.get();
+    }
+
+    // ---- routed convenience calls ----
+    bool addDoctor(int facilityId, int docId, const string& name, const string& spec, int queueCap = 10) {
+        auto fut = route(facilityId, [=](HospitalSystem& H) { return H.addDoctor(docId, name, spec, queueCap); });
+        return fut.valid() && fut.get();
+    }
+
+    bool scheduleAddSlot(int facilityId, int doctorId, int slotId, const string& startTime, const string& endTime) {
+        auto fut = route(facilityId, [=](HospitalSystem& H) { return H.scheduleAddSlot(doctorId, slotId, startTime, endTime); });
+        return fut.valid() && fut.get();
+    }
+
+    int enqueueRoutine(int facilityId, int patientId, int doctorId, int slotId = -1) {
+        auto fut = route(facilityId, [=](HospitalSystem& H) { return H.enqueueRoutine(patientId, doctorId, slotId); });
+        return fut.valid() ? fut.get() : -1;
+    }
+
+    bool triageInsert(int facilityId, int patientId, int severity) {
+        auto fut = route(facilityId, [=](HospitalSystem& H) { return H.triageInsert(patientId, severity); });
+        return fut.valid() && fut.get();
+    }
+
+    bool serveNext(int facilityId, int doctorId, Token& servedOut) {
+        auto fut = route(facilityId, [=](HospitalSystem& H) {
+            Token t; bool ok = H.serveNext(doctorId, t);
+            return make_pair(ok, t);
+        });
+        if (!fut.valid()) return false;
+        pair<bool, Token> r = fut.get();
+        if (r.first) servedOut = r.second;
+        return r.first;
+    }
+
+    // ---- cross-facility reports: scatter to every shard, then gather ----
+    vector<FacilityStats> crossFacilityReport() {
+        vector<future<FacilityStats>> pending;
+        for (auto &kv : shards) {
+            int fid = kv.first;
+            pending.push_back(kv.second->submit([fid](HospitalSystem& H) {
+                FacilityStats s; s.facilityId = fid;
+                s.served = H.servedTotal(); s.pending = H.pendingTotal();
+                s.patients = H.patientCount(); s.doctors = H.doctorCount();
+                return s;
+            }));
         }
-        return nullptr;
+        vector<FacilityStats> out;
+        for (auto &f : pending) out.push_back(f.get());
+        return out;
     }
 
-    SlotNode* nextFreeSlot() {
-        SlotNode* cur = slotHead;
-        while (cur) {
-            if (!cur->taken) return cur;
-            cur = cur->next;
+    void printNetworkReport() {
+        vector<FacilityStats> all = crossFacilityReport();
+        int served = 0, pend = 0;
+        for (auto &s : all) {
+            cout << "Facility " << s.facilityId << ": doctors " << s.doctors << ", patients " << s.patients
+                 << ", served " << s.served << ", pending " << s.pending << "\n";
+            served += s.served; pend += s.pending;
         }
-        return nullptr;
+        cout << "All facilities: served " << served << " | pending " << pend << "\n";
     }
+};
 
-    void printSlots() {
-        cout << "Slots for Dr. " << name << " (id " << id << "):\n";
-        SlotNode* cur = slotHead;
-        while (cur) {
-            cout << "  SlotId: " << cur->slotId << " [" << cur->startTime << "-" << cur->endTime << "]"
-                 << (cur->taken ? " (TAKEN)" : " (FREE)") << "\n";
-            cur = cur->next;
+// ----------------------------- Benchmarks -----------------------------
+// Run with: ./hospital_system --bench
+typedef chrono::steady_clock BenchClock;
+static volatile uint64_t benchSink; // keeps benchmark results observable
+
+static double msSince(BenchClock::time_point t0) {
+    return chrono::duration<double, milli>(BenchClock::now() - t0).count();
+}
+
+struct BenchRng {
+    uint64_t s;
+    explicit BenchRng(uint64_t seed) : s(seed * 0x9E3779B97F4A7C15ull + 1) {}
+    uint32_t next() { s ^= s << 13; s ^= s >> 7; s ^= s << 17; return (uint32_t)s; }
+    int below(int n) { return (int)(next() % (uint32_t)n); }
+};
+
+// Deterministic desk traffic: registrations, bookings, triage, serves and undos.
+static void simulateDeskDay(HospitalSystem& H, int doctorsN, int patientsN, int ops, uint64_t seed) {
+    static const char* kSpecs[] = { "General", "Cardio", "Ortho", "Pediatrics" };
+    static const char* kHistory[] = { "No_history", "Allergy_pollen", "Asthma", "Hypertension", "Diabetes_type2", "Follow_up" };
+    BenchRng rng(seed);
+    for (int d = 1; d <= doctorsN; ++d) {
+        H.addDoctor(d, "Dr_" + to_string(d), kSpecs[d % 4], 64);
+        for (int s = 0; s < 32; ++s) {
+            int m = 9 * 60 + s * 15;
+            char a[16], b[16];
+            snprintf(a, sizeof(a), "%02d:%02d", m / 60, m % 60);
+            snprintf(b, sizeof(b), "%02d:%02d", (m + 15) / 60, (m + 15) % 60);
+            H.scheduleAddSlot(d, d * 100 + s, a, b);
         }
     }
-};
+    for (int p = 1; p <= patientsN; ++p)
+        H.patientUpsert(Patient{p, "Patient_" + to_string(p), 1 + rng.below(90), kHistory[rng.below(6)], 0});
+    for (int i = 0; i < ops; ++i) {
+        int r = rng.below(10);
+        int doc = 1 + rng.below(doctorsN), pid = 1 + rng.below(patientsN);
+        Token t;
+        if (r <= 3) H.enqueueRoutine(pid, doc);
+        else if (r <= 5) H.serveNext(doc, t);
+        else if (r == 6) H.triageInsert(pid, 1 + rng.below(10));
+        else if (r == 7) H.patientUpsert(Patient{pid, "Patient_" + to_string(pid), 1 + rng.below(90), kHistory[rng.below(6)], 0});
+        else if (r == 8) H.enqueueRoutine(pid, doc, doc * 100 + rng.below(32));
+        else H.undoPop();
+    }
+}
 
-// ----------------------------- Emergency Triage -----------------------------
-struct TriagedToken {
-    int severity;
-    Token token;
-    bool operator>(TriagedToken const& other) const {
-        if (severity != other.severity) return severity > other.severity;
-        return token.tokenId > other.token.tokenId;
+static void benchOpLog() {
+    cout << "[oplog] compressed segments vs raw\n";
+    OpLog packed(4096, true);
+    {
+        HospitalSystem H; H.attachOpLog(&packed);
+        simulateDeskDay(H, 40, 20000, 300000, 7);
+        packed.seal();
     }
-};
+    OpLog raw(4096, false);
+    packed.replay([&](const Action& a) { raw.append(a); });
+    raw.seal();
 
-// ----------------------------- Undo Stack -----------------------------
-enum ActionType { BOOK, CANCEL, SERVE, REGISTER_PATIENT, TRIAGE_INSERT };
+    uint64_t sumPacked = 0, sumRaw = 0;
+    const int rounds = 5;
+    BenchClock::time_point t0 = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) raw.replay([&](const Action& a) { sumRaw += (uint64_t)a.token.tokenId + a.timestamp; });
+    double rawMs = msSince(t0);
+    t0 = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) packed.replay([&](const Action& a) { sumPacked += (uint64_t)a.token.tokenId + a.timestamp; });
+    double packedMs = msSince(t0);
 
-struct Action {
-    ActionType type;
-    Token token;
-    int slotId = -1;
-    int doctorId = -1;
-    Patient patientSnapshot;
-    bool slotPreviouslyTaken = false;
-    int severity = 0;
-    int patientIdForUpsert = -1;
-    bool patientExistedBefore = false;
-};
+    double recs = (double)packed.recordCount() * rounds;
+    cout << "  records " << packed.recordCount() << " in " << packed.segmentCount() << " segments"
+         << (sumRaw == sumPacked ? "" : "  (REPLAY MISMATCH)") << "\n";
+    cout << "  raw size        " << raw.storedBytes() << " bytes, replay " << (recs / rawMs / 1000.0) << " Mrec/s\n";
+    cout << "  compressed size " << packed.storedBytes() << " bytes (" << (100.0 * packed.storedBytes() / raw.storedBytes())
+         << "% of raw), replay " << (recs / packedMs / 1000.0) << " Mrec/s\n";
+}
 
-// ----------------------------- HospitalSystem -----------------------------
-class HospitalSystem {
-private:
-    unordered_map<int, Doctor> doctors;
-    unordered_map<int, Patient> patients;
-    priority_queue<TriagedToken, vector<TriagedToken>, greater<TriagedToken>> triageHeap;
-    stack<Action> undoStack;
-    int nextTokenId = 1;
-    int servedCount = 0;
-    int pendingCountTotal = 0;
+static void benchRoutineRings() {
+    cout << "[rings] dynamic (vector, % capacity) vs fixed (std::array, mask)\n";
+    const int ops = 20000000;
+    volatile int cap = 16; // runtime value, as addDoctor would pass it
+    DynamicRoutineRing dyn(cap);
+    FixedRoutineRing<16> fixed;
+    Token t; uint64_t sink = 0;
+    BenchClock::time_point t0 = BenchClock::now();
+    for (int i = 0; i < ops; ++i) {
+        t.tokenId = i;
+        if (!dyn.push(t)) { dyn.pop(t); sink += t.tokenId; dyn.push(t); }
+        if ((i & 3) == 3) { dyn.pop(t); sink += t.tokenId; }
+    }
+    double dynMs = msSince(t0);
+    t0 = BenchClock::now();
+    for (int i = 0; i < ops; ++i) {
+        t.tokenId = i;
+        if (!fixed.push(t)) { fixed.pop(t); sink += t.tokenId; fixed.push(t); }
+        if ((i & 3) == 3) { fixed.pop(t); sink += t.tokenId; }
+    }
+    double fixedMs = msSince(t0);
+    benchSink = sink;
+    cout << "  dynamic " << (dynMs * 1e6 / ops) << " ns/op, fixed " << (fixedMs * 1e6 / ops) << " ns/op\n";
+}
 
-public:
-    HospitalSystem() = default;
+// Book-then-serve rounds against a 200k-patient table: the booking resolves
+// the patient once and the token's handle carries it to the serve.
+static void benchServePath() {
+    cout << "[serve] triage+serve and walk-in+serve rounds, 200k patients\n";
+    const int n = 200000, rounds = 1000000;
+    HospitalSystem H;
+    H.reserveCapacity(n, 1024, 1024);
+    H.addDoctor(1, "Dr_Bench", "General", 64);
+    for (int p = 1; p <= n; ++p)
+        H.patientUpsert(Patient{p * 7 + 1, "Patient_" + to_string(p), 1 + p % 90, "History_note_" + to_string(p % 50), 0});
+    BenchRng rng(3);
+    vector<int> ids(1 << 16);
+    for (int &id : ids) id = rng.below(n) * 7 + 8;
+    Token t;
+    BenchClock::time_point t0 = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) { H.triageInsert(ids[i & 0xffff], 1 + (i & 7)); H.serveNext(1, t); }
+    double emMs = msSince(t0);
+    t0 = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) { H.enqueueRoutine(ids[i & 0xffff], 1); H.serveNext(1, t); }
+    double walkMs = msSince(t0);
+    cout << "  emergency " << (emMs * 1e6 / rounds) << " ns/round, walk-in " << (walkMs * 1e6 / rounds) << " ns/round\n";
+}
 
-    bool addDoctor(int docId, const string& name, const string& spec, int queueCap = 10) {
-        if (doctors.count(docId)) return false;
-        doctors.emplace(docId, Doctor(docId, name, spec, queueCap));
-        return true;
+// Walk-ins in three routine classes: enqueue+serve cost, and undo of a
+// walk-in booking at a nearly full doctor, which takes the token off the
+// tail of its class ring instead of rebuilding the queue.
+static void benchRoutineClasses() {
+    cout << "[classes] walk-ins in priority/follow-up/standard rings\n";
+    const int rounds = 1000000, cap = 64;
+    HospitalSystem H;
+    H.addDoctor(1, "Dr_Bench", "General", cap);
+    for (int p = 1; p <= 100; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), p % 10 == 0 ? 80 : 40, "", 0});
+    Token t; uint64_t sink = 0;
+    BenchClock::time_point t0 = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) {
+        H.enqueueRoutine(1 + i % 100, 1, -1, nullptr, (i & 7) == 3 ? WALKIN_FOLLOW_UP : 0);
+        if (i & 1) { H.serveNext(1, t); sink += t.routineClass; H.serveNext(1, t); sink += t.routineClass; }
     }
+    double mixMs = msSince(t0);
+    while (H.serveNext(1, t)) {}
+    for (int i = 0; i < cap - 4; ++i) H.enqueueRoutine(1 + i % 100, 1, -1, nullptr, i % 3 == 0 ? WALKIN_FOLLOW_UP : 0);
+    t0 = BenchClock::now();
+    for (int i = 0; i < rounds; ++i) { H.enqueueRoutine(1 + i % 100, 1); H.undoPop(); }
+    double undoMs = msSince(t0);
+    benchSink = sink;
+    cout << "  enqueue+serve " << (mixMs * 1e6 / rounds) << " ns/walk-in, enqueue+undo with " << cap - 4
+         << " waiting " << (undoMs * 1e6 / rounds) << " ns/round\n";
+}
 
-    bool scheduleAddSlot(int doctorId, int slotId, const string& startTime, const string& endTime) {
-        auto it = doctors.find(doctorId);
-        if (it == doctors.end()) return false;
-        it->second.insertSlot(slotId, startTime, endTime);
-        return true;
+// A 2,000-patient vaccination drive at one doctor: every patient booked
+// with enqueueRoutine and served with serveNext, against check-in and
+// serve in batches into a group session. Both end with the whole drive undone.
+static void benchGroupSession() {
+    cout << "[group] 2000-patient drive: per-patient walk-ins vs group session batches\n";
+    const int n = 2000, batch = 50, drives = 50;
+    HospitalSystem H;
+    H.addDoctor(1, "Dr_Bench", "General", n);
+    for (int p = 1; p <= n; ++p) H.patientUpsert(Patient{p, "Patient_" + to_string(p), 1 + p % 90, "", 0});
+    vector<int> ids(n);
+    for (int i = 0; i < n; ++i) ids[i] = i + 1;
+    auto undoDepth = [&]() { size_t depth, inMemory; uint64_t spilled; H.undoStats(depth, inMemory, spilled); return depth; };
+    Token t; uint64_t sink = 0;
+    double singleMs = 0, singleUndoMs = 0, groupMs = 0, groupUndoMs = 0;
+    size_t singleActions = 0, groupActions = 0;
+    for (int d = 0; d < drives; ++d) {
+        size_t depth = undoDepth();
+        BenchClock::time_point t0 = BenchClock::now();
+        for (int i = 0; i < n; i += batch) {
+            for (int k = i; k < i + batch; ++k) H.enqueueRoutine(ids[k], 1);
+            for (int k = 0; k < batch; ++k) { H.serveNext(1, t); sink += t.tokenId; }
+        }
+        singleMs += msSince(t0);
+        singleActions = undoDepth() - depth;
+        t0 = BenchClock::now();
+        while (undoDepth() > depth) H.undoPop();
+        singleUndoMs += msSince(t0);
+
+        H.scheduleAddGroupSession(1, d, "09:00", "17:00", n);
+        vector<Token> served; served.reserve(batch);
+        t0 = BenchClock::now();
+        for (int i = 0; i < n; i += batch) {
+            H.groupCheckIn(1, d, vector<int>(ids.begin() + i, ids.begin() + i + batch));
+            served.clear(); H.groupServe(1, d, batch, &served); sink += served.back().tokenId;
+        }
+        groupMs += msSince(t0);
+        groupActions = undoDepth() - depth;
+        t0 = BenchClock::now();
+        while (undoDepth() > depth) H.undoPop();
+        groupUndoMs += msSince(t0);
+        H.scheduleRemoveGroupSession(1, d);
     }
+    benchSink = sink;
+    cout << "  per patient: " << (singleMs * 1e6 / drives / n) << " ns/patient, " << singleActions << " undo records, undo "
+         << (singleUndoMs * 1e6 / drives / n) << " ns/patient\n";
+    cout << "  group (batches of " << batch << "): " << (groupMs * 1e6 / drives / n) << " ns/patient, " << groupActions
+         << " undo records, undo " << (groupUndoMs * 1e6 / drives / n) << " ns/patient\n";
+}
 
-    bool scheduleCancelSlot(int doctorId, int slotId) {
-        auto it = doctors.find(doctorId); if (it == doctors.end()) return false;
-        SlotNode* slot = it->second.findSlot(slotId); if (!slot) return false;
-        if (slot->taken) {
-            Action act; act.type = CANCEL;
-            act.token = Token{slot->tokenId, -1, doctorId, slotId, ROUTINE};
-            act.slotId = slotId; act.doctorId = doctorId; act.slotPreviouslyTaken = true;
-            undoStack.push(act);
-            --pendingCountTotal;
-            slot->taken = false; slot->tokenId = -1;
+// Serves with the history off and at its default retention, then a
+// patient's last 10 visits from the chunk index against scanning the log
+// backwards, which is what finding them without the index costs.
+static void benchVisitHistory() {
+    cout << "[visits] per-patient history: serve overhead, last-10 lookup, memory at retention\n";
+    const int n = 100000, doctorsN = 40, serves = 1000000, lookups = 2000;
+    // Returns ns per serve over a million walk-ins.
+    auto drive = [&](HospitalSystem& S) {
+        S.reserveCapacity(n, 1 << 16, 1024);
+        for (int d = 1; d <= doctorsN; ++d) S.addDoctor(d, "Dr_" + to_string(d), "General", 1024);
+        for (int p = 1; p <= n; ++p) S.patientUpsert(Patient{p, "P", 1 + p % 90, "", 0});
+        BenchRng rng(17);
+        Token t; uint64_t sink = 0;
+        double ms = 0;
+        for (int i = 0; i < serves; i += 1000) {
+            for (int k = 0; k < 1000; ++k) S.enqueueRoutine(1 + rng.below(n), 1 + k % doctorsN);
+            BenchClock::time_point t0 = BenchClock::now();
+            for (int k = 0; k < 1000; ++k) { S.serveNext(1 + k % doctorsN, t); sink += t.tokenId; }
+            ms += msSince(t0);
         }
-        return it->second.cancelSlot(slotId);
+        benchSink = sink;
+        return ms * 1e6 / serves;
+    };
+    double offNs;
+    {
+        HospitalSystem off;
+        off.setVisitRetention(0, 1);
+        offNs = drive(off);
+    }
+    HospitalSystem H;
+    double onNs = drive(H);
+    size_t retained = 0, chunks = 0, bytes = 0;
+    H.visitStats(retained, chunks, bytes);
+    // The visits the index reaches, in serve order, as a plain log would hold them.
+    vector<VisitRecord> log;
+    log.reserve(retained);
+    for (int p = 1; p <= n; ++p) {
+        vector<VisitRecord> v;
+        H.recentVisits(p, SIZE_MAX, v);
+        log.insert(log.end(), v.begin(), v.end());
+    }
+    sort(log.begin(), log.end(), [](const VisitRecord& a, const VisitRecord& b) { return a.tokenId < b.tokenId; });
+    BenchRng rng(23);
+    vector<VisitRecord> out;
+    uint64_t found = 0;
+    BenchClock::time_point t0 = BenchClock::now();
+    for (int i = 0; i < lookups; ++i) found += H.recentVisits(1 + rng.below(n), 10, out);
+    double indexUs = msSince(t0) * 1e3 / lookups;
+    uint64_t scanned = 0;
+    t0 = BenchClock::now();
+    for (int i = 0; i < lookups; ++i) {
+        int pid = 1 + rng.below(n);
+        size_t got = 0;
+        for (size_t j = log.size(); j-- > 0 && got < 10;) if (log[j].patientId == pid) ++got;
+        scanned += got;
     }
+    double scanUs = msSince(t0) * 1e3 / lookups;
+    benchSink = found + scanned;
+    cout << "  serve: " << offNs << " ns with the history off, " << onNs << " ns at retention " << retained << "\n";
+    cout << "  last 10 visits: index " << indexUs << " us, log scan " << scanUs << " us (" << found / lookups << " visits/lookup)\n";
+    cout << "  " << retained << " visits in " << chunks << " chunks, " << bytes / 1024 << " KiB\n";
+}
 
-    void patientUpsert(const Patient& p) {
-        bool existed = patients.find(p.id) != patients.end();
-        Action act; act.type = REGISTER_PATIENT;
-        act.patientExistedBefore = existed;
-        act.patientIdForUpsert = p.id;
-        act.patientSnapshot = existed ? patients[p.id] : Patient();
-        undoStack.push(act);
-        patients[p.id] = p;
+// Cohort counts over a million patients: one age band, a band range
+// joined with the pending and seen-by filters, and all four filters.
+static void benchCohorts() {
+    cout << "[cohorts] bitmap cohort counts, 1M patients\n";
+    static const char* kSpecs[] = { "General", "Cardio", "Ortho", "Pediatrics" };
+    const int n = 1000000, doctorsN = 40, queries = 2000;
+    HospitalSystem H;
+    H.reserveCapacity(n, 1 << 18, 1024);
+    for (int d = 1; d <= doctorsN; ++d) H.addDoctor(d, "Dr_" + to_string(d), kSpecs[d % 4], 1024);
+    BenchRng rng(11);
+    for (int p = 1; p <= n; ++p) H.patientUpsert(Patient{p, "P", rng.below(100), "", 0});
+    Token t;
+    for (int i = 0; i < 400000; ++i) {
+        H.enqueueRoutine(1 + rng.below(n), 1 + i % doctorsN);
+        if (i % 3) H.serveNext(1 + i % doctorsN, t);
     }
+    for (int i = 0; i < 100000; ++i) H.triageInsert(1 + rng.below(n), 1 + rng.below(9));
+    CohortQuery band; band.minAge = 60; band.maxAge = 69;
+    CohortQuery joined; joined.minAge = 40; joined.pending = true; joined.seenBy = "Cardio";
+    CohortQuery all4 = joined; all4.triagedToday = true;
+    const CohortQuery* qs[] = { &band, &joined, &all4 };
+    const char* names[] = { "one band", "bands+pending+seen", "+triaged today" };
+    for (int k = 0; k < 3; ++k) {
+        uint64_t count = 0;
+        BenchClock::time_point t0 = BenchClock::now();
+        for (int i = 0; i < queries; ++i) count += H.cohortCount(*qs[k]);
+        double ms = msSince(t0);
+        cout << "  " << names[k] << ": " << count / queries << " patients, " << (ms * 1e3 / queries) << " us/query\n";
+    }
+    cout << "  bitmaps hold " << H.cohortBytes() / 1024 << " KiB\n";
+}
 
-    bool patientGet(int patientId, Patient& out) {
-        auto it = patients.find(patientId);
-        if (it == patients.end()) return false;
-        out = it->second;
-        return true;
+#ifdef HOSPITAL_HAVE_SHM
+// Round trips from a forked client process through the shared-memory rings.
+static void benchShmRing() {
+    cout << "[shm] client process -> shared-memory ring -> server round trip\n";
+    const string name = "/hospital_bench_" + to_string(getpid());
+    ShmCommandServer server;
+    if (!server.open(name)) { cout << "  shm_open failed, skipped\n"; return; }
+    HospitalSystem H;
+    H.addDoctor(1, "Dr_Bench", "General", 1024);
+    for (int p = 1; p <= 100; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), 30, "", 0});
+    fflush(stdout); cout.flush();
+    pid_t child = fork();
+    if (child == 0) {
+        ShmCommandClient client;
+        if (!client.attach(name)) _exit(1);
+        const int calls = 50000;
+        vector<double> lat; lat.reserve(calls);
+        for (int i = 0; i < calls; ++i) {
+            BenchClock::time_point t0 = BenchClock::now();
+            if (i & 1) client.call(SHM_SERVE_NEXT, 1);
+            else client.call(SHM_ENQUEUE_ROUTINE, 1 + i % 100, 1);
+            lat.push_back(chrono::duration<double, nano>(BenchClock::now() - t0).count());
+        }
+        sort(lat.begin(), lat.end());
+        printf("  %d calls: p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns\n", calls,
+               lat[calls / 2], lat[calls * 99 / 100], lat[calls * 999 / 1000]);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status = 0, spins = 0;
+    while (waitpid(child, &status, WNOHANG) == 0) {
+        if (server.poll(H)) spins = 0; else cpuRelax(spins);
     }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) cout << "  client failed\n";
+    if (thread::hardware_concurrency() < 2) cout << "  (single CPU: client and server time-slice, latency is scheduler bound)\n";
+}
+#endif
 
-    int enqueueRoutine(int patientId, int doctorId, int slotId = -1) {
-        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return -1;
-        if (patients.find(patientId) == patients.end()) return -1;
-        Doctor& D = dit->second;
-        Token tk; tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = doctorId; tk.slotId = slotId; tk.type = ROUTINE;
-        if (slotId != -1) {
-            SlotNode* slot = D.findSlot(slotId); if (!slot || slot->taken) return -1;
-            slot->taken = true; slot->tokenId = tk.tokenId;
-            Action act; act.type = BOOK; act.token = tk; act.slotId = slotId; act.doctorId = doctorId; undoStack.push(act);
-            ++pendingCountTotal; ++patients[patientId].freq; return tk.tokenId;
-        } else {
-            if (D.isFull()) return -1;
-            D.enqueueRoutine(tk);
-            Action act; act.type = BOOK; act.token = tk; act.doctorId = doctorId; undoStack.push(act);
-            ++pendingCountTotal; ++patients[patientId].freq; return tk.tokenId;
+#ifdef HOSPITAL_HAVE_MMAP
+// Routine enqueue latency with queues in memory vs in a memory-mapped file.
+static void benchPersistentQueues() {
+    cout << "[pqueue] enqueueRoutine latency: in-memory vs memory-mapped file\n";
+    const string path = "/tmp/hospital_bench_queues_" + to_string(getpid());
+    const int batch = 200;
+    const uint32_t modes[] = { 0, 4096, 64, 1 }; // 0 = in-memory, else msync every N writes
+    for (uint32_t syncEvery : modes) {
+        PersistentQueueStore store;
+        HospitalSystem H;
+        H.addDoctor(1, "Dr_Bench", "General", batch);
+        for (int p = 1; p <= 100; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), 30, "", 0});
+        if (syncEvery) {
+            unlink(path.c_str());
+            if (!store.open(path, 4, 8192, 16, syncEvery)) { cout << "  cannot map " << path << "\n"; return; }
+            H.attachQueueStore(&store);
+        }
+        double ms = 0; Token t;
+        int rounds = syncEvery == 1 ? 10 : 500;
+        for (int i = 0; i < batch; ++i) H.enqueueRoutine(1 + i % 100, 1); // warm-up
+        while (H.serveNext(1, t)) {}
+        for (int r = 0; r < rounds; ++r) {
+            BenchClock::time_point t0 = BenchClock::now();
+            for (int i = 0; i < batch; ++i) H.enqueueRoutine(1 + i % 100, 1);
+            ms += msSince(t0);
+            while (H.serveNext(1, t)) {}
         }
+        if (syncEvery) cout << "  mmap, msync every " << syncEvery << " writes: ";
+        else cout << "  in-memory: ";
+        cout << (ms * 1e6 / (batch * rounds)) << " ns/enqueue\n";
     }
+    unlink(path.c_str());
+}
+#endif
 
-    bool serveNext(int doctorId, Token& servedOut) {
-        if (!triageHeap.empty()) {
-            TriagedToken tt = triageHeap.top(); triageHeap.pop();
-            Token served = tt.token; served.type = EMERGENCY;
-            ++servedCount; --pendingCountTotal;
-            Action act; act.type = SERVE; act.token = served; act.severity = tt.severity; undoStack.push(act);
-            if (served.patientId != -1) ++patients[served.patientId].freq;
-            servedOut = served;
-            return true;
+static void benchCheckpoints() {
+    cout << "[ckpt] full base vs dirty-only delta\n";
+    const string prefix = "/tmp/hospital_bench_ckpt";
+    HospitalSystem H;
+    simulateDeskDay(H, 40, 200000, 50000, 11);
+    BenchClock::time_point t0 = BenchClock::now();
+    if (!H.writeCheckpoint(prefix)) { cout << "  cannot write " << prefix << ".base\n"; return; }
+    double baseMs = msSince(t0);
+    size_t baseBytes = H.lastCheckpointBytes();
+    cout << "  base: " << baseBytes << " bytes, " << baseMs << " ms\n";
+    const int changes[] = { 100, 300, 1000 };
+    BenchRng rng(12);
+    for (int n : changes) {
+        for (int i = 0; i < n; ++i) {
+            int pid = 1 + rng.below(200000), doc = 1 + rng.below(40);
+            Token t;
+            if (i % 3 == 0) H.serveNext(doc, t); else H.enqueueRoutine(pid, doc);
         }
-        auto dit = doctors.find(doctorId); if (dit == doctors.end()) return false;
-        Doctor& D = dit->second;
-        Token maybeTk;
-        if (!D.dequeueRoutine(maybeTk)) {
-            SlotNode* s = D.slotHead;
-            while (s) {
-                if (s->taken) {
-                    Token served; served.tokenId = s->tokenId; served.patientId = -1; served.doctorId = doctorId; served.slotId = s->slotId; served.type = ROUTINE;
-                    s->taken = false; s->tokenId = -1;
-                    ++servedCount; --pendingCountTotal;
-                    Action act; act.type = SERVE; act.token = served; undoStack.push(act);
-                    servedOut = served;
-                    return true;
+        t0 = BenchClock::now();
+        H.writeCheckpoint(prefix);
+        double ms = msSince(t0);
+        cout << "  delta after " << n << " ops: " << H.lastCheckpointBytes() << " bytes ("
+             << (100.0 * H.lastCheckpointBytes() / baseBytes) << "% of base), " << ms << " ms\n";
+    }
+    t0 = BenchClock::now();
+    HospitalSystem L;
+    bool ok = L.loadCheckpoint(prefix);
+    double loadMs = msSince(t0);
+    cout << "  load base + " << L.checkpointDeltaCount() << " deltas: " << loadMs << " ms, checksum "
+         << (ok && L.stateChecksum() == H.stateChecksum() ? "matches" : "DIFFERS") << "\n";
+    remove((prefix + ".base").c_str());
+    for (int i = 1; i <= H.checkpointDeltaCount(); ++i) remove((prefix + ".delta." + to_string(i)).c_str());
+}
+
+// Visit notes in the shape the front desk writes them, years of them per patient.
+static string syntheticHistory(BenchRng& rng) {
+    static const char* kDept[] = { "General", "Cardio", "Ortho", "Pediatrics", "ENT", "Derm" };
+    static const char* kNote[] = { "hypertension review", "annual checkup", "knee pain follow-up", "asthma control",
+                                   "diabetes type 2 review", "rash, topical advised", "fever and cough", "post-op wound check" };
+    static const char* kRx[] = { "amlodipine 5mg", "metformin 500mg", "paracetamol 650mg", "salbutamol inhaler",
+                                 "ibuprofen 400mg", "none" };
+    string h;
+    int visits = 3 + rng.below(40);
+    int dept = rng.below(6), note = rng.below(8), rx = rng.below(6); // the patient's usual complaint
+    char buf[160];
+    for (int v = 0; v < visits; ++v) {
+        bool usual = rng.below(10) < 7;
+        snprintf(buf, sizeof(buf), "%04d-%02d-%02d %s: %s; BP %d/%d; Rx %s. ", 2012 + v * 14 / visits, 1 + rng.below(12),
+                 1 + rng.below(28), kDept[usual ? dept : rng.below(6)], kNote[usual ? note : rng.below(8)],
+                 105 + rng.below(50), 65 + rng.below(30), kRx[usual ? rx : rng.below(6)]);
+        h += buf;
+    }
+    return h;
+}
+
+static void benchColdHistory() {
+    cout << "[history] plain vs packed cold patient history\n";
+    const int patientsN = 50000, gets = 200000;
+    HospitalSystem H;
+    BenchRng rng(21);
+    for (int p = 1; p <= patientsN; ++p) H.patientUpsert(Patient{p, "Patient_" + to_string(p), 1 + rng.below(90), syntheticHistory(rng), 0});
+    auto timeGets = [&]() {
+        Patient out; size_t sink = 0;
+        BenchClock::time_point t0 = BenchClock::now();
+        for (int i = 0; i < gets; ++i) { H.patientGet(1 + rng.below(patientsN), out); sink += out.history.size(); }
+        benchSink = sink;
+        return msSince(t0) * 1e6 / gets;
+    };
+    size_t plain, packed, cold;
+    H.historyFootprint(plain, packed, cold);
+    double ns = timeGets();
+    cout << "  plain: " << plain / 1024 << " KiB, patientGet " << ns << " ns\n";
+    for (int dict = 0; dict < 2; ++dict) {
+        H.thawAllHistories();
+        BenchClock::time_point t0 = BenchClock::now();
+        if (dict) H.trainHistoryDictionary(16384);
+        double trainMs = msSince(t0);
+        t0 = BenchClock::now();
+        H.freezeColdHistories(0);
+        double freezeMs = msSince(t0);
+        H.historyFootprint(plain, packed, cold);
+        ns = timeGets();
+        cout << "  packed" << (dict ? " + 16 KiB dictionary" : "") << ": " << (plain + packed + H.historyDictionaryBytes()) / 1024
+             << " KiB (" << cold << " cold), freeze " << freezeMs << " ms";
+        if (dict) cout << ", train " << trainMs << " ms";
+        cout << ", patientGet " << ns << " ns\n";
+    }
+}
+
+// Population churn: archive the idle half, register newcomers, repeat; the
+// store should stay dense and lookups flat while no single call stalls.
+static void benchPatientChurn() {
+    cout << "[churn] patient store under archive/register churn\n";
+    const int population = 200000, lookups = 500000;
+    const string archive = "/tmp/hospital_bench_archive";
+    HospitalSystem H;
+    int nextId = 1;
+    for (; nextId <= population; ++nextId) H.patientUpsert(Patient{nextId, "Patient_" + to_string(nextId), 40, "Follow_up", 0});
+    BenchRng rng(31);
+    for (int round = 0; round < 4; ++round) {
+        BenchClock::time_point t0 = BenchClock::now();
+        size_t archived = H.archiveInactivePatients(population / 2, archive);
+        double archiveMs = msSince(t0);
+        double worstUs = 0;
+        for (size_t i = 0; i < archived; ++i, ++nextId) {
+            t0 = BenchClock::now();
+            H.patientUpsert(Patient{nextId, "Patient_" + to_string(nextId), 40, "Follow_up", 0});
+            worstUs = max(worstUs, msSince(t0) * 1000);
+        }
+        Patient out; size_t hits = 0;
+        t0 = BenchClock::now();
+        for (int i = 0; i < lookups; ++i) hits += H.patientGet(1 + rng.below(nextId), out);
+        double ns = msSince(t0) * 1e6 / lookups;
+        benchSink = hits;
+        size_t live, rows, dead;
+        H.patientStoreStats(live, rows, dead);
+        cout << "  round " << round << ": archived " << archived << " in " << archiveMs << " ms, live " << live << ", rows " << rows
+             << ", tombstones " << dead << ", worst register " << worstUs << " us, lookup " << ns << " ns\n";
+    }
+    remove(archive.c_str());
+}
+
+// Monte-Carlo clinic weeks: every slot is booked as far as the policy lets
+// the desk, then each booked patient shows with the bucket's true rate
+// (Monday morning and Friday afternoon are unreliable). Compares throughput
+// and slot overruns with overbooking off and on.
+static void benchOverbooking() {
+    cout << "[overbook] 40 simulated weeks, stats from the last 20\n";
+    const int doctorsN = 4, slotsPerDay = 32, weeks = 40;
+    auto showPerMille = [](int weekday, int hour) {
+        if ((weekday == 0 && hour < 11) || (weekday == 4 && hour >= 14)) return 500;
+        return 880;
+    };
+    OverbookPolicy on; on.maxPerSlot = 3; on.maxOvertimeRisk = 0.3; on.minSamples = 20;
+    for (int mode = 0; mode < 2; ++mode) {
+        HospitalSystem H;
+        if (mode) H.setOverbookPolicy(on);
+        for (int p = 1; p <= 1000; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), 40, "", 0});
+        for (int d = 1; d <= doctorsN; ++d) {
+            H.addDoctor(d, "Dr_" + to_string(d), "General", 8);
+            for (int day = 0; day < 5; ++day)
+                for (int i = 0; i < slotsPerDay; ++i) {
+                    int m = 9 * 60 + i * 15;
+                    char a[16], b[16];
+                    snprintf(a, sizeof(a), "%02d:%02d", m / 60, m % 60);
+                    snprintf(b, sizeof(b), "%02d:%02d", (m + 15) / 60, (m + 15) % 60);
+                    H.scheduleAddSlot(d, d * 1000 + day * 100 + i, a, b, day);
                 }
-                s = s->next;
+        }
+        BenchRng rng(41);
+        long seen = 0, used = 0, overruns = 0, extraPatients = 0, slots = 0, booked = 0;
+        int pid = 1;
+        for (int w = 0; w < weeks; ++w) {
+            bool measure = w >= weeks / 2;
+            for (int d = 1; d <= doctorsN; ++d)
+                for (int day = 0; day < 5; ++day)
+                    for (int i = 0; i < slotsPerDay; ++i) {
+                        int slotId = d * 1000 + day * 100 + i;
+                        int n = 0;
+                        while (H.enqueueRoutine(pid, d, slotId) != -1) { pid = pid % 1000 + 1; ++n; }
+                        if (measure) { booked += n; ++slots; }
+                    }
+            for (int d = 1; d <= doctorsN; ++d)
+                for (int day = 0; day < 5; ++day)
+                    for (int i = 0; i < slotsPerDay; ++i) {
+                        int slotId = d * 1000 + day * 100 + i, shows = 0;
+                        int hour = (9 * 60 + i * 15) / 60;
+                        Token t;
+                        while (H.slotTokenCount(d, slotId) > 0) {
+                            if ((int)rng.below(1000) < showPerMille(day, hour)) {
+                                if (!H.serveNext(d, t)) break; // slot already empty
+                                ++shows;
+                            } else if (!H.markNoShow(d, slotId)) break;
+                        }
+                        if (measure) {
+                            seen += shows; used += shows > 0;
+                            overruns += shows > 1; extraPatients += max(0, shows - 1);
+                        }
+                    }
+        }
+        double perWeek = weeks - weeks / 2;
+        cout << "  overbooking " << (mode ? "on " : "off") << ": " << (booked / perWeek) << " booked/wk, " << (seen / perWeek)
+             << " seen/wk, slot utilization " << (100.0 * used / slots) << "%, overrun slots " << (100.0 * overruns / slots)
+             << "% (" << (extraPatients * 15 / perWeek) << " overtime min/wk)\n";
+    }
+}
+
+// One doctor with a week of 5-minute slots; threads book half of them, each
+// asking for the first free slot after a random minute. Both arms are timed
+// to the end of the bookkeeping: the mutex arm applies each claim under the
+// lock, the CAS arm applies them all once the threads are done.
+static void benchConcurrentClaims() {
+    cout << "[claims] 1008 of 2016 slots booked by N threads, CAS claims vs one mutex\n";
+    const int rounds = 20;
+    for (int threads : {1, 2, 4, 8}) {
+        double ns[2] = {0, 0}, booked[2] = {0, 0}, applyNs = 0;
+        long lost = 0;
+        for (int mode = 0; mode < 2; ++mode)
+            for (int r = 0; r < rounds; ++r) {
+                HospitalSystem H;
+                H.addDoctor(1, "Dr_1", "General", 8);
+                for (int p = 1; p <= 64; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), 40, "", 0});
+                for (int day = 0, id = 0; day < 7; ++day)
+                    for (int m = 0; m < 1440; m += 5, ++id) {
+                        char a[16], b[16];
+                        snprintf(a, sizeof(a), "%02d:%02d", m / 60, m % 60);
+                        snprintf(b, sizeof(b), "%02d:%02d", (m + 5) / 60 % 24, (m + 5) % 60);
+                        if (m + 5 == 1440) snprintf(b, sizeof(b), "23:59");
+                        H.scheduleAddSlot(1, id, a, b, day);
+                    }
+                mutex mu;
+                atomic<long> lostRaces{0};
+                auto t0 = chrono::steady_clock::now();
+                vector<thread> pool;
+                for (int t = 0; t < threads; ++t)
+                    pool.emplace_back([&, t] {
+                        BenchRng rng(r * 16 + t + 1);
+                        int myLost = 0;
+                        Token tk;
+                        auto book = [&](int pid, int from) {
+                            if (mode == 0) return H.claimSlotAfter(pid, 1, from, tk, &myLost);
+                            lock_guard<mutex> g(mu);
+                            int got = H.claimSlotAfter(pid, 1, from, tk);
+                            H.applyConcurrentClaims();
+                            return got;
+                        };
+                        for (int i = 0; i < 1008 / threads; ++i) book(1 + rng.below(64), rng.below(6 * 1440));
+                        lostRaces += myLost;
+                    });
+                for (auto &th : pool) th.join();
+                auto t1 = chrono::steady_clock::now();
+                if (mode == 0) H.applyConcurrentClaims();
+                auto t2 = chrono::steady_clock::now();
+                ns[mode] += chrono::duration_cast<chrono::nanoseconds>(t2 - t0).count();
+                if (mode == 0) applyNs += chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count();
+                lost += lostRaces;
+                booked[mode] += H.pendingTotal();
             }
-            return false;
-        } else {
-            Token served = maybeTk;
-            ++servedCount; --pendingCountTotal;
-            Action act; act.type = SERVE; act.token = served; undoStack.push(act);
-            servedOut = served;
-            return true;
+        cout << "  " << threads << " thread(s): CAS " << (ns[0] / booked[0]) << " ns/booking, " << (applyNs / booked[0])
+             << " of it applying (" << (double)lost / rounds << " lost races/run), mutex " << (ns[1] / booked[1]) << " ns/booking\n";
+    }
+}
+
+// Serving from booked slots when only the later half of the week is
+// booked: the next slot comes off the doctor's timeline heap, so the cost
+// should not grow with the number of slots before it.
+static void benchTimeline() {
+    cout << "[timeline] serving slot appointments, later half of the week booked\n";
+    for (int slotsN : {64, 512, 2016}) {
+        HospitalSystem H;
+        H.addDoctor(1, "Dr_1", "General", 8);
+        for (int p = 1; p <= 64; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), 40, "", 0});
+        int step = 7 * 1440 / slotsN;
+        for (int i = 0; i < slotsN; ++i) {
+            int m = i * step % 1440;
+            char a[16], b[16];
+            snprintf(a, sizeof(a), "%02d:%02d", m / 60, m % 60);
+            snprintf(b, sizeof(b), "%02d:%02d", (m + step) / 60, (m + step) % 60);
+            if (m + step >= 1440) snprintf(b, sizeof(b), "23:59");
+            H.scheduleAddSlot(1, i, a, b, i * step / 1440);
         }
+        double ns = 0;
+        long served = 0;
+        Token t;
+        while (served < 200000) {
+            for (int i = slotsN / 2; i < slotsN; ++i) H.enqueueRoutine(1 + i % 64, 1, i);
+            auto t0 = chrono::steady_clock::now();
+            while (H.serveNext(1, t)) ++served;
+            ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+        }
+        cout << "  " << slotsN << " slots: " << (ns / served) << " ns per serve\n";
     }
+}
 
-    bool triageInsert(int patientId, int severity) {
-        if (!patients.count(patientId)) return false;
-        Token tk; tk.tokenId = nextTokenId++; tk.patientId = patientId; tk.doctorId = -1; tk.slotId = -1; tk.type = EMERGENCY;
-        triageHeap.push(TriagedToken{severity, tk});
-        Action act; act.type = TRIAGE_INSERT; act.token = tk; act.severity = severity; undoStack.push(act);
-        ++pendingCountTotal; ++patients[patientId].freq; return true;
+#ifdef __linux__
+// dTLB load misses of this thread in user space. open() fails where perf
+// events are not permitted or the CPU exposes no counters (many VMs).
+struct TlbMissCounter {
+    int fd = -1;
+    bool open() {
+        perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type = PERF_TYPE_HW_CACHE; pe.size = sizeof(pe);
+        pe.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        pe.disabled = 1; pe.exclude_kernel = 1; pe.exclude_hv = 1;
+        fd = (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+        return fd >= 0;
+    }
+    void start() { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); }
+    long long stop() {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        long long v = 0;
+        return read(fd, &v, sizeof(v)) == (ssize_t)sizeof(v) ? v : -1;
     }
+    ~TlbMissCounter() { if (fd >= 0) close(fd); }
+};
 
-    bool undoPop() {
-        if (undoStack.empty()) return false;
-        Action act = undoStack.top(); undoStack.pop();
-        switch (act.type) {
-            case BOOK: {
-                Token tk = act.token;
-                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
-                Doctor& D = dit->second;
-                if (tk.slotId != -1) {
-                    SlotNode* slot = D.findSlot(tk.slotId);
-                    if (slot && slot->taken && slot->tokenId == tk.tokenId) {
-                        slot->taken = false;
-                        slot->tokenId = -1;
-                        --pendingCountTotal;
-                        return true;
-                    }
-                } else {
-                    vector<Token> tmp;
-                    bool removed = false;
-                    Token ot;
-                    while (D.dequeueRoutine(ot)) {
-                        if (!removed && ot.tokenId == tk.tokenId) { removed = true; --pendingCountTotal; }
-                        else tmp.push_back(ot);
+// AnonHugePages of this process in KiB, or -1.
+static long anonHugePagesKb() {
+    FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) return -1;
+    char line[256]; long kb = -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+    fclose(fp);
+    return kb;
+}
+#endif
+
+// Random patient-table lookups over 2M prefaulted patients with the arenas
+// on 4 KiB pages, transparent huge pages and explicit huge pages.
+static void benchHugePages() {
+    cout << "[hugepages] random lookups in a 2M-patient table, arenas prefaulted\n";
+    static const char* kModeNames[] = { "4k pages   ", "transparent", "explicit   " };
+    const int n = 2000000, lookups = 4000000;
+    HugePageConfig saved = hugePageConfig();
+    BenchRng rng(17);
+    vector<int> probes(lookups);
+    for (int &p : probes) p = rng.below(n) * 7 + 1;
+    for (int mode = 0; mode < 3; ++mode) {
+        hugePageConfig().mode = (HugePageMode)mode;
+        hugePageConfig().prefault = true;
+        size_t fallbacks = hugePageStats().fallbacks;
+        PatientStore store;
+        store.reserve(n);
+        for (int i = 0; i < n; ++i) store.upsert(i * 7 + 1).age = i & 127;
+        cout << "  " << kModeNames[mode] << ": ";
+        if (hugePageStats().fallbacks != fallbacks) { cout << "no huge pages reserved (vm.nr_hugepages), skipped\n"; continue; }
+        long ageSum = 0;
+#ifdef __linux__
+        TlbMissCounter tlb;
+        bool counting = tlb.open();
+        if (counting) tlb.start();
+#endif
+        auto t0 = chrono::steady_clock::now();
+        for (int id : probes) ageSum += store.find(id)->age;
+        double ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+        cout << (ns / lookups) << " ns/lookup";
+#ifdef __linux__
+        if (counting) cout << ", " << ((double)tlb.stop() / lookups) << " dTLB misses/lookup";
+        else cout << ", dTLB misses n/a";
+        long kb = anonHugePagesKb();
+        if (kb >= 0) cout << ", " << kb / 1024 << " MB on transparent huge pages";
+#endif
+        cout << " (checksum " << ageSum % 1000 << ")\n";
+    }
+    hugePageConfig() = saved;
+}
+
+// A long shift of desk traffic with the whole undo history in memory vs
+// spilled beyond 4096 actions, then undone back to the start.
+static void benchUndoSpill() {
+    cout << "[undo] 400k desk operations, undo history in memory vs spilled past 4096\n";
+    const string path = "bench_undo.spill";
+    for (int mode = 0; mode < 2; ++mode) {
+        HospitalSystem H;
+        if (mode && !H.setUndoSpill(path, 4096)) { cout << "  cannot open " << path << "\n"; return; }
+        auto t0 = chrono::steady_clock::now();
+        simulateDeskDay(H, 8, 5000, 400000, 23);
+        double recordMs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count() / 1000.0;
+        size_t depth, inMemory; uint64_t spillBytes;
+        H.undoStats(depth, inMemory, spillBytes);
+        t0 = chrono::steady_clock::now();
+        size_t undone = 0;
+        while (H.undoPop()) ++undone;
+        double undoMs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count() / 1000.0;
+        cout << "  " << (mode ? "spilled  " : "in memory") << ": depth " << depth << ", " << inMemory << " in memory (~"
+             << inMemory * sizeof(Action) / 1024 << " KiB), " << spillBytes / 1024 << " KiB on disk"
+             << (depth > inMemory ? " (" + to_string(spillBytes / (depth - inMemory)) + " B/action)" : string())
+             << "; run " << recordMs << " ms, undo all " << undoMs << " ms (" << undone << " pops)\n";
+    }
+}
+
+// Mass-casualty surge: a burst of emergencies lands within a few serve rounds
+// while walk-ins keep arriving and every doctor keeps calling serveNext. Each
+// round is one serve per doctor; the run goes on until triage has drained.
+// Reports insert/pop latency, how long routine patients starve, and how far
+// the triage heap and the undo history grow, for bursts of rising size.
+static void benchSurge() {
+    cout << "[surge] emergency bursts over 10 rounds, 20 doctors, 10 walk-ins/round\n";
+    const int doctorsN = 20, patientsN = 20000, burstRounds = 10, walkInsPerRound = 10;
+    auto pct = [](vector<double>& v, int perMille) {
+        if (v.empty()) return 0.0;
+        size_t i = min(v.size() - 1, v.size() * perMille / 1000);
+        nth_element(v.begin(), v.begin() + i, v.end());
+        return v[i];
+    };
+    for (int burst : {1000, 5000, 20000, 100000}) {
+        for (int spill = 0; spill < 2; ++spill) {
+            if (spill && burst != 100000) continue;
+            HospitalSystem H;
+            const string path = "bench_surge.spill";
+            if (spill && !H.setUndoSpill(path, 4096)) { cout << "  cannot open " << path << "\n"; return; }
+            simulateDeskDay(H, doctorsN, patientsN, 0, 41);
+            BenchRng rng(burst);
+            vector<double> insertNs, popNs;
+            insertNs.reserve(burst); popNs.reserve(burst);
+            unordered_map<int, int> walkInRound; // tokenId -> round it arrived
+            FailCounts before = H.failureCounts();
+            size_t peakTriage = 0, peakTriageBytes = 0, peakUndo = 0, peakUndoMem = 0;
+            int round = 0, injected = 0, drainedAt = -1, maxWait = 0, starvedRounds = 0, routineServed = 0;
+            auto t0 = chrono::steady_clock::now();
+            while (drainedAt < 0 || round < drainedAt + 20) {
+                if (round < burstRounds) {
+                    int quota = (int)((long)burst * (round + 1) / burstRounds) - injected;
+                    for (int i = 0; i < quota; ++i, ++injected) {
+                        auto a = chrono::steady_clock::now();
+                        H.triageInsert(1 + rng.below(patientsN), 1 + rng.below(10));
+                        insertNs.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - a).count());
                     }
-                    for (auto &t: tmp) D.enqueueRoutine(t);
-                    return removed;
-                }
-                return false;
-            }
-            case CANCEL: {
-                auto dit = doctors.find(act.doctorId); if (dit == doctors.end()) return false;
-                Doctor& D = dit->second; SlotNode* slot = D.findSlot(act.slotId);
-                if (slot) { slot->taken = true; slot->tokenId = act.token.tokenId; ++pendingCountTotal; return true; }
-                return false;
-            }
-            case SERVE: {
-                Token tk = act.token;
-                if (tk.type == EMERGENCY) {
-                    triageHeap.push(TriagedToken{act.severity, tk});
-                    ++pendingCountTotal; --servedCount;
-                    return true;
-                } else {
-                    auto dit = doctors.find(tk.doctorId); if (dit == doctors.end()) return false;
-                    Doctor& D = dit->second; D.enqueueRoutine(tk);
-                    ++pendingCountTotal; --servedCount;
-                    return true;
                 }
-            }
-            case REGISTER_PATIENT: {
-                if (act.patientExistedBefore) {
-                    patients[act.patientIdForUpsert] = act.patientSnapshot;
-                } else {
-                    patients.erase(act.patientIdForUpsert);
+                for (int i = 0; i < walkInsPerRound; ++i) {
+                    int tid = H.enqueueRoutine(1 + rng.below(patientsN), 1 + rng.below(doctorsN));
+                    if (tid >= 0) walkInRound[tid] = round;
                 }
-                return true;
-            }
-            case TRIAGE_INSERT: {
-                int remId = act.token.tokenId; vector<TriagedToken> all;
-                bool removed = false;
-                while (!triageHeap.empty()) {
-                    TriagedToken t = triageHeap.top(); triageHeap.pop();
-                    if (!removed && t.token.tokenId == remId) { removed = true; --pendingCountTotal; }
-                    else all.push_back(t);
+                int routineThisRound = 0;
+                for (int d = 1; d <= doctorsN; ++d) {
+                    Token t;
+                    auto a = chrono::steady_clock::now();
+                    if (!H.serveNext(d, t)) continue;
+                    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - a).count();
+                    if (t.type == EMERGENCY) { popNs.push_back(ns); continue; }
+                    auto it = walkInRound.find(t.tokenId);
+                    if (it != walkInRound.end()) { maxWait = max(maxWait, round - it->second); walkInRound.erase(it); }
+                    ++routineThisRound;
                 }
-                for (auto &x: all) triageHeap.push(x);
-                return removed;
+                routineServed += routineThisRound;
+                if (!routineThisRound) ++starvedRounds;
+                size_t depth, bytes, undoDepth, undoMem; uint64_t spillBytes;
+                H.triageStats(depth, bytes);
+                H.undoStats(undoDepth, undoMem, spillBytes);
+                peakTriage = max(peakTriage, depth); peakTriageBytes = max(peakTriageBytes, bytes);
+                peakUndo = max(peakUndo, undoDepth); peakUndoMem = max(peakUndoMem, undoMem);
+                if (drainedAt < 0 && round >= burstRounds && !depth) drainedAt = round;
+                ++round;
             }
-            default: return false;
+            double ms = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count() / 1000.0;
+            FailCounts after = H.failureCounts();
+            cout << "  " << burst << " emergencies" << (spill ? ", undo spilled past 4096" : "") << ": drained after "
+                 << drainedAt << " rounds (" << ms << " ms)\n";
+            char line[160];
+            snprintf(line, sizeof(line), "    triage insert p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns; pop p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns\n",
+                     pct(insertNs, 500), pct(insertNs, 990), pct(insertNs, 999), pct(popNs, 500), pct(popNs, 990), pct(popNs, 999));
+            cout << line;
+            cout << "    routine: " << routineServed << " served, " << starvedRounds << " rounds with none, longest wait "
+                 << maxWait << " rounds, " << after[FAIL_QUEUE_FULL] - before[FAIL_QUEUE_FULL] << " walk-ins refused (queue full)\n";
+            cout << "    peak triage " << peakTriage << " (" << peakTriageBytes / 1024 << " KiB reserved), peak undo depth "
+                 << peakUndo << " (" << peakUndoMem << " in memory, ~" << peakUndoMem * sizeof(Action) / 1024 << " KiB)\n";
         }
     }
+}
 
-    void perDoctorReport(int doctorId) {
-        auto dit = doctors.find(doctorId);
-        if (dit == doctors.end()) { cout << "Doctor not found\n"; return; }
-        Doctor& D = dit->second;
-        cout << "Doctor: " << D.name << " (id " << D.id << "), Spec: " << D.specialization << "\n";
-        cout << "Pending routine queue: " << D.pendingCount() << "\n";
-        SlotNode* nf = D.nextFreeSlot();
-        if (nf) cout << "Next free slot: " << nf->slotId << " [" << nf->startTime << "-" << nf->endTime << "]\n";
-        else cout << "No free slots\n";
+// Refused bookings at a desk that is out of capacity, then the cost of the
+// counters themselves: per-thread blocks vs one shared atomic per reason.
+static void benchFailureCounters() {
+    cout << "[refusals] reasons for refused bookings, and counter cost per bump\n";
+    HospitalSystem H;
+    simulateDeskDay(H, 4, 500, 0, 31);
+    BenchRng rng(31);
+    FailCounts before = H.failureCounts();
+    for (int i = 0; i < 200000; ++i) {
+        int r = rng.below(100), doc = 1 + rng.below(5), pid = 1 + rng.below(520);
+        if (r < 60) H.enqueueRoutine(pid, doc);
+        else if (r < 90) H.enqueueRoutine(pid, doc, doc * 100 + rng.below(40));
+        else { Token t; H.serveNext(1 + rng.below(4), t); }
     }
-
-    void servedVsPendingSummary() { cout << "Served: " << servedCount << " | Pending: " << pendingCountTotal << "\n"; }
-
-    void topKFrequentPatients(int K) {
-        vector<pair<int,int>> arr;
-        for (auto &p : patients) arr.push_back({p.second.freq, p.first});
-        sort(arr.begin(), arr.end(), greater<>());
-        cout << "Top " << K << " frequent patients:\n";
-        for (int i = 0; i < K && i < (int)arr.size(); ++i) {
-            cout << "  PatientId " << arr[i].second << " freq " << arr[i].first << " name: " << patients[arr[i].second].name << "\n";
+    FailCounts after = H.failureCounts();
+    cout << " ";
+    for (int r = 1; r < FAIL_REASON_COUNT; ++r)
+        if (after[r] != before[r]) cout << " " << kFailReasonNames[r] << "=" << after[r] - before[r];
+    cout << "\n";
+    const int bumps = 2000000;
+    for (int threads : {1, 4}) {
+        double ns[2];
+        static atomic<uint64_t> shared[FAIL_REASON_COUNT];
+        for (int mode = 0; mode < 2; ++mode) {
+            auto t0 = chrono::steady_clock::now();
+            vector<thread> pool;
+            for (int t = 0; t < threads; ++t)
+                pool.emplace_back([mode] {
+                    for (int i = 0; i < bumps; ++i) {
+                        FailReason r = (FailReason)(FAIL_QUEUE_FULL + (i & 1));
+                        if (mode == 0) FailCounters::instance().bump(r);
+                        else shared[r].fetch_add(1, memory_order_relaxed);
+                    }
+                });
+            for (auto &th : pool) th.join();
+            ns[mode] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count() / (double)bumps / threads;
         }
+        cout << "  " << threads << " thread(s): per-thread " << ns[0] << " ns/bump, shared atomic " << ns[1] << " ns/bump\n";
     }
+}
 
-    void listDoctorSlots(int doctorId) {
-        auto it = doctors.find(doctorId);
-        if (it == doctors.end()) {
-            cout << "Doctor not found\n";
-            return;
+// Cost of the watchdog on fast operations, then one deliberately slow top-K.
+static void benchSlowOpWatch() {
+    cout << "[watch] enqueue+serve with the slow-op watchdog off vs on\n";
+    const int rounds = 2000000;
+    double ms[2];
+    for (int on = 0; on < 2; ++on) {
+        HospitalSystem H;
+        H.setSlowOpWatch(on != 0);
+        H.addDoctor(1, "Dr_Bench", "General", 64);
+        for (int p = 1; p <= 100; ++p) H.patientUpsert(Patient{p, "P" + to_string(p), 30, "", 0});
+        Token t;
+        BenchClock::time_point t0 = BenchClock::now();
+        for (int i = 0; i < rounds; ++i) { H.enqueueRoutine(1 + i % 100, 1); H.serveNext(1, t); }
+        ms[on] = msSince(t0);
+        if (on) {
+            streambuf* old = cout.rdbuf(nullptr); // silence the report itself
+            H.setSlowOpBudget(OP_TOPK, 0);
+            H.topKFrequentPatients(10);
+            cout.rdbuf(old);
+            cout << "  forced slow top-K:\n";
+            H.dumpSlowOps(cout);
         }
-        it->second.printSlots();
     }
+    cout << "  off " << (ms[0] * 1e6 / rounds) << " ns/round, on " << (ms[1] * 1e6 / rounds) << " ns/round\n";
+}
 
-    void seedSampleData() {
-        addDoctor(1, "Dr_Ahuja", "General", 5);
-        addDoctor(2, "Dr_Mehta", "Cardio", 5);
-        scheduleAddSlot(1, 101, "09:00", "09:15");
-        scheduleAddSlot(1, 102, "09:15", "09:30");
-        scheduleAddSlot(2, 201, "10:00", "10:15");
-        patientUpsert(Patient{1,"Ananya",22,"No_history",0});
-        patientUpsert(Patient{2,"Lakshita",19,"Allergy_pollen",0});
-        patientUpsert(Patient{3,"Saieena",21,"Asthma",0});
+// Walk-in traffic routed to four facility shards, in batches of 1000 calls
+// per task, against the same traffic through one HospitalSystem. Patients
+// come from the master index; crossFacilityReport must add up to what the
+// batches saw.
+static void benchNetwork() {
+    cout << "[network] walk-in traffic across facility shards vs one system\n";
+    const int facilities = 4, doctorsN = 10, patientsN = 5000, batches = 100, batch = 1000;
+    PatientMasterMap master;
+    for (int p = 1; p <= patientsN; ++p) master[p] = Patient{p, "Patient_" + to_string(p), 1 + p % 90, "", 0};
+    // One batch: enqueue a walk-in and serve one, per call; returns (enqueued, served).
+    auto drive = [](HospitalSystem& H, uint64_t seed) {
+        BenchRng rng(seed);
+        Token t;
+        int enqueued = 0, served = 0;
+        for (int i = 0; i < batch; ++i) {
+            if (H.enqueueRoutine(1 + rng.below(patientsN), 1 + rng.below(doctorsN)) != -1) ++enqueued;
+            if (rng.below(4) && H.serveNext(1 + rng.below(doctorsN), t)) ++served;
+        }
+        return make_pair(enqueued, served);
+    };
+    auto setUp = [&](HospitalSystem& H) {
+        for (int d = 1; d <= doctorsN; ++d) H.addDoctor(d, "Dr_" + to_string(d), "General", 4096);
+    };
+
+    HospitalSystem single;
+    setUp(single);
+    for (auto &kv : master) single.patientUpsert(kv.second);
+    BenchClock::time_point t0 = BenchClock::now();
+    for (int b = 0; b < batches * facilities; ++b) drive(single, 1 + b);
+    double singleMs = msSince(t0);
+
+    HospitalNetwork net;
+    for (int f = 1; f <= facilities; ++f) {
+        net.addFacility(f);
+        net.route(f, [&](HospitalSystem& H) { setUp(H); return true; }).get();
     }
-};
+    net.publishMasterIndex(master);
+    int registered = 0;
+    for (int f = 1; f <= facilities; ++f)
+        for (int p = 1; p <= patientsN; ++p) registered += net.registerFromMaster(f, p);
+    long enqueued = 0, served = 0;
+    t0 = BenchClock::now();
+    vector<future<pair<int, int>>> inFlight;
+    for (int b = 0; b < batches; ++b)
+        for (int f = 1; f <= facilities; ++f) {
+            uint64_t seed = 1 + b * facilities + (f - 1);
+            inFlight.push_back(net.route(f, [&drive, seed](HospitalSystem& H) { return drive(H, seed); }));
+        }
+    for (auto &fut : inFlight) { pair<int, int> r = fut.get(); enqueued += r.first; served += r.second; }
+    double netMs = msSince(t0);
+
+    vector<FacilityStats> stats = net.crossFacilityReport();
+    long reportServed = 0, reportPending = 0;
+    size_t reportPatients = 0;
+    for (auto &s : stats) { reportServed += s.served; reportPending += s.pending; reportPatients += s.patients; }
+    bool match = stats.size() == (size_t)facilities && reportServed == served && reportPending == enqueued - served
+                 && reportPatients == (size_t)registered && registered == facilities * patientsN;
+    double calls = (double)batches * facilities * batch;
+    cout << "  one system: " << (singleMs * 1e6 / calls) << " ns/call, " << facilities << " shards: " << (netMs * 1e6 / calls)
+         << " ns/call (" << thread::hardware_concurrency() << " hardware threads)\n";
+    cout << "  report: served " << reportServed << ", pending " << reportPending << ", patients " << reportPatients
+         << (match ? " (matches the routed calls)" : " (MISMATCH with the routed calls)") << "\n";
+}
+
+static void runBenchmarks() {
+    benchOpLog();
+    benchCheckpoints();
+    benchSlowOpWatch();
+    benchColdHistory();
+    benchPatientChurn();
+    benchOverbooking();
+    benchConcurrentClaims();
+    benchTimeline();
+    benchHugePages();
+    benchUndoSpill();
+    benchFailureCounters();
+    benchServePath();
+    benchSurge();
+    benchRoutineRings();
+    benchRoutineClasses();
+    benchCohorts();
+    benchGroupSession();
+    benchVisitHistory();
+    benchNetwork();
+#ifdef HOSPITAL_HAVE_SHM
+    benchShmRing();
+#endif
+#ifdef HOSPITAL_HAVE_MMAP
+    benchPersistentQueues();
+#endif
+}
 
 // ----------------------------- CLI -----------------------------
 void printMenu() {
     cout << "\n=== Hospital Appointment & Triage System ===\n";
-    cout << "1. Register/Update Patient\n2. Book Slot / Enqueue Routine\n3. Emergency In (Triage)\n4. Serve Next (doctor)\n5. Undo Last Action\n6. Reports\n7. List Doctor Slots\n8. Add Doctor\n9. Add Slot to Doctor\n0. Exit\nChoose option: ";
+    cout << "1. Register/Update Patient\n2. Book Slot / Enqueue Routine\n3. Emergency In (Triage)\n4. Serve Next (doctor)\n5. Undo Last Action\n6. Reports\n7. List Doctor Slots\n8. Add Doctor\n9. Add Slot to Doctor\n10. Mark No-Show\n11. Add Resource Availability\n12. Book Slot with Resources\n13. Add Doctor Availability\n14. Book Appointment (any length)\n15. Cancel / Complete Appointment\n16. Delete Patient\n17. Group Session (add / check in / serve)\n0. Exit\nChoose option: ";
 }
 
-int main() {
+int main(int argc, char** argv) {
     ios::sync_with_stdio(false);
     cin.tie(nullptr);
 
+    // Options come first: --hugepages=thp|explicit, --prefault, --undo-spill=<file>
+    string undoSpill;
+    while (argc > 1) {
+        string opt = argv[1];
+        if (opt.compare(0, 13, "--undo-spill=") == 0) undoSpill = opt.substr(13);
+        else if (opt == "--hugepages=thp") hugePageConfig().mode = HUGEPAGES_TRANSPARENT;
+        else if (opt == "--hugepages=explicit") hugePageConfig().mode = HUGEPAGES_EXPLICIT;
+        else if (opt == "--prefault") hugePageConfig().prefault = true;
+        else break;
+        ++argv; --argc;
+    }
+
+    if (argc > 1 && string(argv[1]) == "--bench") { runBenchmarks(); return 0; }
+#ifdef HOSPITAL_HAVE_SHM
+    if (argc > 2 && string(argv[1]) == "--shm-serve") {
+        // Headless server for local kiosks: ./hospital_system --shm-serve /hospital_cmd
+        HospitalSystem S; S.seedSampleData();
+        if (!undoSpill.empty() && !S.setUndoSpill(undoSpill)) cerr << "Cannot open undo spill file " << undoSpill << "\n";
+        ShmCommandServer server;
+        if (!server.open(argv[2])) { cerr << "Cannot create shared memory " << argv[2] << "\n"; return 1; }
+        cout << "Serving shared-memory clients on " << argv[2] << "\n";
+        atomic<bool> stop(false);
+        server.run(S, stop);
+        return 0;
+    }
+#endif
+
     HospitalSystem H;
     H.seedSampleData();
+    if (!undoSpill.empty() && !H.setUndoSpill(undoSpill)) cerr << "Cannot open undo spill file " << undoSpill << "\n";
 
     while (true) {
         printMenu();
@@ -446,8 +6195,9 @@ int main() {
         else if (opt == 2) {
             int pid, did; int slot = -1;
             cout << "Enter patientId doctorId (slotId or -1): "; cin >> pid >> did >> slot;
-            int tok = H.enqueueRoutine(pid, did, slot);
-            if (tok == -1) cout << "Booking failed (queue full/slot taken/invalid ids)\n"; else cout << "Booked tokenId: " << tok << "\n";
+            FailReason why;
+            int tok = H.enqueueRoutine(pid, did, slot, &why);
+            if (tok == -1) cout << "Booking failed: " << kFailReasonNames[why] << "\n"; else cout << "Booked tokenId: " << tok << "\n";
         }
         else if (opt == 3) {
             int pid, severity; cout << "Enter patientId severityScore (lower -> more urgent): "; cin >> pid >> severity;
@@ -463,11 +6213,17 @@ int main() {
             if (H.undoPop()) cout << "Undo successful\n"; else cout << "Nothing to undo or undo failed\n";
         }
         else if (opt == 6) {
-            cout << "Reports menu:\n1. Per doctor summary\n2. Served vs pending\n3. Top-K frequent\nChoose: ";
+            cout << "Reports menu:\n1. Per doctor summary\n2. Served vs pending\n3. Top-K frequent\n4. State checksum\n5. Slot utilization heatmap\n6. Slow operations\n7. Refused requests\n8. Cohorts\n9. Recent visits\nChoose: ";
             int r; cin >> r;
             if (r == 1) { int did; cout << "Enter doctorId: "; cin >> did; H.perDoctorReport(did); }
             else if (r == 2) H.servedVsPendingSummary();
             else if (r == 3) { int k; cin >> k; H.topKFrequentPatients(k); }
+            else if (r == 4) cout << "State checksum: " << hex << H.stateChecksum() << dec << "\n";
+            else if (r == 5) { string spec; cout << "Enter specialization: "; cin >> spec; H.utilizationHeatmap(spec); }
+            else if (r == 6) H.dumpSlowOps(cout);
+            else if (r == 7) H.failureReport(cout);
+            else if (r == 8) H.cohortReport(cout);
+            else if (r == 9) { int pid, k; cout << "Enter patientId count: "; cin >> pid >> k; H.visitReport(pid, max(k, 0), cout); }
         }
         else if (opt == 7) {
             int did; cout << "Enter doctorId: "; cin >> did;
@@ -487,6 +6243,71 @@ int main() {
             if (H.scheduleAddSlot(did, sid, s, e)) cout << "Slot added\n";
             else cout << "Slot add failed (doctor not found)\n";
         }
+        else if (opt == 10) {
+            int did, sid; cout << "Enter doctorId slotId: "; cin >> did >> sid;
+            if (H.markNoShow(did, sid)) cout << "No-show recorded\n"; else cout << "Failed (slot not booked)\n";
+        }
+        else if (opt == 11) {
+            int rid, day; string name, kind, s, e;
+            cout << "Enter resourceId name kind weekday(0=Mon) startTime endTime: ";
+            cin >> rid >> name >> kind >> day >> s >> e;
+            H.addResource(rid, name, kind);
+            if (H.resourceAddAvailability(rid, day, s, e)) cout << "Availability added\n"; else cout << "Failed (bad time range)\n";
+        }
+        else if (opt == 12) {
+            int pid, did, day, n; string from;
+            cout << "Enter patientId doctorId notBeforeWeekday notBeforeTime resourceCount resourceIds...: ";
+            cin >> pid >> did >> day >> from >> n;
+            vector<int> rids(max(n, 0)); for (auto &r : rids) cin >> r;
+            Token tk; FailReason why;
+            if (H.bookWithResources(pid, did, rids, max(0, weekMinute(day, from)), tk, &why) == -1) cout << "Booking failed: " << kFailReasonNames[why] << "\n";
+            else cout << "Booked tokenId " << tk.tokenId << " in slot " << tk.slotId << "\n";
+        }
+        else if (opt == 13) {
+            int did, day; string s, e;
+            cout << "Enter doctorId weekday(0=Mon) startTime endTime: "; cin >> did >> day >> s >> e;
+            if (H.doctorAddAvailability(did, day, s, e)) cout << "Availability added\n"; else cout << "Failed (doctor not found/bad range)\n";
+        }
+        else if (opt == 14) {
+            int pid, did, mins, day; string from;
+            cout << "Enter patientId doctorId durationMinutes notBeforeWeekday notBeforeTime: "; cin >> pid >> did >> mins >> day >> from;
+            Token tk; Appointment ap; FailReason why;
+            if (H.bookAppointment(pid, did, mins, max(0, weekMinute(day, from)), tk, &why) == -1) cout << "Booking failed: " << kFailReasonNames[why] << "\n";
+            else if (H.appointmentGet(tk.tokenId, ap))
+                cout << "Booked tokenId " << tk.tokenId << " " << kWeekdayNames[ap.start / 1440] << " minute " << ap.start % 1440
+                     << " for " << ap.end - ap.start << " min\n";
+        }
+        else if (opt == 15) {
+            int sub, tok; cout << "1. Cancel 2. Served 3. No-show; then appointment tokenId: "; cin >> sub >> tok;
+            bool ok = sub == 1 ? H.cancelAppointment(tok) : H.completeAppointment(tok, sub == 2);
+            if (ok) cout << (sub == 1 ? "Appointment cancelled\n" : sub == 2 ? "Appointment served\n" : "No-show recorded\n");
+            else cout << "Unknown appointment\n";
+        }
+        else if (opt == 16) {
+            int pid; cout << "Enter patientId: "; cin >> pid;
+            if (H.patientDelete(pid)) cout << "Patient deleted\n"; else cout << "Patient not found\n";
+        }
+        else if (opt == 17) {
+            int sub, did, sid; cout << "1. Add 2. Check in 3. Serve; then doctorId sessionId: "; cin >> sub >> did >> sid;
+            if (sub == 1) {
+                string s, e; int cap; cout << "Enter startTime endTime capacity: "; cin >> s >> e >> cap;
+                if (H.scheduleAddGroupSession(did, sid, s, e, cap)) cout << "Session added\n"; else cout << "Failed (doctor not found or session exists)\n";
+            } else if (sub == 2) {
+                int n; cout << "Enter count then patientIds: "; cin >> n;
+                vector<int> ids(max(n, 0));
+                for (int &id : ids) cin >> id;
+                FailReason why;
+                int in = H.groupCheckIn(did, sid, ids, &why);
+                if (in == -1) cout << "Check-in failed: " << kFailReasonNames[why] << "\n";
+                else cout << "Checked in " << in << " of " << ids.size() << (why ? string(" (first refusal: ") + kFailReasonNames[why] + ")" : "") << "\n";
+            } else if (sub == 3) {
+                int n; cout << "Enter how many to serve: "; cin >> n;
+                vector<Token> served;
+                int got = H.groupServe(did, sid, n, &served);
+                if (got == -1) cout << "Session not found\n";
+                else { cout << "Served " << got << ":"; for (auto &t : served) cout << " " << t.patientId; cout << "\n"; }
+            }
+        }
     }
 
     return 0;